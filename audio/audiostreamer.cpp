@@ -1,5 +1,7 @@
 #include "audiostreamer.h"
+#include "common.h"
 #include <QDebug>
+#include <QElapsedTimer>
 #include <iostream>
 
 AudioStreamer::AudioStreamer(QObject *parent):
@@ -8,10 +10,12 @@ AudioStreamer::AudioStreamer(QObject *parent):
     setupAudioFormat();
     initializeFFTW();
 
+    m_endOfTurn.setSampleRate(m_formatInput.sampleRate());
+
 
     // Initialize the timer
     m_delayTimer = new QTimer(this);
-    m_delayTimer->setInterval(1000);  // 1 second delay
+    m_delayTimer->setInterval(EndOfTurnDetector::MaxHangoverMs);
     m_delayTimer->setSingleShot(true);  // Ensure the timer only fires once
     connect(m_delayTimer, &QTimer::timeout, this, &AudioStreamer::onDelayTimerTimeout);
 }
@@ -20,6 +24,8 @@ AudioStreamer::~AudioStreamer()
 {
     stopStreaming();
     cleanupFFTW();
+
+    delete m_recorder;
 }
 
 void  AudioStreamer::startStreaming()
@@ -104,61 +110,88 @@ void  AudioStreamer::setSpeechThreshold(double newSpeechThreshold)
     m_speechThreshold = newSpeechThreshold;
 }
 
-void  AudioStreamer::handleAudioData()
+bool  AudioStreamer::setSessionRecording(const QString &fileName)
 {
-    // Read audio data from the input device
-    QByteArray  audioData = m_audioInputDevice->readAll();
+    delete m_recorder;
+    m_recorder = nullptr;
 
-    if (audioData.isEmpty())
+    if (fileName.isEmpty())
     {
-        return;
+        return true;
     }
 
-    if (m_ignore < 10)
+    if ((m_formatInput.sampleRate() != COMMON_SAMPLE_RATE) || (m_formatInput.channelCount() != 1) ||
+        (m_formatInput.sampleFormat() != QAudioFormat::Float))
     {
-        m_ignore++;
+        qWarning() << "Session recording needs 16 kHz mono float input";
 
-        return;
+        return false;
     }
 
-    // Convert raw PCM data to float samples
-    const float *rawData     = reinterpret_cast<const float *>(audioData.data());
-    int          sampleCount = audioData.size() / sizeof(float);
+    m_recorder = new wav_writer();
 
-    // Ensure the sample count matches the FFT size
-    if (sampleCount > m_fftwSize)
+    if (!m_recorder->open(fileName.toStdString(), COMMON_SAMPLE_RATE, 16, 1))
     {
-        sampleCount = m_fftwSize;  // Truncate if necessary
+        qWarning() << "Failed to open session recording" << fileName;
+        delete m_recorder;
+        m_recorder = nullptr;
+
+        return false;
     }
 
-    pcmf32.reserve(pcmf32.size() + sampleCount);
-    pcmf32.insert(pcmf32.end(), rawData, rawData + sampleCount);
+    return true;
+}
+
+void  AudioStreamer::setPartialTranscript(const QString &text, bool endOfSpeech)
+{
+    if (!endOfSpeech || !m_isDelaying)
+    {
+        return;
+    }
+
+    m_endOfTurn.setTranscript(text);
+
+    const qint64  remaining = m_endOfTurn.hangoverMs() - m_silence.elapsed();
 
+    if (remaining <= 0)
+    {
+        m_delayTimer->stop();
+        onDelayTimerTimeout();
+    }
+    else
+    {
+        m_delayTimer->start(remaining);
+    }
+}
+
+double  AudioStreamer::frameLevel(const float *data, int count, std::vector<double> &magnitudes)
+{
     // Fill the input array with the audio data
-    for (int i = 0; i < sampleCount; ++i)
+    for (int i = 0; i < count; ++i)
     {
-        m_fftwIn[i][0] = rawData[i];  // Real part
-        m_fftwIn[i][1] = 0.0;         // Imaginary part (set to 0 for real input)
+        m_fftwIn[i][0] = data[i];  // Real part
+        m_fftwIn[i][1] = 0.0;      // Imaginary part (set to 0 for real input)
+    }
+
+    for (int i = count; i < m_fftwSize; ++i)
+    {
+        m_fftwIn[i][0] = 0.0;
+        m_fftwIn[i][1] = 0.0;
     }
 
     // Execute the FFT
     fftw_execute(m_fftwPlan);
 
     // Process the FFT output (m_fftwOut array contains the frequency domain data)
-    int                  s = m_fftwSize / 2.0;
-    std::vector<double>  magnitudes(s);
-    double               maxMagnitude           = 0.0;
-    double               maxMagnitudeWithOffset = 0.0;  // Reset the offset maximum magnitude
+    int     s                      = m_fftwSize / 2.0;
+    double  maxMagnitudeWithOffset = 0.0;
+
+    magnitudes.resize(s);
 
     for (int i = 0; i < s; ++i)
     {
         magnitudes[i] = sqrt(m_fftwOut[i][0] * m_fftwOut[i][0] + m_fftwOut[i][1] * m_fftwOut[i][1]);
 
-        if (magnitudes[i] > maxMagnitude)
-        {
-            maxMagnitude = magnitudes[i];
-        }
-
         // Calculate the maximum magnitude with an offset of 10
         if ((i >= 10) && (magnitudes[i] > maxMagnitudeWithOffset))
         {
@@ -166,6 +199,169 @@ void  AudioStreamer::handleAudioData()
         }
     }
 
+    return maxMagnitudeWithOffset;
+}
+
+AudioStreamer::TurnEvaluation  AudioStreamer::evaluateEndOfTurn(const QStringList &files, int baselineMs,
+                                                                const std::function<QString(const std::vector<float> &)> &transcribe)
+{
+    TurnEvaluation       total;
+    std::vector<double>  magnitudes;
+
+    for (const QString &file : files)
+    {
+        std::vector<float>               pcm;
+        std::vector<std::vector<float>>  pcms;
+
+        if (!read_wav(file.toStdString(), pcm, pcms, false))
+        {
+            qWarning() << "Failed to read session" << file;
+            continue;
+        }
+
+        // the VAD decision for every block, as handleAudioData() makes it
+        const double       blockMs = 1000.0 * m_fftwSize / COMMON_SAMPLE_RATE;
+        std::vector<bool>  speaking;
+
+        for (size_t i = 0; i + m_fftwSize <= pcm.size(); i += m_fftwSize)
+        {
+            speaking.push_back(frameLevel(pcm.data() + i, m_fftwSize, magnitudes) > m_speechThreshold);
+        }
+
+        EndOfTurnDetector  detector(COMMON_SAMPLE_RATE);
+        TurnEvaluation     session;
+        size_t             utterance = 0;   // first sample of the current utterance
+
+        for (size_t b = 0; b < speaking.size(); ++b)
+        {
+            const float *block = pcm.data() + b * m_fftwSize;
+
+            if (speaking[b])
+            {
+                detector.addFrame(block, m_fftwSize, true);
+                continue;
+            }
+
+            if ((b == 0) || !speaking[b - 1])
+            {
+                continue;
+            }
+
+            // silence starts, see how long it lasts
+            size_t  end = b;
+
+            while (end < speaking.size() && !speaking[end])
+            {
+                end++;
+            }
+
+            const double  gapMs    = (end - b) * blockMs;
+            const bool    turnEnd  = (gapMs >= baselineMs) || (end == speaking.size());
+            int           hangover = detector.hangoverMs();
+
+            // the transcript only counts if it arrives before the acoustic decision
+            if (transcribe)
+            {
+                QElapsedTimer  timer;
+
+                timer.start();
+
+                const QString  text   = transcribe(std::vector<float>(pcm.begin() + utterance, pcm.begin() + b * m_fftwSize));
+                const int      textMs = int(timer.elapsed());
+
+                if (textMs < hangover)
+                {
+                    detector.setTranscript(text);
+                    hangover = std::max(textMs, detector.hangoverMs());
+                }
+            }
+
+            if (turnEnd)
+            {
+                session.turns++;
+                session.savedMs += baselineMs - hangover;
+            }
+            else
+            {
+                session.pauses++;
+
+                if (hangover <= gapMs)
+                {
+                    session.prematureCuts++;
+                }
+                else
+                {
+                    detector.addPause(qRound(gapMs));
+                }
+            }
+
+            // a turn that ended, rightly or not, starts a new utterance
+            if (turnEnd || (hangover <= gapMs))
+            {
+                detector.reset();
+                utterance = end * m_fftwSize;
+            }
+
+            b = end - 1;
+        }
+
+        qDebug().nospace() << "end of turn " << file << ": " << session.turns << " turns, "
+                           << (session.turns ? session.savedMs / session.turns : 0.0) << " ms saved per turn, "
+                           << session.prematureCuts << " of " << session.pauses << " pauses cut";
+
+        total.turns         += session.turns;
+        total.pauses        += session.pauses;
+        total.prematureCuts += session.prematureCuts;
+        total.savedMs       += session.savedMs;
+    }
+
+    const int  utterances = total.turns + total.prematureCuts;
+
+    qDebug().nospace() << "end of turn: " << total.turns << " turns, "
+                       << (total.turns ? total.savedMs / total.turns : 0.0) << " ms saved per turn, premature cut rate "
+                       << (utterances ? 100.0 * total.prematureCuts / utterances : 0.0) << "%";
+
+    return total;
+}
+
+void  AudioStreamer::handleAudioData()
+{
+    // Read audio data from the input device
+    QByteArray  audioData = m_audioInputDevice->readAll();
+
+    if (audioData.isEmpty())
+    {
+        return;
+    }
+
+    if (m_ignore < 10)
+    {
+        m_ignore++;
+
+        return;
+    }
+
+    // Convert raw PCM data to float samples
+    const float *rawData     = reinterpret_cast<const float *>(audioData.data());
+    int          sampleCount = audioData.size() / sizeof(float);
+
+    // Ensure the sample count matches the FFT size
+    if (sampleCount > m_fftwSize)
+    {
+        sampleCount = m_fftwSize;  // Truncate if necessary
+    }
+
+    pcmf32.reserve(pcmf32.size() + sampleCount);
+    pcmf32.insert(pcmf32.end(), rawData, rawData + sampleCount);
+
+    if (m_recorder)
+    {
+        m_recorder->write(rawData, sampleCount);
+    }
+
+    std::vector<double>  magnitudes;
+    double               maxMagnitudeWithOffset = frameLevel(rawData, sampleCount, magnitudes);
+
     // Emit the processed audio data
     emit  audioDataProcessed(magnitudes);
     // emit  audioDataLevel(maxMagnitude);
@@ -182,10 +378,13 @@ void  AudioStreamer::handleAudioData()
         {
             m_delayTimer->stop();
             m_isDelaying = false;
+            m_endOfTurn.addPause(m_silence.elapsed());
         }
         else
         {
             pcmf32.clear();
+            m_partialSize = 0;
+            m_endOfTurn.reset();
         }
 
         emit  userStartedSpeaking();
@@ -198,10 +397,26 @@ void  AudioStreamer::handleAudioData()
         // Start the delay timer if it's not already running
         if (!m_isDelaying)
         {
-            m_delayTimer->start();
+            m_delayTimer->start(m_endOfTurn.hangoverMs());
+            m_silence.start();
             m_isDelaying = true;
         }
+
+        // likely the whole utterance, its transcript also tells the
+        // end-of-turn detector whether the sentence is finished
+        if (m_partialInterval > 0)
+        {
+            m_partialSize = pcmf32.size();
+            emit  audioDataPartial(pcmf32, true);
+        }
+    }
+    else if (m_isSpeaking && (m_partialInterval > 0) && (pcmf32.size() >= m_partialSize + m_partialInterval))
+    {
+        m_partialSize = pcmf32.size();
+        emit  audioDataPartial(pcmf32, false);
     }
+
+    m_endOfTurn.addFrame(rawData, sampleCount, m_isSpeaking);
 }
 
 void  AudioStreamer::onDelayTimerTimeout()
@@ -209,10 +424,13 @@ void  AudioStreamer::onDelayTimerTimeout()
     // If the user is still not speaking after the delay, emit userStoppedSpeaking
     if (!m_isSpeaking)
     {
+        qDebug() << "end of turn after" << m_silence.elapsed() << "ms of silence";
+
         emit  userStoppedSpeaking();
         emit  audioDataRaw(pcmf32);
 
         pcmf32.clear();
+        m_partialSize = 0;
     }
 
     // Reset the delay flag
@@ -9,6 +9,11 @@
 #include <QThread>
 #include <fftw3.h>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <functional>
+#include "endofturndetector.h"
+
+class wav_writer;
 
 class AudioStreamer: public QObject
 {
@@ -27,6 +32,28 @@ public:
 
     void    setSpeechThreshold(double newSpeechThreshold);
 
+    // Keep the microphone audio the VAD sees, for evaluateEndOfTurn().
+    bool    setSessionRecording(const QString &fileName);
+
+    struct TurnEvaluation
+    {
+        int     turns         = 0;
+        int     pauses        = 0;    // silences the user talked on after
+        int     prematureCuts = 0;    // pauses the detector would have ended the turn in
+        double  savedMs       = 0.0;  // against the fixed hangover, summed over turns
+    };
+
+    // Replays recorded 16 kHz sessions through the VAD and the end-of-turn
+    // detector. Silences of baselineMs or more count as turn ends, as they do
+    // with the fixed hangover; transcribe, if given, supplies the text cue and
+    // its latency.
+    TurnEvaluation  evaluateEndOfTurn(const QStringList &files, int baselineMs = 1000,
+                                      const std::function<QString(const std::vector<float> &)> &transcribe = nullptr);
+
+public slots:
+    // Text cue for the silence in progress, from the partial transcript.
+    void    setPartialTranscript(const QString &text, bool endOfSpeech);
+
 signals:
     void    userStartedSpeaking();
 
@@ -36,6 +63,11 @@ signals:
 
     void    audioDataRaw(std::vector<float>);
 
+    // The utterance so far, every few seconds while the user speaks and once
+    // when the silence starts (endOfSpeech), before audioDataRaw() delivers
+    // it after the hangover.
+    void    audioDataPartial(std::vector<float>, bool endOfSpeech);
+
     void    audioDataLevel(double);
 
 private slots:
@@ -51,6 +83,9 @@ private:
 
     void    cleanupFFTW();
 
+    // FFT of one block, returns the level the VAD compares to the threshold
+    double  frameLevel(const float *data, int count, std::vector<double> &magnitudes);
+
 private:
     QAudioSource *m_audioSource      = nullptr;
     QIODevice    *m_audioInputDevice = nullptr;
@@ -71,10 +106,19 @@ private:
     int     m_ignore          = 0;
 
 
-    // Timer for one-second delay
+    // Hangover timer, the end-of-turn detector sets its interval
     QTimer *m_delayTimer = nullptr;
     // Flag to track if we're in the delay period
     bool  m_isDelaying = false;
+
+    EndOfTurnDetector  m_endOfTurn;
+    QElapsedTimer      m_silence;
+
+    wav_writer *m_recorder = nullptr;
+
+    // Samples between partial utterances, 0 disables them
+    size_t  m_partialInterval = 2 * 16000;
+    size_t  m_partialSize     = 0;
 };
 
 #endif // AUDIOSTREAMER_H
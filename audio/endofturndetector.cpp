@@ -0,0 +1,324 @@
+#include "endofturndetector.h"
+#include <QSet>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+// speech kept for the acoustic cues
+constexpr float  HistoryMs = 3000.0f;
+// end of the utterance compared against the rest of it
+constexpr float  TailMs = 320.0f;
+// pauses needed before they replace the default floor
+constexpr int  MinPauses      = 8;
+constexpr int  MaxPauses      = 64;
+constexpr int  DefaultFloorMs = 500;
+
+double  median(std::vector<float> &values)
+{
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+
+    return values[values.size() / 2];
+}
+
+// words a finished sentence does not end with
+const QSet<QString>  &trailingWords()
+{
+    static const QSet<QString>  words =
+    {
+        "and", "or", "but", "so", "because", "if", "then", "that", "which", "the", "a", "an", "of", "to",
+        "with", "for", "in", "on", "at", "from", "is", "are", "was", "um", "uh", "like",
+        "و", "یا", "اما", "ولی", "که", "چون", "تا", "اگر", "با", "از", "به", "در", "برای", "را", "این", "آن",
+        "هم", "یعنی"
+    };
+
+    return words;
+}
+
+// common last words of a finished Persian question or request
+const QSet<QString>  &finalWords()
+{
+    static const QSet<QString>  words =
+    {
+        "است", "هست", "نیست", "چیست", "کجاست", "چطوره", "چنده", "چقدره", "چیه", "بگو", "بده", "کن", "شد"
+    };
+
+    return words;
+}
+}
+
+EndOfTurnDetector::EndOfTurnDetector(int sampleRate):
+    m_sampleRate(sampleRate)
+{
+}
+
+void  EndOfTurnDetector::setSampleRate(int sampleRate)
+{
+    m_sampleRate = sampleRate;
+}
+
+void  EndOfTurnDetector::reset()
+{
+    m_frames.clear();
+    m_framesMs = 0;
+    m_textCue  = -1.0;
+}
+
+void  EndOfTurnDetector::addFrame(const float *pcm, int count, bool speaking)
+{
+    if (!speaking || (count <= 0))
+    {
+        return;
+    }
+
+    double  sum = 0.0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        sum += pcm[i] * pcm[i];
+    }
+
+    Frame  frame;
+
+    frame.energyDb = 10.0f * std::log10(float(sum / count) + 1e-10f);
+    frame.pitchHz  = estimatePitch(pcm, count);
+    frame.ms       = 1000.0f * count / m_sampleRate;
+
+    m_frames.push_back(frame);
+    m_framesMs += frame.ms;
+
+    while (m_framesMs - m_frames.front().ms > HistoryMs)
+    {
+        m_framesMs -= m_frames.front().ms;
+        m_frames.pop_front();
+    }
+}
+
+void  EndOfTurnDetector::addPause(int ms)
+{
+    // shorter gaps are the VAD flickering inside a word
+    if (ms < MinHangoverMs / 2)
+    {
+        return;
+    }
+
+    m_pauses.push_back(ms);
+
+    if (int(m_pauses.size()) > MaxPauses)
+    {
+        m_pauses.pop_front();
+    }
+}
+
+void  EndOfTurnDetector::setTranscript(const QString &text)
+{
+    m_textCue = textCue(text);
+}
+
+int  EndOfTurnDetector::hangoverMs() const
+{
+    // a sentence cut in the middle always gets the full wait
+    if (m_textCue == 0.0)
+    {
+        return MaxHangoverMs;
+    }
+
+    double  acoustic = 0.0;
+    int     cues     = 0;
+
+    for (double cue : { energyCue(), pitchCue() })
+    {
+        if (cue >= 0.0)
+        {
+            acoustic += cue;
+            cues++;
+        }
+    }
+
+    acoustic = cues ? acoustic / cues : 0.5;
+
+    const double  p  = (m_textCue < 0.0) ? acoustic : 0.4 * acoustic + 0.6 * m_textCue;
+    int           ms = qRound(MaxHangoverMs - p * (MaxHangoverMs - MinHangoverMs));
+
+    // unless the text says it is done, wait out the pauses this speaker
+    // usually makes inside a turn
+    if (m_textCue < 0.9)
+    {
+        ms = std::max(ms, pauseFloorMs());
+    }
+
+    return std::clamp(ms, MinHangoverMs, MaxHangoverMs);
+}
+
+double  EndOfTurnDetector::textCue(const QString &text)
+{
+    QString  t = text.trimmed();
+
+    if (t.isEmpty())
+    {
+        return -1.0;
+    }
+
+    const QChar  last = t.back();
+
+    if ((last == '?') || (last == QChar(0x061F)))
+    {
+        return 1.0;
+    }
+
+    if ((last == ',') || (last == QChar(0x060C)) || t.endsWith("..."))
+    {
+        return 0.0;
+    }
+
+    const double  punctuated = ((last == '.') || (last == '!')) ? 0.8 : 0.5;
+
+    while (!t.isEmpty() && (t.back().isPunct() || t.back().isSpace()))
+    {
+        t.chop(1);
+    }
+
+    const QString  word = t.mid(t.lastIndexOf(' ') + 1).toLower();
+
+    if (trailingWords().contains(word))
+    {
+        return 0.0;
+    }
+
+    if (finalWords().contains(word))
+    {
+        return std::max(punctuated, 0.9);
+    }
+
+    return punctuated;
+}
+
+float  EndOfTurnDetector::estimatePitch(const float *pcm, int count) const
+{
+    // normalized autocorrelation over the 60-400 Hz range of speech
+    const int  minLag = m_sampleRate / 400;
+    const int  maxLag = std::min(m_sampleRate / 60, count / 2);
+
+    if (maxLag <= minLag)
+    {
+        return 0.0f;
+    }
+
+    double  energy = 0.0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        energy += pcm[i] * pcm[i];
+    }
+
+    if (energy <= 1e-8)
+    {
+        return 0.0f;
+    }
+
+    double  best    = 0.0;
+    int     bestLag = 0;
+
+    for (int lag = minLag; lag <= maxLag; ++lag)
+    {
+        double  r = 0.0;
+
+        for (int i = 0; i + lag < count; ++i)
+        {
+            r += pcm[i] * pcm[i + lag];
+        }
+
+        r /= energy * (count - lag) / count;
+
+        if (r > best)
+        {
+            best    = r;
+            bestLag = lag;
+        }
+    }
+
+    // weak periodicity is noise or an unvoiced sound
+    return (best > 0.45) ? float(m_sampleRate) / bestLag : 0.0f;
+}
+
+double  EndOfTurnDetector::energyCue() const
+{
+    std::vector<float>  body;
+    double              tail    = 0.0;
+    int                 tailN   = 0;
+    float               elapsed = 0.0f;
+
+    for (auto it = m_frames.rbegin(); it != m_frames.rend(); ++it)
+    {
+        if (elapsed < TailMs)
+        {
+            tail += it->energyDb;
+            tailN++;
+        }
+        else
+        {
+            body.push_back(it->energyDb);
+        }
+
+        elapsed += it->ms;
+    }
+
+    if ((tailN < 2) || (body.size() < 3))
+    {
+        return -1.0;
+    }
+
+    // a 10 dB fade is a sentence ending, a flat level a pause for breath
+    const double  dropDb = median(body) - tail / tailN;
+
+    return std::clamp(dropDb / 10.0, 0.0, 1.0);
+}
+
+double  EndOfTurnDetector::pitchCue() const
+{
+    std::vector<float>  body;
+    std::vector<float>  tail;
+    float               elapsed = 0.0f;
+
+    for (auto it = m_frames.rbegin(); it != m_frames.rend(); ++it)
+    {
+        if (it->pitchHz > 0.0f)
+        {
+            (elapsed < TailMs ? tail : body).push_back(it->pitchHz);
+        }
+
+        elapsed += it->ms;
+    }
+
+    if (tail.empty() || (body.size() < 3))
+    {
+        return -1.0;
+    }
+
+    const double  semitones = 12.0 * std::log2(median(tail) / median(body));
+
+    // a falling pitch ends a statement, a clear rise a question, a level
+    // pitch keeps the floor
+    if (semitones < 0.0)
+    {
+        return std::clamp(-semitones / 4.0, 0.0, 1.0);
+    }
+
+    return 0.6 * std::clamp(semitones / 4.0, 0.0, 1.0);
+}
+
+int  EndOfTurnDetector::pauseFloorMs() const
+{
+    if (int(m_pauses.size()) < MinPauses)
+    {
+        return DefaultFloorMs;
+    }
+
+    std::vector<int>  pauses(m_pauses.begin(), m_pauses.end());
+    const size_t      p90 = pauses.size() * 9 / 10;
+
+    std::nth_element(pauses.begin(), pauses.begin() + p90, pauses.end());
+
+    return std::min(qRound(pauses[p90] * 1.1), MaxHangoverMs);
+}
@@ -0,0 +1,64 @@
+#ifndef ENDOFTURNDETECTOR_H
+#define ENDOFTURNDETECTOR_H
+
+#include <QString>
+#include <deque>
+
+// Predicts how long to wait after the user goes quiet before the utterance is
+// treated as finished. Combines the energy decay and pitch movement at the end
+// of the speech, the pauses this speaker makes inside a turn, and the partial
+// transcript (a complete question vs a trailing "and ...").
+class EndOfTurnDetector
+{
+public:
+    static constexpr int  MinHangoverMs = 200;
+    static constexpr int  MaxHangoverMs = 1500;
+
+    explicit EndOfTurnDetector(int sampleRate = 16000);
+
+    void    setSampleRate(int sampleRate);
+
+    // Forget the current utterance, the learnt pauses are kept.
+    void    reset();
+
+    // One block of microphone audio and the VAD decision for it.
+    void    addFrame(const float *pcm, int count, bool speaking);
+
+    // The user went on talking after a pause of this length.
+    void    addPause(int ms);
+
+    // Latest partial transcript of the current utterance.
+    void    setTranscript(const QString &text);
+
+    // Silence needed before the turn ends, between MinHangoverMs and MaxHangoverMs.
+    int     hangoverMs() const;
+
+    // 0 the user is in the middle of a sentence, 1 the text reads as finished,
+    // negative when there is nothing to judge.
+    static double  textCue(const QString &text);
+
+private:
+    struct Frame
+    {
+        float  energyDb;
+        float  pitchHz;  // 0 when unvoiced
+        float  ms;
+    };
+
+    float   estimatePitch(const float *pcm, int count) const;
+
+    double  energyCue() const;
+
+    double  pitchCue() const;
+
+    int     pauseFloorMs() const;
+
+private:
+    int                m_sampleRate;
+    std::deque<Frame>  m_frames;           // speech of the current utterance, last few seconds
+    float              m_framesMs = 0;
+    std::deque<int>    m_pauses;           // recent pauses inside turns
+    double             m_textCue  = -1.0;
+};
+
+#endif // ENDOFTURNDETECTOR_H
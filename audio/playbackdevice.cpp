@@ -0,0 +1,153 @@
+#include "playbackdevice.h"
+
+#include <cstring>
+
+PlaybackDevice::PlaybackDevice(size_t capacity, QAudioFormat::SampleFormat format, QObject *parent):
+    QIODevice(parent)
+{
+    if (format == QAudioFormat::Float)
+    {
+        m_floatRing = std::make_unique<SpscRing<float>>(capacity);
+    }
+    else
+    {
+        m_ring = std::make_unique<SpscRing<int16_t>>(capacity);
+    }
+}
+
+bool  PlaybackDevice::isFloat() const
+{
+    return m_floatRing != nullptr;
+}
+
+void  PlaybackDevice::beginStream()
+{
+    m_streaming = true;
+}
+
+bool  PlaybackDevice::writeSamples(const int16_t *samples, size_t count, const std::atomic<bool> &cancel)
+{
+    Q_ASSERT(m_ring);
+
+    return push(*m_ring, samples, count, cancel);
+}
+
+bool  PlaybackDevice::writeSamples(const float *samples, size_t count, const std::atomic<bool> &cancel)
+{
+    Q_ASSERT(m_floatRing);
+
+    return push(*m_floatRing, samples, count, cancel);
+}
+
+template<typename Sample>
+bool  PlaybackDevice::push(SpscRing<Sample> &ring, const Sample *samples, size_t count, const std::atomic<bool> &cancel)
+{
+    size_t  written = 0;
+
+    while (written < count)
+    {
+        written += ring.push(samples + written, count - written);
+
+        if (written < count)
+        {
+            if (cancel)
+            {
+                return false;
+            }
+
+            // each pull makes room, the timeout only covers a stopped sink
+            m_room.tryAcquire(1, 100);
+        }
+    }
+
+    // wakes the sink up if it went idle
+    emit  readyRead();
+
+    return true;
+}
+
+void  PlaybackDevice::endStream()
+{
+    m_streaming = false;
+}
+
+void  PlaybackDevice::cancel()
+{
+    // only the consumer moves the read index, so the flush waits for its pull
+    m_flushTo   = m_floatRing ? m_floatRing->mark() : m_ring->mark();
+    m_streaming = false;
+    m_room.release();
+}
+
+int  PlaybackDevice::underruns() const
+{
+    return m_underruns;
+}
+
+bool  PlaybackDevice::isSequential() const
+{
+    return true;
+}
+
+qint64  PlaybackDevice::bytesAvailable() const
+{
+    const size_t  bytes = m_floatRing ? m_floatRing->size() * sizeof(float) : m_ring->size() * sizeof(int16_t);
+
+    return qint64(bytes) + QIODevice::bytesAvailable();
+}
+
+qint64  PlaybackDevice::readData(char *data, qint64 maxSize)
+{
+    return m_floatRing ? pop(*m_floatRing, data, maxSize) : pop(*m_ring, data, maxSize);
+}
+
+template<typename Sample>
+qint64  PlaybackDevice::pop(SpscRing<Sample> &ring, char *data, qint64 maxSize)
+{
+    const size_t  wanted  = size_t(maxSize) / sizeof(Sample);
+    const size_t  flushTo = m_flushTo.exchange(0);
+
+    if (flushTo)
+    {
+        ring.discardTo(flushTo);
+    }
+
+    const size_t  n = ring.pop(reinterpret_cast<Sample *>(data), wanted);
+
+    if (n || flushTo)
+    {
+        // one permit is enough, the producer checks the ring again when it wakes
+        if (m_room.available() == 0)
+        {
+            m_room.release();
+        }
+    }
+
+    if ((n == wanted) || !m_streaming)
+    {
+        m_starved = false;
+
+        return qint64(n * sizeof(Sample));
+    }
+
+    // the next sentence is late, keep the sink running on silence
+    if (!m_starved)
+    {
+        m_starved = true;
+        m_underruns++;
+    }
+
+    // all bits zero is 0.0f as well
+    std::memset(data + n * sizeof(Sample), 0, (wanted - n) * sizeof(Sample));
+
+    return qint64(wanted * sizeof(Sample));
+}
+
+qint64  PlaybackDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+
+    // written through writeSamples()
+    return -1;
+}
@@ -0,0 +1,79 @@
+#ifndef PLAYBACKDEVICE_H
+#define PLAYBACKDEVICE_H
+
+#include <QAudioFormat>
+#include <QIODevice>
+#include <QSemaphore>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "model/spscring.h"
+
+// 16 bit or float PCM source for a QAudioSink in pull mode.
+//
+// The synthesis thread writes each sentence as soon as piper has it, the
+// audio thread pulls whatever is queued. Between beginStream() and
+// endStream() the sink is kept fed: if the next sentence is late the gap is
+// filled with silence and counted as an underrun. After endStream() the
+// device runs dry and the sink goes idle until the next stream.
+class PlaybackDevice: public QIODevice
+{
+    Q_OBJECT
+
+public:
+    // capacity in samples, the producer waits while it is full. format is
+    // the sink's, Int16 or Float.
+    PlaybackDevice(size_t capacity, QAudioFormat::SampleFormat format, QObject *parent = nullptr);
+
+    // Float samples are queued with writeSamples(const float *, ...).
+    bool    isFloat() const;
+
+    // Producer: the first sentence of an answer is ready.
+    void    beginStream();
+
+    // Producer: queue samples, waits for room. Returns false if cancel was
+    // set before all of them fit.
+    bool    writeSamples(const int16_t *samples, size_t count, const std::atomic<bool> &cancel);
+
+    bool    writeSamples(const float *samples, size_t count, const std::atomic<bool> &cancel);
+
+    // Producer: nothing more for this answer.
+    void    endStream();
+
+    // Drop what is queued so far and wake a waiting producer, safe to call
+    // from any thread. The audio thread does the flush on its next pull.
+    void    cancel();
+
+    // Gaps filled with silence since the device was created.
+    int     underruns() const;
+
+    bool    isSequential() const override;
+
+    qint64  bytesAvailable() const override;
+
+protected:
+    qint64  readData(char *data, qint64 maxSize) override;
+
+    qint64  writeData(const char *data, qint64 maxSize) override;
+
+private:
+    template<typename Sample>
+    bool    push(SpscRing<Sample> &ring, const Sample *samples, size_t count, const std::atomic<bool> &cancel);
+
+    template<typename Sample>
+    qint64  pop(SpscRing<Sample> &ring, char *data, qint64 maxSize);
+
+private:
+    // only the one matching the format is allocated
+    std::unique_ptr<SpscRing<int16_t>>  m_ring;
+    std::unique_ptr<SpscRing<float>>    m_floatRing;
+    std::atomic<bool>                   m_streaming { false };
+    std::atomic<int>                    m_underruns { 0 };
+    std::atomic<size_t>                 m_flushTo { 0 }; // ring mark, 0 for none
+    QSemaphore                          m_room; // released by readData()
+    bool                                m_starved = false; // consumer side
+};
+
+#endif // PLAYBACKDEVICE_H
@@ -0,0 +1,209 @@
+#include "speechcache.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+
+#include <cstring>
+
+SpeechCache::SpeechCache(qint64 maxDiskBytes, int memoryKiB):
+    m_memory(memoryKiB), m_maxDiskBytes(maxDiskBytes)
+{
+}
+
+bool  SpeechCache::open(const QString &dir)
+{
+    QMutexLocker  locker(&m_mutex);
+
+    if (!QDir().mkpath(dir))
+    {
+        return false;
+    }
+
+    m_dir = dir;
+    m_files.clear();
+    m_diskBytes = 0;
+
+    // oldest first, so the file times carry the LRU order across restarts
+    const QFileInfoList  entries = QDir(dir).entryInfoList({ "*.pcmz" }, QDir::Files, QDir::Time | QDir::Reversed);
+
+    for (const QFileInfo &entry : entries)
+    {
+        m_files.insert(entry.fileName(), { entry.size(), ++m_clock });
+        m_diskBytes += entry.size();
+    }
+
+    evict();
+
+    qDebug() << "speech cache:" << m_files.size() << "sentences," << m_diskBytes / 1024 << "KiB in" << dir;
+
+    return true;
+}
+
+bool  SpeechCache::lookup(const std::string &key, std::vector<int16_t> &audio)
+{
+    QMutexLocker   locker(&m_mutex);
+    const QString  name = fileName(key);
+
+    m_lookups++;
+
+    QByteArray  pcm;
+
+    if (QByteArray *cached = m_memory.object(name))
+    {
+        pcm = *cached;
+        m_memoryHits++;
+
+        if (m_files.contains(name))
+        {
+            m_files[name].lastUsed = ++m_clock;
+        }
+    }
+    else
+    {
+        auto  file = m_files.find(name);
+
+        if (file == m_files.end())
+        {
+            return false;
+        }
+
+        QFile  entry(m_dir + "/" + name);
+
+        if (!entry.open(QIODevice::ReadOnly))
+        {
+            m_diskBytes -= file->bytes;
+            m_files.erase(file);
+
+            return false;
+        }
+
+        pcm = qUncompress(entry.readAll());
+
+        if (pcm.isEmpty() || (pcm.size() % qsizetype(sizeof(int16_t)) != 0))
+        {
+            // truncated or corrupt
+            entry.close();
+            entry.remove();
+            m_diskBytes -= file->bytes;
+            m_files.erase(file);
+
+            return false;
+        }
+
+        entry.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        file->lastUsed = ++m_clock;
+        m_diskHits++;
+
+        m_memory.insert(name, new QByteArray(pcm), qMax<qsizetype>(1, pcm.size() / 1024));
+    }
+
+    audio.resize(pcm.size() / sizeof(int16_t));
+    std::memcpy(audio.data(), pcm.constData(), audio.size() * sizeof(int16_t));
+
+    return true;
+}
+
+void  SpeechCache::store(const std::string &key, const std::vector<int16_t> &audio)
+{
+    QMutexLocker      locker(&m_mutex);
+    const QString     name = fileName(key);
+    const QByteArray  pcm(reinterpret_cast<const char *>(audio.data()), qsizetype(audio.size() * sizeof(int16_t)));
+
+    m_memory.insert(name, new QByteArray(pcm), qMax<qsizetype>(1, pcm.size() / 1024));
+
+    if (m_dir.isEmpty())
+    {
+        return;
+    }
+
+    const QString  path = m_dir + "/" + name;
+    QFile          entry(path + ".tmp");
+
+    // speech compresses poorly, the silence between sentences well
+    const QByteArray  data = qCompress(pcm, 6);
+
+    if (!entry.open(QIODevice::WriteOnly) || (entry.write(data) != data.size()))
+    {
+        qWarning() << "cannot write speech cache entry" << path;
+        entry.remove();
+
+        return;
+    }
+
+    entry.close();
+
+    // a reader never sees a half written entry
+    QFile::remove(path);
+
+    if (!entry.rename(path))
+    {
+        entry.remove();
+
+        return;
+    }
+
+    if (m_files.contains(name))
+    {
+        m_diskBytes -= m_files[name].bytes;
+    }
+
+    m_files.insert(name, { data.size(), ++m_clock });
+    m_diskBytes += data.size();
+
+    evict();
+}
+
+void  SpeechCache::clear()
+{
+    QMutexLocker  locker(&m_mutex);
+
+    m_memory.clear();
+
+    for (auto it = m_files.constBegin(); it != m_files.constEnd(); ++it)
+    {
+        QFile::remove(m_dir + "/" + it.key());
+    }
+
+    m_files.clear();
+    m_diskBytes = 0;
+}
+
+SpeechCache::Stats  SpeechCache::stats() const
+{
+    QMutexLocker  locker(&m_mutex);
+
+    return { m_lookups, m_memoryHits, m_diskHits, m_diskBytes, int(m_files.size()) };
+}
+
+QString  SpeechCache::fileName(const std::string &key)
+{
+    const QByteArray  hash = QCryptographicHash::hash(QByteArray::fromStdString(key), QCryptographicHash::Sha1);
+
+    return QString::fromLatin1(hash.toHex()) + ".pcmz";
+}
+
+void  SpeechCache::evict()
+{
+    while ((m_diskBytes > m_maxDiskBytes) && !m_files.isEmpty())
+    {
+        auto  oldest = m_files.begin();
+
+        for (auto it = m_files.begin(); it != m_files.end(); ++it)
+        {
+            if (it->lastUsed < oldest->lastUsed)
+            {
+                oldest = it;
+            }
+        }
+
+        QFile::remove(m_dir + "/" + oldest.key());
+        m_memory.remove(oldest.key());
+        m_diskBytes -= oldest->bytes;
+        m_files.erase(oldest);
+    }
+}
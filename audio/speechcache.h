@@ -0,0 +1,70 @@
+#ifndef SPEECHCACHE_H
+#define SPEECHCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include "piper/piper.hpp"
+
+// Synthesized sentences for piper, so alerts, canned answers and sentences
+// repeated inside answers are not synthesized again.
+//
+// Entries are addressed by the SHA-1 of piper's key (voice, speaker,
+// synthesis settings and the sentence text), one qCompress'ed file per
+// sentence in a directory, which keeps them across restarts. When the files
+// go over the size bound the least recently used ones are deleted. Recently
+// used sentences are also kept decompressed in memory.
+class SpeechCache: public piper::SentenceAudioCache
+{
+public:
+    struct Stats
+    {
+        int     lookups;
+        int     memoryHits;
+        int     diskHits;
+        qint64  diskBytes;
+        int     files;
+    };
+
+    explicit SpeechCache(qint64 maxDiskBytes = 256ll * 1024 * 1024, int memoryKiB = 16 * 1024);
+
+    // Directory of the entries, created if missing. Without one the cache is
+    // memory only.
+    bool   open(const QString &dir);
+
+    bool   lookup(const std::string &key, std::vector<int16_t> &audio) override;
+
+    void   store(const std::string &key, const std::vector<int16_t> &audio) override;
+
+    void   clear();
+
+    Stats  stats() const;
+
+private:
+    struct File
+    {
+        qint64   bytes;
+        quint64  lastUsed;
+    };
+
+    static QString  fileName(const std::string &key);
+
+    void   evict();
+
+private:
+    mutable QMutex               m_mutex;
+    QString                      m_dir;
+    QCache<QString, QByteArray>  m_memory;        // decompressed PCM, cost in KiB
+    QHash<QString, File>         m_files;
+    qint64                       m_maxDiskBytes;
+    qint64                       m_diskBytes = 0;
+    quint64                      m_clock     = 0;
+    int                          m_lookups    = 0;
+    int                          m_memoryHits = 0;
+    int                          m_diskHits   = 0;
+};
+
+#endif // SPEECHCACHE_H
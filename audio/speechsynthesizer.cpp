@@ -0,0 +1,105 @@
+#include "speechsynthesizer.h"
+#include "playbackdevice.h"
+#include "speechcache.h"
+#include "piper/piper.hpp"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+SpeechSynthesizer::SpeechSynthesizer(PlaybackDevice *device, QObject *parent):
+    QObject(parent), m_device(device)
+{
+}
+
+void  SpeechSynthesizer::setVoice(piper::PiperConfig *config, piper::Voice *voice)
+{
+    m_config = config;
+    m_voice  = voice;
+}
+
+void  SpeechSynthesizer::cancel()
+{
+    m_cancel = true;
+
+    // stops what is already queued as well
+    m_device->cancel();
+}
+
+void  SpeechSynthesizer::speak(const std::string &text)
+{
+    if (!m_config || !m_voice)
+    {
+        return;
+    }
+
+    m_cancel = false;
+
+    QElapsedTimer  timer;
+    const int      underruns = m_device->underruns();
+
+    timer.start();
+
+    // float sinks get piper's float samples, without the int16 round trip
+    const size_t  samples = m_device->isFloat() ? synthesize<float>(text, timer) : synthesize<int16_t>(text, timer);
+
+    m_device->endStream();
+
+    if (m_cancel)
+    {
+        return;
+    }
+
+    qDebug() << "synthesized" << samples << "samples in" << timer.elapsed() << "ms,"
+             << m_device->underruns() - underruns << "underruns";
+
+    if (m_config->phonemizeCache)
+    {
+        const piper::PhonemizeCacheStats  stats = m_config->phonemizeCache->stats();
+
+        qDebug() << "phoneme cache:" << stats.memoryHits << "memory hits," << stats.diskHits << "disk hits,"
+                 << stats.misses << "misses," << qRound(stats.hitRate() * 100) << "% hit rate";
+    }
+
+    if (auto speechCache = dynamic_cast<SpeechCache *>(m_config->audioCache.get()))
+    {
+        const SpeechCache::Stats  stats = speechCache->stats();
+
+        qDebug() << "speech cache:" << stats.memoryHits << "memory hits," << stats.diskHits << "disk hits of"
+                 << stats.lookups << "lookups," << stats.files << "sentences on disk";
+    }
+}
+
+template<typename Sample>
+size_t  SpeechSynthesizer::synthesize(const std::string &text, const QElapsedTimer &timer)
+{
+    std::vector<Sample>     audioBuffer;
+    size_t                  samples = 0;
+    piper::SynthesisResult  result  = { };
+    bool                    started = false;
+
+    // called with each sentence, audioBuffer is cleared afterwards. cancel()
+    // also stops the sentences after the current one from being synthesized.
+    piper::textToAudio(*m_config, *m_voice, text, audioBuffer, result, [&]()
+    {
+        if (m_cancel || audioBuffer.empty())
+        {
+            return;
+        }
+
+        samples += audioBuffer.size();
+
+        if (!m_device->writeSamples(audioBuffer.data(), audioBuffer.size(), m_cancel))
+        {
+            return;
+        }
+
+        if (!started)
+        {
+            started = true;
+            m_device->beginStream();
+            emit  playbackStarted(timer.elapsed());
+        }
+    }, &m_cancel);
+
+    return samples;
+}
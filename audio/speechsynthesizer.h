@@ -0,0 +1,56 @@
+#ifndef SPEECHSYNTHESIZER_H
+#define SPEECHSYNTHESIZER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+
+#include <atomic>
+#include <string>
+
+namespace piper
+{
+struct PiperConfig;
+struct Voice;
+}
+
+class PlaybackDevice;
+
+// Runs piper on its own thread and feeds a PlaybackDevice sentence by
+// sentence through textToAudio's audioCallback, so playback starts with the
+// first sentence instead of after the whole answer.
+class SpeechSynthesizer: public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SpeechSynthesizer(PlaybackDevice *device, QObject *parent = nullptr);
+
+    // Call on the synthesizer's thread, e.g. from a queued call, so the voice
+    // changes between answers.
+    void    setVoice(piper::PiperConfig *config, piper::Voice *voice);
+
+    // Stop the current answer and its queued audio, safe to call from any
+    // thread.
+    void    cancel();
+
+public slots:
+    void    speak(const std::string &text);
+
+signals:
+    // The first sentence is queued, synthesisMs after speak() was called.
+    void    playbackStarted(qint64 synthesisMs);
+
+private:
+    // textToAudio into the device, returns the samples queued
+    template<typename Sample>
+    size_t  synthesize(const std::string &text, const QElapsedTimer &timer);
+
+private:
+    PlaybackDevice      *m_device;
+    piper::PiperConfig  *m_config = nullptr;
+    piper::Voice        *m_voice  = nullptr;
+    std::atomic<bool>    m_cancel { false };
+};
+
+#endif // SPEECHSYNTHESIZER_H
@@ -0,0 +1,164 @@
+#include "voiceregistry.h"
+#include "piper/piper.hpp"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+
+#include <optional>
+#include <stdexcept>
+
+VoiceRegistry::VoiceRegistry(piper::PiperConfig *config):
+    m_config(config)
+{
+}
+
+VoiceRegistry::~VoiceRegistry() = default;
+
+void  VoiceRegistry::setMemoryBudget(qint64 bytes)
+{
+    m_budget = bytes;
+}
+
+piper::Voice * VoiceRegistry::voice(const QString &name)
+{
+    Entry &entry = m_entries[name];
+
+    if (!entry.voice && !load(name, entry))
+    {
+        return nullptr;
+    }
+
+    entry.lastUsed = ++m_clock;
+    m_current      = name;
+
+    return entry.voice.get();
+}
+
+float  VoiceRegistry::lengthScale(const QString &name) const
+{
+    auto  it = m_entries.find(name);
+
+    return (it != m_entries.end()) ? it->second.lengthScale : 1.0f;
+}
+
+void  VoiceRegistry::preload(const QStringList &names)
+{
+    for (const QString &name : names)
+    {
+        Entry &entry = m_entries[name];
+
+        if (entry.voice)
+        {
+            continue;
+        }
+
+        // never push out a voice that was chosen for one loaded ahead
+        if (residentBytes() + QFileInfo(name + ".onnx").size() > m_budget)
+        {
+            break;
+        }
+
+        if (load(name, entry))
+        {
+            entry.lastUsed = 0;
+        }
+    }
+}
+
+bool  VoiceRegistry::isResident(const QString &name) const
+{
+    auto  it = m_entries.find(name);
+
+    return (it != m_entries.end()) && it->second.voice;
+}
+
+qint64  VoiceRegistry::residentBytes() const
+{
+    qint64  bytes = 0;
+
+    for (const auto &it : m_entries)
+    {
+        if (it.second.voice)
+        {
+            bytes += it.second.bytes;
+        }
+    }
+
+    return bytes;
+}
+
+bool  VoiceRegistry::load(const QString &name, Entry &entry)
+{
+    const QString  modelPath = name + ".onnx";
+
+    if (!QFile::exists(modelPath))
+    {
+        qWarning() << "voice model not found:" << modelPath;
+
+        return false;
+    }
+
+    // the session holds about the model's size, weights dominate
+    const qint64  bytes = QFileInfo(modelPath).size();
+
+    evict(bytes, m_current);
+
+    std::optional<piper::SpeakerId>  speakerId;
+    auto                             voice = std::make_unique<piper::Voice>();
+    QElapsedTimer                    timer;
+
+    timer.start();
+
+    try
+    {
+        piper::loadVoice(*m_config, modelPath.toStdString(), (modelPath + ".json").toStdString(), *voice, speakerId, false);
+    }
+    catch (const std::exception &e)
+    {
+        qWarning() << "failed to load voice" << name << ":" << e.what();
+
+        return false;
+    }
+
+    entry.voice       = std::move(voice);
+    entry.lengthScale = entry.voice->synthesisConfig.lengthScale;
+    entry.bytes       = bytes;
+
+    qDebug() << "loaded voice" << name << "in" << timer.elapsed() << "ms,"
+             << residentBytes() / (1024 * 1024) << "MiB resident";
+
+    return true;
+}
+
+void  VoiceRegistry::evict(qint64 extra, const QString &keep)
+{
+    while (residentBytes() + extra > m_budget)
+    {
+        auto  oldest = m_entries.end();
+
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+        {
+            if (!it->second.voice || (it->first == keep))
+            {
+                continue;
+            }
+
+            if ((oldest == m_entries.end()) || (it->second.lastUsed < oldest->second.lastUsed))
+            {
+                oldest = it;
+            }
+        }
+
+        if (oldest == m_entries.end())
+        {
+            // only the current voice is left, go over budget
+            return;
+        }
+
+        qDebug() << "unloading voice" << oldest->first;
+
+        oldest->second.voice.reset();
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef VOICEREGISTRY_H
+#define VOICEREGISTRY_H
+
+#include <QString>
+#include <QStringList>
+
+#include <map>
+#include <memory>
+
+namespace piper
+{
+struct PiperConfig;
+struct Voice;
+}
+
+// Keeps piper voices loaded so switching between them is a lookup instead of
+// a model load.
+//
+// A voice is loaded on first use and stays resident until the resident models
+// go over the memory budget, then the least recently used ones other than the
+// current voice are unloaded. All sessions share one onnxruntime environment
+// (see piper::loadModel) and espeak-ng is initialized once by the owner:
+// phonemize_eSpeak selects the espeak voice on every call.
+//
+// Not thread-safe. MainWindow only uses it on the synthesis thread, between
+// answers, as unloading a voice must not race with speaking it.
+class VoiceRegistry
+{
+public:
+    explicit VoiceRegistry(piper::PiperConfig *config);
+
+    ~VoiceRegistry();
+
+    // Model bytes the resident voices may take.
+    void      setMemoryBudget(qint64 bytes);
+
+    // Resident voice, loaded if needed, which makes it the current one.
+    // name is the model file without .onnx. nullptr if it could not be loaded.
+    piper::Voice * voice(const QString &name);
+
+    // Length scale from the voice config, before any change made to the
+    // resident voice.
+    float     lengthScale(const QString &name) const;
+
+    // Load voices ahead of use while they fit the budget, the current voice
+    // stays current.
+    void      preload(const QStringList &names);
+
+    bool      isResident(const QString &name) const;
+
+    qint64    residentBytes() const;
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<piper::Voice>  voice;
+        float                          lengthScale = 1.0f;
+        qint64                         bytes       = 0;
+        quint64                        lastUsed    = 0;
+    };
+
+    bool  load(const QString &name, Entry &entry);
+
+    // Unload least recently used voices until extra bytes fit.
+    void  evict(qint64 extra, const QString &keep);
+
+private:
+    piper::PiperConfig      *m_config;
+    std::map<QString, Entry> m_entries;
+    QString                  m_current;
+    quint64                  m_clock  = 0;
+    qint64                   m_budget = 512ll * 1024 * 1024;
+};
+
+#endif // VOICEREGISTRY_H
@@ -0,0 +1,322 @@
+#include "wakewordgate.h"
+#include "model/answercache.h"
+#include "whisper.h"
+
+#include <QDebug>
+#include <QFile>
+
+#include <algorithm>
+#include <ctime>
+
+namespace
+{
+// the keyword is expected at the start of the utterance
+constexpr int  MaxSpotMs = 3000;
+// shorter bursts are clicks and knocks
+constexpr int  MinSpeechMs = 300;
+// bursts dropped unheard while over the CPU budget
+constexpr int  ShortBurstMs = 1000;
+
+qint64  threadCpuMs()
+{
+    timespec  ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    {
+        return 0;
+    }
+
+    return qint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+std::u32string  withoutSpaces(const std::string &text)
+{
+    std::u32string  s = utf8_to_utf32(text);
+
+    s.erase(std::remove(s.begin(), s.end(), U' '), s.end());
+
+    return s;
+}
+}
+
+WakeWordGate::WakeWordGate(QObject *parent):
+    QObject(parent)
+{
+}
+
+WakeWordGate::~WakeWordGate()
+{
+    if (m_context)
+    {
+        whisper_free(m_context);
+        m_context = nullptr;
+    }
+}
+
+bool  WakeWordGate::initialize(const QString &modelPath, const QString &language)
+{
+    if (!QFile::exists(modelPath))
+    {
+        qWarning() << "Wake word model not found:" << modelPath;
+
+        return false;
+    }
+
+    m_context = whisper_init_from_file_with_params(modelPath.toStdString().c_str(), whisper_context_default_params());
+
+    if (!m_context)
+    {
+        qWarning() << "Failed to initialize the wake word model.";
+
+        return false;
+    }
+
+    m_language = language.toStdString();
+    m_clock.start();
+
+    return true;
+}
+
+void  WakeWordGate::setKeywords(const QStringList &keywords)
+{
+    m_keywords.clear();
+
+    for (const QString &keyword : keywords)
+    {
+        const std::string  normalized = AnswerCache::normalize(keyword);
+
+        if (normalized.empty())
+        {
+            continue;
+        }
+
+        m_keywords.push_back({ int(std::count(normalized.begin(), normalized.end(), ' ')) + 1,
+                               edit_distance_pattern(withoutSpaces(normalized)) });
+    }
+}
+
+void  WakeWordGate::setSensitivity(double sensitivity)
+{
+    m_threshold = 0.9 - 0.3 * std::clamp(sensitivity, 0.0, 1.0);
+}
+
+void  WakeWordGate::setRefractoryMs(int ms)
+{
+    m_refractoryMs = ms;
+}
+
+void  WakeWordGate::setFollowUpMs(int ms)
+{
+    m_followUpMs = ms;
+}
+
+void  WakeWordGate::setCpuBudget(double percent)
+{
+    m_cpuBudget = percent;
+}
+
+QString  WakeWordGate::stripKeyword(const QString &transcript) const
+{
+    const QStringList  tokens = transcript.simplified().split(' ');
+    const int          n      = matchLength(splitWords(transcript));
+
+    if (n == 0)
+    {
+        return transcript;
+    }
+
+    return tokens.mid(n).join(' ');
+}
+
+WakeWordGate::Stats  WakeWordGate::stats() const
+{
+    Stats  stats = m_stats;
+
+    stats.wallMs = m_clock.isValid() ? m_clock.elapsed() : 0;
+
+    return stats;
+}
+
+void  WakeWordGate::processPartial(std::vector<float> pcmf32, bool endOfSpeech)
+{
+    if (m_decision == Undecided)
+    {
+        m_decision = decide(pcmf32);
+    }
+
+    if (m_decision != Rejected)
+    {
+        emit  partialAccepted(std::move(pcmf32), endOfSpeech);
+    }
+}
+
+void  WakeWordGate::processUtterance(std::vector<float> pcmf32)
+{
+    if (m_decision == Undecided)
+    {
+        m_decision = decide(pcmf32);
+    }
+
+    const Decision  decision = m_decision;
+
+    // the next audio is a new utterance
+    m_decision = Undecided;
+
+    if (m_stats.utterances % 20 == 0)
+    {
+        qDebug().nospace() << "wake word: " << m_stats.utterances << " utterances, " << m_stats.spotted << " spotted, "
+                           << m_stats.followUps << " follow-ups, " << m_stats.skipped << " skipped, cpu "
+                           << cpuPercent() << "% of one core";
+    }
+
+    // only a keyword opens the window, so follow-ups cannot chain it forever
+    if (decision == Spotted)
+    {
+        m_lastWakeUtterance.start();
+    }
+
+    if (decision != Rejected)
+    {
+        emit  utteranceAccepted(std::move(pcmf32));
+    }
+}
+
+WakeWordGate::Decision  WakeWordGate::decide(const std::vector<float> &pcmf32)
+{
+    if (!m_context)
+    {
+        return Accepted;
+    }
+
+    m_stats.utterances++;
+
+    if (m_lastWakeUtterance.isValid() && (m_lastWakeUtterance.elapsed() < m_followUpMs))
+    {
+        m_stats.followUps++;
+
+        return Accepted;
+    }
+
+    const size_t  samplesPerMs = WHISPER_SAMPLE_RATE / 1000;
+
+    if ((pcmf32.size() < MinSpeechMs * samplesPerMs) ||
+        ((pcmf32.size() < ShortBurstMs * samplesPerMs) && (cpuPercent() > m_cpuBudget)))
+    {
+        m_stats.skipped++;
+
+        return Rejected;
+    }
+
+    const qint64  cpu   = threadCpuMs();
+    bool          heard = spot(pcmf32);
+
+    m_stats.cpuMs += threadCpuMs() - cpu;
+
+    if (heard && m_lastSpotted.isValid() && (m_lastSpotted.elapsed() < m_refractoryMs))
+    {
+        qDebug() << "wake word ignored in the refractory period";
+        heard = false;
+    }
+
+    if (heard)
+    {
+        m_stats.spotted++;
+        m_lastSpotted.start();
+    }
+
+    return heard ? Spotted : Rejected;
+}
+
+bool  WakeWordGate::spot(const std::vector<float> &pcmf32)
+{
+    const int  n = int(std::min(pcmf32.size(), size_t(MaxSpotMs * WHISPER_SAMPLE_RATE / 1000)));
+
+    whisper_full_params  wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    // one core, a few tokens, and an encoder window cut to the clip (50
+    // frames per second) instead of the full 30 s. No initial prompt with
+    // the keywords, on noise Whisper tends to repeat it.
+    wparams.n_threads        = 1;
+    wparams.language         = m_language.c_str();
+    wparams.single_segment   = true;
+    wparams.no_timestamps    = true;
+    wparams.max_tokens       = 16;
+    wparams.audio_ctx        = std::min(1500, n * 50 / WHISPER_SAMPLE_RATE + 16);
+    wparams.temperature_inc  = 0.0f;
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.print_special    = false;
+
+    if (whisper_full(m_context, wparams, pcmf32.data(), n) != 0)
+    {
+        return false;
+    }
+
+    QString  text;
+
+    for (int i = 0; i < whisper_full_n_segments(m_context); i++)
+    {
+        text += QString::fromUtf8(whisper_full_get_segment_text(m_context, i));
+    }
+
+    const bool  heard = matchLength(splitWords(text)) > 0;
+
+    qDebug() << "wake word:" << text << (heard ? "heard" : "not heard");
+
+    return heard;
+}
+
+int  WakeWordGate::matchLength(const std::vector<std::u32string> &words) const
+{
+    // allow one filler word ("ok", "um") before the keyword, and Whisper
+    // splitting or merging a word
+    for (size_t start = 0; start < std::min<size_t>(2, words.size()); ++start)
+    {
+        for (const Keyword &keyword : m_keywords)
+        {
+            for (int count = std::max(1, keyword.words - 1); count <= keyword.words + 1; ++count)
+            {
+                if (start + count > words.size())
+                {
+                    break;
+                }
+
+                std::u32string  joined;
+
+                for (size_t i = start; i < start + count; ++i)
+                {
+                    joined += words[i];
+                }
+
+                if (!joined.empty() && (keyword.pattern.similarity(joined) >= m_threshold))
+                {
+                    return int(start + count);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+std::vector<std::u32string>  WakeWordGate::splitWords(const QString &text)
+{
+    // one entry per whitespace separated token, so that counts map back to
+    // the transcript
+    std::vector<std::u32string>  words;
+
+    for (const QString &token : text.simplified().split(' '))
+    {
+        words.push_back(withoutSpaces(AnswerCache::normalize(token)));
+    }
+
+    return words;
+}
+
+double  WakeWordGate::cpuPercent() const
+{
+    const qint64  wallMs = m_clock.isValid() ? m_clock.elapsed() : 0;
+
+    return (wallMs > 0) ? 100.0 * m_stats.cpuMs / wallMs : 0.0;
+}
@@ -0,0 +1,121 @@
+#ifndef WAKEWORDGATE_H
+#define WAKEWORDGATE_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+
+#include "common.h"
+
+#include <vector>
+
+struct whisper_context;
+
+// Keyword spotter in front of WhisperTranscriber. An utterance only reaches
+// the large Whisper model (and so the LLM) when a tiny Whisper model hears
+// one of the keywords at its start, or when it starts within the follow-up
+// window after an utterance that had one. Everything else is dropped, so noise in the
+// plant costs one tiny Whisper pass over at most MaxSpotMs of audio.
+//
+// Matching is phonetic in the loose sense: the tiny model's transcript is
+// normalized like the answer cache keys and compared to the keywords with
+// the edit distance engine, with and without the spaces between words.
+class WakeWordGate: public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Stats
+    {
+        int     utterances;  // decisions taken
+        int     spotted;     // keyword heard
+        int     followUps;   // passed in the follow-up window
+        int     skipped;     // dropped without running the model
+        qint64  cpuMs;       // thread CPU time spent deciding
+        qint64  wallMs;      // since initialize()
+    };
+
+    explicit WakeWordGate(QObject *parent = nullptr);
+
+    ~WakeWordGate();
+
+    bool   initialize(const QString &modelPath, const QString &language);
+
+    void   setKeywords(const QStringList &keywords);
+
+    // 0 needs a near exact match, 1 accepts anything remotely similar.
+    void   setSensitivity(double sensitivity);
+
+    // A keyword heard this soon after the last one does not open the gate
+    // again, e.g. the assistant saying its own name through the speakers.
+    void   setRefractoryMs(int ms);
+
+    // Utterances starting this soon after the end of one with a keyword need
+    // no keyword. Follow-ups do not extend the window.
+    void   setFollowUpMs(int ms);
+
+    // Share of one core the gate may use while nobody talks to it. Above it,
+    // bursts shorter than a second are dropped without running the model.
+    void   setCpuBudget(double percent);
+
+    // Remove a keyword at the start of a transcript.
+    QString  stripKeyword(const QString &transcript) const;
+
+    Stats    stats() const;
+
+public slots:
+    // Same arguments as the AudioStreamer signals.
+    void  processPartial(std::vector<float> pcmf32, bool endOfSpeech);
+
+    void  processUtterance(std::vector<float> pcmf32);
+
+signals:
+    void  partialAccepted(std::vector<float> pcmf32, bool endOfSpeech);
+
+    void  utteranceAccepted(std::vector<float> pcmf32);
+
+private:
+    enum Decision
+    {
+        Undecided,
+        Spotted,  // keyword heard, opens the follow-up window
+        Accepted, // passed without a keyword
+        Rejected
+    };
+
+    Decision  decide(const std::vector<float> &pcmf32);
+
+    bool      spot(const std::vector<float> &pcmf32);
+
+    // Words of the transcript that match a keyword, 0 if none.
+    int       matchLength(const std::vector<std::u32string> &words) const;
+
+    static std::vector<std::u32string>  splitWords(const QString &text);
+
+    double    cpuPercent() const;
+
+private:
+    struct Keyword
+    {
+        int                    words;   // number of words
+        edit_distance_pattern  pattern; // normalized, without spaces
+    };
+
+    whisper_context      *m_context = nullptr;
+    std::string           m_language;
+    std::vector<Keyword>  m_keywords;
+
+    double  m_threshold    = 0.75; // keyword similarity
+    int     m_refractoryMs = 2000;
+    int     m_followUpMs   = 8000;
+    double  m_cpuBudget    = 5.0;
+
+    Decision       m_decision = Undecided;
+    QElapsedTimer  m_lastSpotted;
+    QElapsedTimer  m_lastWakeUtterance; // end of the last one with a keyword
+    QElapsedTimer  m_clock;
+    Stats          m_stats = { };
+};
+
+#endif // WAKEWORDGATE_H
@@ -14,6 +14,7 @@
 #include <locale>
 #include <codecvt>
 #include <sstream>
+#include <algorithm>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -799,27 +800,252 @@ bool vad_simple(std::vector<float> & pcmf32, int sample_rate, int last_ms, float
 }
 
 float similarity(const std::string & s0, const std::string & s1) {
-    const size_t len0 = s0.size() + 1;
-    const size_t len1 = s1.size() + 1;
+    return edit_distance_pattern(s0).similarity(utf8_to_utf32(s1));
+}
+
+std::u32string utf8_to_utf32(const std::string & s) {
+    std::u32string result;
+    result.reserve(s.size());
+
+    for (size_t i = 0; i < s.size(); ) {
+        const unsigned char c = s[i];
+        const int len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xe ? 3 : (c >> 3) == 0x1e ? 4 : 1;
+
+        if (len == 1 || i + len > s.size()) {
+            result.push_back(c);
+            i++;
+            continue;
+        }
+
+        char32_t cp = c & (0xff >> (len + 1));
+        bool valid = true;
+        for (int k = 1; k < len; k++) {
+            const unsigned char cc = s[i + k];
+            valid = valid && (cc & 0xc0) == 0x80;
+            cp = (cp << 6) | (cc & 0x3f);
+        }
 
-    std::vector<int> col(len1, 0);
-    std::vector<int> prevCol(len1, 0);
+        if (!valid) {
+            result.push_back(c);
+            i++;
+            continue;
+        }
 
-    for (size_t i = 0; i < len1; i++) {
-        prevCol[i] = i;
+        result.push_back(cp);
+        i += len;
     }
 
-    for (size_t i = 0; i < len0; i++) {
-        col[0] = i;
-        for (size_t j = 1; j < len1; j++) {
-            col[j] = std::min(std::min(1 + col[j - 1], 1 + prevCol[j]), prevCol[j - 1] + (i > 0 && s0[i - 1] == s1[j - 1] ? 0 : 1));
+    return result;
+}
+
+edit_distance_pattern::edit_distance_pattern(const std::string & pattern)
+    : edit_distance_pattern(utf8_to_utf32(pattern)) {
+}
+
+edit_distance_pattern::edit_distance_pattern(const std::u32string & pattern) {
+    m      = pattern.size();
+    blocks = std::max<size_t>(1, (m + 63) / 64);
+
+    std::vector<char32_t> chars;
+    for (char32_t c : pattern) {
+        if (c >= 128) {
+            chars.push_back(c);
         }
-        col.swap(prevCol);
     }
+    std::sort(chars.begin(), chars.end());
+    chars.erase(std::unique(chars.begin(), chars.end()), chars.end());
+
+    // open addressing table for the non-ASCII characters, at most half full
+    size_t slots = 1;
+    while (slots < 2 * chars.size()) {
+        slots *= 2;
+    }
+    table.assign(slots, { 0, 0 });
+    table_mask = slots - 1;
 
-    const float dist = prevCol[len1 - 1];
+    for (size_t k = 0; k < chars.size(); k++) {
+        size_t slot = chars[k] & table_mask;
+        while (table[slot].entry != 0) {
+            slot = (slot + 1) & table_mask;
+        }
+        table[slot] = { chars[k], uint32_t(128 + k) };
+    }
 
-    return 1.0f - (dist / std::max(s0.size(), s1.size()));
+    // bit i of a character's mask is set where pattern[i] is that character,
+    // entry 128 + chars.size() stays zero for characters not in the pattern
+    n_entries = 128 + chars.size();
+    masks.assign((n_entries + 1) * blocks, 0);
+
+    for (size_t i = 0; i < m; i++) {
+        masks[entry(pattern[i]) * blocks + i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
+
+size_t edit_distance_pattern::entry(char32_t c) const {
+    if (c < 128) {
+        return c;
+    }
+
+    for (size_t slot = c & table_mask; table[slot].entry != 0; slot = (slot + 1) & table_mask) {
+        if (table[slot].c == c) {
+            return table[slot].entry;
+        }
+    }
+
+    return n_entries;
+}
+
+const uint64_t * edit_distance_pattern::peq(char32_t c) const {
+    return masks.data() + entry(c) * blocks;
+}
+
+int edit_distance_pattern::distance(const std::u32string & text, int max_distance) const {
+    const int n = text.size();
+
+    if (m == 0 || n == 0) {
+        const int d = std::max<int>(m, n);
+        return d > max_distance ? max_distance + 1 : d;
+    }
+
+    if (std::abs((int) m - n) > max_distance) {
+        return max_distance + 1;
+    }
+
+    const uint64_t last = uint64_t(1) << ((m - 1) % 64);
+
+    int score = m;
+
+    if (blocks == 1) {
+        // vertical deltas of the current DP column, +1 (pv) or -1 (mv) per row
+        uint64_t pv = ~uint64_t(0);
+        uint64_t mv = 0;
+
+        for (int j = 0; j < n; j++) {
+            const uint64_t eq = *peq(text[j]);
+            const uint64_t xv = eq | mv;
+            const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+
+            score += (ph & last) ? 1 : (mh & last) ? -1 : 0;
+
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+
+            // each remaining text character lowers the score by at most one
+            if (score - (n - 1 - j) > max_distance) {
+                return max_distance + 1;
+            }
+        }
+
+        return score;
+    }
+
+    // patterns up to 512 characters keep the column on the stack
+    uint64_t stack[16];
+    std::vector<uint64_t> heap;
+    uint64_t * pv = stack;
+
+    if (blocks > 8) {
+        heap.resize(2 * blocks);
+        pv = heap.data();
+    }
+
+    uint64_t * mv = pv + blocks;
+
+    std::fill(pv, pv + blocks, ~uint64_t(0));
+    std::fill(mv, mv + blocks, 0);
+
+    for (int j = 0; j < n; j++) {
+        const uint64_t * eq_c = peq(text[j]);
+
+        // horizontal delta entering the top of the block, +1 in row 0
+        int hin = 1;
+
+        for (size_t b = 0; b < blocks; b++) {
+            uint64_t eq = eq_c[b];
+            uint64_t Pv = pv[b];
+            uint64_t Mv = mv[b];
+
+            const uint64_t xv = eq | Mv;
+            if (hin < 0) {
+                eq |= 1;
+            }
+            const uint64_t xh = (((eq & Pv) + Pv) ^ Pv) | eq;
+
+            uint64_t ph = Mv | ~(xh | Pv);
+            uint64_t mh = Pv & xh;
+
+            const uint64_t top = b + 1 < blocks ? uint64_t(1) << 63 : last;
+            const int hout = (ph & top) ? 1 : (mh & top) ? -1 : 0;
+
+            ph <<= 1;
+            mh <<= 1;
+            if (hin < 0) {
+                mh |= 1;
+            } else if (hin > 0) {
+                ph |= 1;
+            }
+
+            pv[b] = mh | ~(xv | ph);
+            mv[b] = ph & xv;
+
+            hin = hout;
+        }
+
+        score += hin;
+
+        if (score - (n - 1 - j) > max_distance) {
+            return max_distance + 1;
+        }
+    }
+
+    return score;
+}
+
+float edit_distance_pattern::similarity(const std::u32string & text) const {
+    const size_t len = std::max(m, text.size());
+
+    if (len == 0) {
+        return 1.0f;
+    }
+
+    return 1.0f - float(distance(text)) / len;
+}
+
+std::vector<int> edit_distance_batch(
+        const std::string & query,
+        const std::vector<std::string> & candidates,
+        int max_distance) {
+    const edit_distance_pattern pattern(query);
+
+    std::vector<int> result;
+    result.reserve(candidates.size());
+
+    for (const auto & candidate : candidates) {
+        result.push_back(pattern.distance(utf8_to_utf32(candidate), max_distance));
+    }
+
+    return result;
+}
+
+std::vector<float> similarity_batch(
+        const std::string & query,
+        const std::vector<std::string> & candidates) {
+    const edit_distance_pattern pattern(query);
+
+    std::vector<float> result;
+    result.reserve(candidates.size());
+
+    for (const auto & candidate : candidates) {
+        result.push_back(pattern.similarity(utf8_to_utf32(candidate)));
+    }
+
+    return result;
 }
 
 bool sam_params_parse(int argc, char ** argv, sam_params & params) {
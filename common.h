@@ -10,6 +10,7 @@
 #include <ctime>
 #include <fstream>
 #include <sstream>
+#include <cstdint>
 
 #define COMMON_SAMPLE_RATE 16000
 
@@ -266,6 +267,60 @@ bool vad_simple(
 // compute similarity between two strings using Levenshtein distance
 float similarity(const std::string & s0, const std::string & s1);
 
+//
+// Edit distance
+//
+
+// decode UTF-8, invalid bytes are kept as single code points
+std::u32string utf8_to_utf32(const std::string & s);
+
+// Levenshtein distance of one pattern to many texts, bit-parallel (Myers 1999,
+// Hyyrö 2003): a text character costs one pass over ceil(m / 64) words instead
+// of m cells of the DP matrix. Works on code points so that Persian letters
+// count as one edit.
+struct edit_distance_pattern {
+    edit_distance_pattern() = default;
+    explicit edit_distance_pattern(const std::u32string & pattern);
+    explicit edit_distance_pattern(const std::string & pattern);
+
+    // returns max_distance + 1 as soon as the distance is known to exceed max_distance
+    int distance(const std::u32string & text, int max_distance = INT32_MAX) const;
+
+    // 1 - distance / max(length), as similarity()
+    float similarity(const std::u32string & text) const;
+
+    size_t size() const { return m; }
+
+private:
+    struct slot {
+        char32_t c;
+        uint32_t entry; // 0 if empty
+    };
+
+    size_t entry(char32_t c) const;
+
+    const uint64_t * peq(char32_t c) const;
+
+    size_t m         = 0; // pattern length
+    size_t blocks    = 0; // 64 bit words per character
+    size_t n_entries = 0; // 128 ASCII characters and the other pattern characters
+
+    std::vector<slot>     table;          // non-ASCII character -> entry
+    size_t                table_mask = 0;
+    std::vector<uint64_t> masks;          // blocks words per entry, then an all zero entry
+};
+
+// distances of query to every candidate, see edit_distance_pattern::distance()
+std::vector<int> edit_distance_batch(
+        const std::string & query,
+        const std::vector<std::string> & candidates,
+        int max_distance = INT32_MAX);
+
+// similarity() of query to every candidate
+std::vector<float> similarity_batch(
+        const std::string & query,
+        const std::vector<std::string> & candidates);
+
 //
 // SAM argument parsing
 //
@@ -1,6 +1,7 @@
 #include "mainwindow.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QSettings>
 
 int  main(int argc, char *argv[])
@@ -12,7 +13,30 @@ int  main(int argc, char *argv[])
     QCoreApplication::setApplicationVersion("0.1.0");
 
     QApplication  a(argc, argv);
-    MainWindow    w;
+
+    QCommandLineParser  parser;
+    QCommandLineOption  prewarmOption("prewarm-phonemes", "Phonemize the plant documents into the phoneme cache and exit.");
+    QCommandLineOption  endOfTurnOption("evaluate-end-of-turn",
+                                        "Replay recorded sessions (the given wav files, or all recorded ones) through the end-of-turn detector, print the saved latency and premature cuts and exit.");
+
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addOption(prewarmOption);
+    parser.addOption(endOfTurnOption);
+    parser.addPositionalArgument("sessions", "Session recordings for --evaluate-end-of-turn.", "[sessions...]");
+    parser.process(a);
+
+    if (parser.isSet(prewarmOption))
+    {
+        return MainWindow::prewarmPhonemes();
+    }
+
+    if (parser.isSet(endOfTurnOption))
+    {
+        return MainWindow::evaluateEndOfTurn(parser.positionalArguments());
+    }
+
+    MainWindow  w;
 
     w.show();
 
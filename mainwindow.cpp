@@ -10,6 +10,9 @@
 #include <QBuffer>
 #include <QByteArray>
 #include <QSettings>
+#include <QDir>
+#include <QRegularExpression>
+#include <QSet>
 
 #include <nlohmann/json.hpp>
 
@@ -17,6 +20,7 @@ using json = nlohmann::json;
 #include <QAudioSink>
 
 #include "piper/piper.hpp"
+#include "model/document.h"
 
 #include <iostream>
 
@@ -29,11 +33,32 @@ using json = nlohmann::json;
 #include <QDebug>
 #include <QDateTime>
 #include <QMessageBox>
+#include <QScreen>
+#include <QTimer>
 
 #if QT_CONFIG(permissions)
 #include <QPermission>
 #endif
 
+namespace
+{
+// piper voices in the order of the language combobox
+constexpr int  VoiceCount = 3;
+
+const char *VoiceNames[VoiceCount]     = { "en_US-lessac-high", "fa_IR-gyro-medium", "fa_IR-amir-medium" };
+const char *VoiceLanguages[VoiceCount] = { "en", "fa", "fa" };
+
+QString  phonemeCachePath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/phonemes.cache";
+}
+
+QString  sessionsPath()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/sessions";
+}
+}
+
 MainWindow::MainWindow(QWidget *parent):
     QMainWindow(parent)
     , ui(new Ui::MainWindow)
@@ -43,8 +68,23 @@ MainWindow::MainWindow(QWidget *parent):
     QSettings  settings;
     QString    modelPath = settings.value("model_path", "/home/mola/Data/Model/Meta-Llama-3.1-8B-Instruct-Q4_K_M.gguf").toString();
 
+    m_status.loadDefaults();
+    m_router.addDefaultIntents();
+
     m_model = new LlamaInterface();
 
+    QString  embeddingPath = settings.value("embedding_model_path").toString();
+    QString  dataDir       = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+
+    QDir().mkpath(dataDir);
+
+    if (!embeddingPath.isEmpty() && QFile::exists(embeddingPath))
+    {
+        m_model->loadEmbeddingModel(embeddingPath, dataDir + "/plant-documents.idx", settings.value("embedding_int8", false).toBool());
+    }
+
+    m_model->loadAnswerCache(dataDir + "/answer-cache.bin");
+
     if (QFile::exists(modelPath))
     {
         m_modelLoaded = m_model->loadModel(modelPath);
@@ -55,18 +95,66 @@ MainWindow::MainWindow(QWidget *parent):
         QMessageBox::warning(this, tr("Model Path"), tr("Please set model path in settings"), QMessageBox::Ok);
     }
 
+    // a second operator station shares the loaded weights, its conversation
+    // runs in a KV sequence of its own
+    if (m_modelLoaded && settings.value("second_station", false).toBool())
+    {
+        m_stations = new LlamaSessionManager(m_model->model(), 1, 2048);
+
+        if (m_stations->isValid() && m_stations->setSystemMessages(m_model->systemMessages()))
+        {
+            m_stationSession = m_stations->openSession(settings.value("station_answer_tokens", 512).toInt());
+        }
+
+        if (m_stationSession < 0)
+        {
+            qWarning() << "second station not usable";
+
+            delete m_stations;
+            m_stations = nullptr;
+        }
+    }
+
+    ui->groupStation->setVisible(m_stations != nullptr);
+
     m_thread = new QThread();
     m_model->moveToThread(m_thread);
+
+    if (m_stations)
+    {
+        // decodes between the jobs of the first station
+        m_stations->moveToThread(m_thread);
+
+        connect(m_stations, &LlamaSessionManager::answerReady, this, [this](int, const QString &piece)
+        {
+            ui->txtStation->insertPlainText(piece);
+        });
+        connect(m_stations, &LlamaSessionManager::generateFinished, this, [this](int, std::string)
+        {
+            ui->txtStation->insertPlainText("\n");
+        });
+        connect(m_stations, &LlamaSessionManager::errorOccure, this, [this](int, QString error)
+        {
+            ui->txtStation->insertPlainText(error + "\n");
+        });
+    }
+
     m_thread->start();
 
 
-    connect(m_model, &LlamaInterface::answerReady, this, [this](QString c)
-    {
-        ui->txtToSpeach->insertPlainText(c);
-    });
+    // generated text is shown once per frame instead of once per token
+    m_streamTimer = new QTimer(this);
+    m_streamTimer->setInterval(qMax(1, qRound(1000.0 / screen()->refreshRate())));
+    connect(m_streamTimer, &QTimer::timeout, this, &MainWindow::drainTokenStream);
 
     connect(m_model, &LlamaInterface::generateFinished, this, [this](std::string msg)
     {
+        if (m_stageClock.isValid())
+        {
+            m_governor.record(QualityGovernor::Generation, m_stageClock.elapsed());
+        }
+
+        drainTokenStream();
         ui->txtToSpeach->insertPlainText("\n");
         playText(msg);
     }, Qt::QueuedConnection);
@@ -82,8 +170,53 @@ MainWindow::MainWindow(QWidget *parent):
 
     auto  defaultDeviceInfo = m_devices->defaultAudioOutput();
 
+    // piper produces float, handing it over as is skips the conversion to
+    // int16 and the sink's conversion back
+    if (settings.value("tts_float_output", true).toBool())
+    {
+        QAudioFormat  floatFormat = format;
+
+        floatFormat.setSampleFormat(QAudioFormat::Float);
+
+        if (defaultDeviceInfo.isFormatSupported(floatFormat))
+        {
+            format = floatFormat;
+        }
+    }
+
     m_audioOutput = new QAudioSink(defaultDeviceInfo, format);
 
+    // the sink pulls answers from the synthesis thread as they are spoken,
+    // up to 4 s ahead
+    m_playback = new PlaybackDevice(4 * format.sampleRate(), format.sampleFormat(), this);
+    m_playback->open(QIODevice::ReadOnly);
+    m_audioOutput->start(m_playback);
+
+    m_synthesizer = new SpeechSynthesizer(m_playback);
+    m_synthThread = new QThread();
+    m_synthesizer->moveToThread(m_synthThread);
+    m_synthThread->start();
+
+    connect(m_synthesizer, &SpeechSynthesizer::playbackStarted, this, [this](qint64 synthesisMs)
+    {
+        if (m_audioOutput->state() == QAudio::StoppedState)
+        {
+            m_audioOutput->start(m_playback);
+        }
+
+        if (synthesisMs > 0)
+        {
+            m_governor.record(QualityGovernor::Synthesis, synthesisMs);
+        }
+
+        if (m_turnClock.isValid())
+        {
+            m_governor.record(QualityGovernor::EndToEnd, m_turnClock.elapsed());
+            m_turnClock.invalidate();
+            m_stageClock.invalidate();
+        }
+    });
+
     int  sampleRate   = 22050;                            // For example, or use pVoice.synthesisConfig.sampleRate
     int  channelCount = 1;                              // For example, or use pVoice.synthesisConfig.channels
     int  sampleSize   = 16;                               // bits per sample (pVoice.synthesisConfig.sampleWidth)
@@ -91,17 +224,83 @@ MainWindow::MainWindow(QWidget *parent):
     m_pConf.eSpeakDataPath = "espeak-ng-data";
     m_pConf.useESpeak      = true;
 
-    std::optional<piper::SpeakerId>  speakerId;
+    // sentences of an answer are synthesized side by side, each onnxruntime
+    // run gets a share of the cores
+    m_pConf.synthesisWorkers = qMax(1, settings.value("tts_workers", 2).toInt());
+    m_pConf.intraOpThreads   = settings.value("tts_intra_op_threads",
+                                              qMax(1, QThread::idealThreadCount() / m_pConf.synthesisWorkers)).toInt();
+
+    // batching sentences into one model run raises throughput but delays
+    // the sentences after the first, so it is off unless configured
+    m_pConf.maxBatchPhonemes  = settings.value("tts_batch_phonemes", 0).toInt();
+    m_pConf.maxBatchSentences = settings.value("tts_batch_sentences", 8).toInt();
+
+    // clauses spoken before skip espeak-ng, across restarts too
+    if (settings.value("phoneme_cache", true).toBool())
+    {
+        m_pConf.phonemizeCache = std::make_shared<piper::PhonemizeCache>();
+
+        if (!m_pConf.phonemizeCache->open(phonemeCachePath().toStdString()))
+        {
+            qWarning() << "phoneme cache not usable, keeping it in memory:" << phonemeCachePath();
+        }
+    }
+
+    // sentences spoken before, e.g. alerts and cached answers, skip piper
+    // entirely; the key covers voice and scales, so nothing is flushed when
+    // they change
+    if (settings.value("speech_cache", true).toBool())
+    {
+        auto  speechCache = std::make_shared<SpeechCache>(settings.value("speech_cache_mb", 256).toLongLong() * 1024 * 1024);
+
+        if (!speechCache->open(dataDir + "/speech-cache"))
+        {
+            qWarning() << "speech cache not usable, keeping it in memory:" << dataDir + "/speech-cache";
+        }
+
+        m_pConf.audioCache = speechCache;
+    }
+
+    // espeak-ng is set up once, phonemize_eSpeak picks the voice per call
+    piper::initialize(m_pConf);
+
+    m_voices.setMemoryBudget(settings.value("voice_memory_mb", 512).toLongLong() * 1024 * 1024);
+
+    // only with whisper_language "auto", a fixed language is never detected
+    m_voiceFollowsLanguage = settings.value("voice_follows_language", true).toBool();
+    m_languageThreshold    = settings.value("voice_follows_language_probability", 0.8).toFloat();
 
     on_language_currentIndexChanged(1);
 
+    // the other voices load on the synthesis thread, switching to them later
+    // is instant
+    QStringList  voices;
+
+    for (int i = 0; i < VoiceCount; i++)
+    {
+        voices << voiceModel(VoiceNames[i]);
+    }
+
+    QMetaObject::invokeMethod(m_synthesizer, [this, voices]()
+    {
+        m_voices.preload(voices);
+    }, Qt::QueuedConnection);
+
     // whisper audio recorder
 
     requestMicrophonePermission();
 
+    // steps quality down when voice answers get slow, see QualityGovernor
+    m_governor.setSloMs(settings.value("latency_slo_ms", 4000).toLongLong());
+    // queued, the level changes inside the playbackStarted handler
+    connect(&m_governor, &QualityGovernor::levelChanged, this, &MainWindow::applyQualityLevel, Qt::QueuedConnection);
+
     // whisper
     m_whisperTranscriber = new WhisperTranscriber();
-    m_whisperTranscriber->initialize("ggml-large-v3-turbo-q8_0.bin", "fa");
+    m_whisperLanguage    = settings.value("whisper_language", "fa").toString();
+    m_whisperTranscriber->initialize("ggml-large-v3-turbo-q8_0.bin", m_whisperLanguage);
+    m_whisperTranscriber->setSmallModel(settings.value("whisper_small_model", "ggml-base-q8_0.bin").toString());
+
     connect(m_whisperTranscriber, &WhisperTranscriber::transcriptionCompleted, this, &MainWindow::transcriptionCompleted);
 
     m_whisperThread = new QThread();
@@ -120,20 +319,99 @@ MainWindow::MainWindow(QWidget *parent):
     {
         std::cout << "User started speaking!" << std::endl;
     });
-    connect(m_audioStreamer, &AudioStreamer::userStoppedSpeaking, this, []()
+    connect(m_audioStreamer, &AudioStreamer::userStoppedSpeaking, this, [this]()
     {
         std::cout << "User stopped speaking!" << std::endl;
+        m_turnClock.start();
+        m_stageClock.start();
     });
     connect(m_audioStreamer, &AudioStreamer::audioDataLevel, this, [this](double lvl)
     {
         ui->lblLEvel->setText(QString::number(lvl, 'f', 6));
     });
 
-    connect(m_audioStreamer, &AudioStreamer::audioDataRaw, m_whisperTranscriber, &WhisperTranscriber::transcribeAudio, Qt::QueuedConnection);
+    // with the wake word on, only utterances starting with a keyword (or
+    // following one) reach Whisper. Off by default, the tiny model may be
+    // installed for other uses.
+    if (settings.value("wake_word", false).toBool())
+    {
+        m_wakeWord = new WakeWordGate();
+
+        if (!m_wakeWord->initialize(settings.value("wake_word_model", "ggml-tiny.bin").toString(), "fa"))
+        {
+            qWarning() << "wake word not usable, every utterance is transcribed";
+
+            delete m_wakeWord;
+            m_wakeWord = nullptr;
+        }
+    }
+
+    if (m_wakeWord)
+    {
+        m_wakeWord->setKeywords(settings.value("wake_words", QStringList { "hey bridge", "هی بریج" }).toStringList());
+        m_wakeWord->setSensitivity(settings.value("wake_word_sensitivity", 0.5).toDouble());
+        m_wakeWord->setRefractoryMs(settings.value("wake_word_refractory_ms", 2000).toInt());
+        m_wakeWord->setFollowUpMs(settings.value("wake_word_follow_up_ms", 8000).toInt());
+        m_wakeWord->setCpuBudget(settings.value("wake_word_cpu_percent", 5.0).toDouble());
+
+        m_wakeThread = new QThread();
+        m_wakeWord->moveToThread(m_wakeThread);
+        m_wakeThread->start();
+
+        connect(m_audioStreamer, &AudioStreamer::audioDataRaw, m_wakeWord, &WakeWordGate::processUtterance, Qt::QueuedConnection);
+        connect(m_audioStreamer, &AudioStreamer::audioDataPartial, m_wakeWord, &WakeWordGate::processPartial, Qt::QueuedConnection);
+        connect(m_wakeWord, &WakeWordGate::utteranceAccepted, m_whisperTranscriber, &WhisperTranscriber::transcribeAudio, Qt::QueuedConnection);
+        connect(m_wakeWord, &WakeWordGate::partialAccepted, this, &MainWindow::forwardPartial);
+    }
+    else
+    {
+        connect(m_audioStreamer, &AudioStreamer::audioDataRaw, m_whisperTranscriber, &WhisperTranscriber::transcribeAudio, Qt::QueuedConnection);
+        connect(m_audioStreamer, &AudioStreamer::audioDataPartial, this, &MainWindow::forwardPartial);
+    }
+
+    connect(m_whisperTranscriber, &WhisperTranscriber::partialTranscription, this, [this](const QString &text, bool endOfSpeech)
+    {
+        if (!text.contains("[") && m_modelLoaded)
+        {
+            const QString  question = m_wakeWord ? m_wakeWord->stripKeyword(text) : text;
+
+            QMetaObject::invokeMethod(m_model, [this, question, endOfSpeech]()
+            {
+                m_model->prefillPartial(question, endOfSpeech);
+            }, Qt::QueuedConnection);
+        }
+    });
+    connect(m_whisperTranscriber, &WhisperTranscriber::partialTranscription, m_audioStreamer, &AudioStreamer::setPartialTranscript);
+
+    // opt-in recordings of the microphone, for --evaluate-end-of-turn
+    if (settings.value("record_sessions", false).toBool())
+    {
+        QDir().mkpath(sessionsPath());
+        m_audioStreamer->setSessionRecording(sessionsPath() + "/" + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss") + ".wav");
+    }
 }
 
 MainWindow::~MainWindow()
 {
+    if (m_synthThread)
+    {
+        m_synthesizer->cancel();
+        m_synthThread->quit();
+        m_synthThread->wait();
+        delete m_synthThread;
+    }
+
+    delete m_synthesizer;
+
+    if (m_wakeThread)
+    {
+        m_wakeThread->quit();
+        m_wakeThread->wait();
+        delete m_wakeThread;
+    }
+
+    delete m_wakeWord;
+
     if (m_whisperThread)
     {
         m_whisperThread->quit();
@@ -162,49 +440,187 @@ MainWindow::~MainWindow()
         delete m_thread;
     }
 
+    // its context uses the model's weights
+    delete m_stations;
     delete m_model;
 
     delete ui;
-    delete m_pVoice;
+
+    piper::terminate(m_pConf);
+}
+
+int  MainWindow::prewarmPhonemes()
+{
+    const QString          path = phonemeCachePath();
+    piper::PiperConfig     config;
+    piper::PhonemizeCache  cache;
+
+    QDir().mkpath(QFileInfo(path).path());
+
+    if (!cache.open(path.toStdString()))
+    {
+        qWarning() << "cannot open phoneme cache" << path;
+
+        return 1;
+    }
+
+    config.eSpeakDataPath = "espeak-ng-data";
+    config.useESpeak      = true;
+    piper::initialize(config);
+
+    // espeak voices of the installed piper voices
+    QSet<QString>  voices;
+
+    for (int i = 0; i < VoiceCount; i++)
+    {
+        QFile  file(QString(VoiceNames[i]) + ".onnx.json");
+
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            continue;
+        }
+
+        json  root = json::parse(file.readAll().toStdString(), nullptr, false);
+
+        if (!root.is_discarded() && root.contains("espeak") && root["espeak"].contains("voice"))
+        {
+            voices.insert(QString::fromStdString(root["espeak"]["voice"].get<std::string>()));
+        }
+    }
+
+    // the document lines are concatenated without separators, break them
+    // where the answers quoting them would
+    QString  text = QString::fromStdString(documents);
+
+    text.replace(QRegularExpression("([.!?:])(?=[A-Z#-])"), "\\1\n");
+
+    for (const QString &voice : voices)
+    {
+        try
+        {
+            const size_t  added = cache.prewarm(text.toStdString(), voice.toStdString());
+
+            qInfo() << "prewarmed" << added << "clauses for espeak voice" << voice;
+        }
+        catch (const std::exception &e)
+        {
+            qWarning() << "prewarming espeak voice" << voice << "failed:" << e.what();
+        }
+    }
+
+    const piper::PhonemizeCacheStats  stats = cache.stats();
+
+    qInfo() << stats.diskEntries << "clauses in" << path;
+
+    piper::terminate(config);
+
+    return 0;
+}
+
+int  MainWindow::evaluateEndOfTurn(const QStringList &files)
+{
+    QStringList  sessions = files;
+
+    if (sessions.isEmpty())
+    {
+        const QDir  dir(sessionsPath());
+
+        for (const QString &name : dir.entryList({ "*.wav" }, QDir::Files, QDir::Name))
+        {
+            sessions.append(dir.filePath(name));
+        }
+    }
+
+    if (sessions.isEmpty())
+    {
+        qWarning() << "no recorded sessions in" << sessionsPath() << ", set record_sessions to record them";
+
+        return 1;
+    }
+
+    // the VAD threshold and the detector the microphone would use, without
+    // starting it
+    AudioStreamer                        streamer;
+    const AudioStreamer::TurnEvaluation  evaluation = streamer.evaluateEndOfTurn(sessions);
+
+    return (evaluation.turns > 0) ? 0 : 1;
 }
 
 void  MainWindow::on_speakButton_clicked()
 {
     auto  text = ui->txtToSpeach->toPlainText();
 
+    // not a turn, e.g. after an utterance the wake word gate dropped
+    m_turnClock.invalidate();
+    m_stageClock.invalidate();
+
     playText(text.toStdString());
 }
 
 void  MainWindow::on_language_currentIndexChanged(int index)
 {
-    std::optional<piper::SpeakerId>  speakerId;
+    // the synthesis thread finishes its sentence, the voice changes after it
+    m_synthesizer->cancel();
 
-    piper::terminate(m_pConf);
-    delete m_pVoice;
-    m_pVoice = new piper::Voice();
+    selectVoice(index);
+}
 
-    if (index == 0)
+void  MainWindow::selectVoice(int index)
+{
+    const QualityGovernor::Level  quality = QualityGovernor::settings(m_governor.level());
+    QString                       name;
+
+    if ((index >= 0) && (index < VoiceCount))
     {
-        piper::loadVoice(m_pConf, "en_US-lessac-high.onnx", "en_US-lessac-high.onnx.json", *m_pVoice, speakerId, false);
+        name = voiceModel(VoiceNames[index]);
     }
 
-    if (index == 1)
+    m_lowQualityVoice = quality.lowQualityVoice;
+
+    // the voices are only touched on the synthesis thread, queued calls run
+    // between answers
+    QMetaObject::invokeMethod(m_synthesizer, [this, name, lengthScale = quality.lengthScale]()
     {
-        piper::loadVoice(m_pConf, "fa_IR-gyro-medium.onnx", "fa_IR-gyro-medium.onnx.json", *m_pVoice, speakerId, false);
-    }
+        m_pVoice = name.isEmpty() ? nullptr : m_voices.voice(name);
+
+        if (m_pVoice)
+        {
+            m_voiceLengthScale                    = m_voices.lengthScale(name);
+            m_pVoice->synthesisConfig.lengthScale = m_voiceLengthScale * lengthScale;
+        }
 
-    if (index == 2)
+        m_synthesizer->setVoice(&m_pConf, m_pVoice);
+    }, Qt::QueuedConnection);
+}
+
+void  MainWindow::on_pbStationSend_clicked()
+{
+    const QString  text    = ui->lineStationText->text();
+    const int      session = m_stationSession;
+
+    if (!m_stations || text.isEmpty())
     {
-        piper::loadVoice(m_pConf, "fa_IR-amir-medium.onnx", "fa_IR-amir-medium.onnx.json", *m_pVoice, speakerId, false);
+        return;
     }
 
-    piper::initialize(m_pConf);
+    ui->txtStation->insertPlainText(text + "\n");
+    ui->lineStationText->clear();
+
+    QMetaObject::invokeMethod(m_stations, [this, session, text]()
+    {
+        m_stations->ask(session, text);
+    }, Qt::QueuedConnection);
 }
 
 void  MainWindow::on_pbSend_clicked()
 {
     auto  str = ui->lineModelText->text();
-    QMetaObject::invokeMethod(m_model, "generate", Qt::QueuedConnection, Q_ARG(QString, str));
+
+    m_turnClock.start();
+    m_stageClock.start();
+    m_model->submit(str, GenerationJob::Normal, -1, QualityGovernor::settings(m_governor.level()).answerTokens);
+    m_streamIdleTicks = 0;
+    m_streamTimer->start();
 
     // m_model->askQuestion(ui->lineModelText->text());
 }
@@ -235,28 +651,104 @@ void  MainWindow::requestMicrophonePermission()
 
 void  MainWindow::playText(std::string msg)
 {
-    std::vector<int16_t>    audioBuffer;
-    piper::SynthesisResult  result = { };
+    // sentences spoken before come from the speech cache
+    QMetaObject::invokeMethod(m_synthesizer, [this, msg]()
+    {
+        m_synthesizer->speak(msg);
+    }, Qt::QueuedConnection);
+}
+
+QString  MainWindow::voiceModel(const QString &name) const
+{
+    if (!QualityGovernor::settings(m_governor.level()).lowQualityVoice)
+    {
+        return name;
+    }
+
+    QString  lower = name;
+
+    if (lower.endsWith("-high"))
+    {
+        lower.replace("-high", "-medium");
+    }
+    else
+    {
+        lower.replace("-medium", "-low");
+    }
+
+    if ((lower == name) || !QFile::exists(lower + ".onnx"))
+    {
+        return name;
+    }
+
+    return lower;
+}
+
+void  MainWindow::applyQualityLevel(int level, const QString &reason)
+{
+    const QualityGovernor::Level  settings = QualityGovernor::settings(level);
+
+    statusBar()->showMessage(tr("Quality level %1: %2").arg(level).arg(reason));
+
+    QMetaObject::invokeMethod(m_whisperTranscriber, [this, settings]()
+    {
+        m_whisperTranscriber->setQuality(settings.whisperFast, settings.whisperSmall);
+    }, Qt::QueuedConnection);
+
+    // the current answer keeps its voice, the next one gets the new settings
+    if (settings.lowQualityVoice != m_lowQualityVoice)
+    {
+        // loading the voice also applies the length scale
+        selectVoice(ui->language->currentIndex());
+    }
+    else
+    {
+        QMetaObject::invokeMethod(m_synthesizer, [this, lengthScale = settings.lengthScale]()
+        {
+            if (m_pVoice)
+            {
+                m_pVoice->synthesisConfig.lengthScale = m_voiceLengthScale * lengthScale;
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+void  MainWindow::drainTokenStream()
+{
+    QString  text = m_model->tokenStream()->read();
 
-    piper::textToAudio(m_pConf, *m_pVoice, msg, audioBuffer, result, nullptr);
+    if (text.isEmpty())
+    {
+        // stop polling after a few idle seconds, the next question restarts it
+        if (++m_streamIdleTicks * m_streamTimer->interval() > 5000)
+        {
+            m_streamTimer->stop();
+        }
 
-    QByteArray  audioData(reinterpret_cast<const char *>(audioBuffer.data()),
-                          static_cast<int>(audioBuffer.size() * sizeof(int16_t)));
+        return;
+    }
 
-    // Use a QBuffer to wrap the data for streaming playback.
-    // QBuffer *audioBufferQ = new QBuffer;
-    // audioBufferQ->setData(audioData);
-    auto  io = m_audioOutput->start();
+    m_streamIdleTicks = 0;
 
-    io->write(audioData.data(), audioData.size());
+    // one document edit for everything that arrived since the last frame
+    ui->txtToSpeach->moveCursor(QTextCursor::End);
+    ui->txtToSpeach->insertPlainText(text);
 }
 
 void  MainWindow::on_sendSpeechBtn_clicked()
 {
 }
 
-void  MainWindow::transcriptionCompleted(const QString &text, QPair<QString, QString> language)
+void  MainWindow::transcriptionCompleted(const QString &transcript, QPair<QString, QString> language, float languageProbability)
 {
+    // the question without the wake word
+    const QString  text = m_wakeWord ? m_wakeWord->stripKeyword(transcript) : transcript;
+
+    if (m_stageClock.isValid())
+    {
+        m_governor.record(QualityGovernor::Transcription, m_stageClock.elapsed());
+    }
+
     ui->speechTxtEdit->clear();
     ui->speechTxtEdit->setText(text);
     statusBar()->showMessage("language: " + language.first + " : " + language.second);
@@ -267,8 +759,22 @@ void  MainWindow::transcriptionCompleted(const QString &text, QPair<QString, QSt
         return;
     }
 
-    if (!ui->language->currentText().startsWith(language.first, Qt::CaseInsensitive))
+    // answer in the voice of the language spoken, the current one if it fits
+    // or whisper is not sure about it
+    const int   current  = ui->language->currentIndex();
+    const bool  detected = (m_whisperLanguage == "auto") && (languageProbability >= m_languageThreshold);
+
+    if (m_voiceFollowsLanguage && detected && !language.first.isEmpty() &&
+        ((current < 0) || (current >= VoiceCount) || (language.first != VoiceLanguages[current])))
     {
+        for (int i = 0; i < VoiceCount; i++)
+        {
+            if (language.first == VoiceLanguages[i])
+            {
+                ui->language->setCurrentIndex(i);
+                break;
+            }
+        }
     }
 
     if (m_modelLoaded)
@@ -278,7 +784,35 @@ void  MainWindow::transcriptionCompleted(const QString &text, QPair<QString, QSt
             return;
         }
 
-        QMetaObject::invokeMethod(m_model, "generate", Qt::QueuedConnection, Q_ARG(QString, text));
+        QString  answer;
+
+        if (m_router.route(text, answer))
+        {
+            ui->txtToSpeach->insertPlainText(answer + "\n");
+            playText(answer.toStdString());
+
+            return;
+        }
+
+        // spoken questions go before typed ones
+        m_stageClock.start();
+        m_model->submit(text, GenerationJob::Interactive, -1, QualityGovernor::settings(m_governor.level()).answerTokens);
+        m_streamIdleTicks = 0;
+        m_streamTimer->start();
+    }
+}
+
+void  MainWindow::forwardPartial(std::vector<float> pcm, bool endOfSpeech)
+{
+    // partial transcripts prefill the LLM while the user is still talking and
+    // tell the end-of-turn detector whether the sentence is finished, skipped
+    // while Whisper is busy so the final transcript never waits
+    if (!m_whisperTranscriber->isBusy())
+    {
+        QMetaObject::invokeMethod(m_whisperTranscriber, [this, pcm, endOfSpeech]()
+        {
+            m_whisperTranscriber->transcribePartial(pcm, endOfSpeech);
+        }, Qt::QueuedConnection);
     }
 }
 
@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QAudioFormat>
 #include <QAudioOutput>
@@ -10,11 +11,21 @@
 #include <QAudioSource>
 #include <QIODevice>
 #include <QThread>
+#include <QTimer>
 
 #include "piper/piper.hpp"
 #include "model/llamamodel.h"
+#include "model/llamasessionmanager.h"
+#include "model/intentrouter.h"
+#include "model/statusstore.h"
 #include "audio/audiostreamer.h"
+#include "audio/wakewordgate.h"
+#include "audio/playbackdevice.h"
+#include "audio/speechsynthesizer.h"
+#include "audio/speechcache.h"
+#include "audio/voiceregistry.h"
 #include "whispertranscriber.h"
+#include "qualitygovernor.h"
 
 #include <fftw3.h> // Include FFTW3 header
 
@@ -35,6 +46,16 @@ public:
 
     ~MainWindow();
 
+    // Phonemize the plant documents into the phoneme cache with every
+    // installed voice, for --prewarm-phonemes. Returns the exit code.
+    static int  prewarmPhonemes();
+
+    // Replay recorded sessions through the end-of-turn detector and print the
+    // saved latency and premature cut rate, for --evaluate-end-of-turn. With
+    // no files, every session recorded with record_sessions is used. Returns
+    // the exit code.
+    static int  evaluateEndOfTurn(const QStringList &files);
+
 private slots:
     void  on_speakButton_clicked();
 
@@ -42,9 +63,12 @@ private slots:
 
     void  on_pbSend_clicked();
 
+    // Question of the second operator station, see LlamaSessionManager.
+    void  on_pbStationSend_clicked();
+
     void  on_sendSpeechBtn_clicked();
 
-    void  transcriptionCompleted(const QString &text, QPair<QString, QString> language);
+    void  transcriptionCompleted(const QString &text, QPair<QString, QString> language, float languageProbability);
 
     void  on_pbRecord_toggled(bool checked);
 
@@ -52,23 +76,67 @@ private slots:
 
     void  on_spinThreshold_valueChanged(double arg1);
 
+    // Show the text generated since the last call.
+    void  drainTokenStream();
+
+    // Partial utterance to Whisper, unless it is busy with another one.
+    void  forwardPartial(std::vector<float> pcm, bool endOfSpeech);
+
+    // Pass the governor's quality level on to Whisper and piper.
+    void  applyQualityLevel(int level, const QString &reason);
+
 private:
     void  requestMicrophonePermission();
 
     void  playText(std::string msg);
 
+    // Voice file name without extension, a lower quality variant if the
+    // quality level asks for one and it is installed.
+    QString  voiceModel(const QString &name) const;
+
+    // Loads the voice of the language index at the current quality level,
+    // queued on the synthesis thread so it applies between answers.
+    void     selectVoice(int index);
+
 private:
     Ui::MainWindow     *ui;
     piper::PiperConfig  m_pConf;
-    piper::Voice       *m_pVoice      = nullptr;
+    piper::Voice       *m_pVoice      = nullptr; // current voice, owned by m_voices, synthesis thread only
     QMediaDevices      *m_devices     = nullptr;
     QAudioSink         *m_audioOutput = nullptr;
     LlamaInterface     *m_model       = nullptr;
     bool                m_modelLoaded = false;
+    LlamaSessionManager *m_stations = nullptr; // second_station setting, model thread
+    int                 m_stationSession = -1;
     QThread            *m_thread      = nullptr;
     WhisperTranscriber *m_whisperTranscriber;
     QThread            *m_whisperThread = nullptr;
     AudioStreamer      *m_audioStreamer = nullptr;
     QThread            *m_audioThread   = nullptr;
+    WakeWordGate       *m_wakeWord      = nullptr;
+    QThread            *m_wakeThread    = nullptr;
+    PlaybackDevice     *m_playback      = nullptr;
+    SpeechSynthesizer  *m_synthesizer   = nullptr;
+    QThread            *m_synthThread   = nullptr;
+    QTimer             *m_streamTimer   = nullptr;
+    int                 m_streamIdleTicks = 0;
+
+    // Voices stay loaded between language switches
+    VoiceRegistry                m_voices { &m_pConf };
+    bool                         m_voiceFollowsLanguage = true;
+    float                        m_languageThreshold    = 0.8f; // detection probability to switch the voice
+    QString                      m_whisperLanguage;
+
+    // Status questions are answered without the LLM
+    StatusStore                  m_status;
+    IntentRouter                 m_router { &m_status };
+
+    // Latency of the current turn, from the end of speech (or submit) and
+    // from the start of the current stage
+    QualityGovernor              m_governor;
+    QElapsedTimer                m_turnClock;
+    QElapsedTimer                m_stageClock;
+    float                        m_voiceLengthScale = 1.0f; // from the voice config, synthesis thread only
+    bool                         m_lowQualityVoice  = false;
 };
 #endif // MAINWINDOW_H
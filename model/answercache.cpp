@@ -0,0 +1,419 @@
+#include "answercache.h"
+#include "textembedder.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+
+namespace
+{
+const quint32  CACHE_MAGIC   = 0x51564143; // "QVAC"
+const quint32  CACHE_VERSION = 1;
+
+float  dot(const std::vector<float> &a, const std::vector<float> &b)
+{
+    float  sum = 0.0f;
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+}
+
+AnswerCache::AnswerCache(int capacity):
+    m_capacity(capacity)
+{
+}
+
+void  AnswerCache::setEmbedder(TextEmbedder *embedder)
+{
+    m_embedder = embedder;
+}
+
+void  AnswerCache::setThreshold(float threshold)
+{
+    m_threshold = threshold;
+}
+
+void  AnswerCache::setEntities(const QStringList &entities)
+{
+    m_entities.clear();
+
+    for (const QString &entity : entities)
+    {
+        m_entities.insert(normalize(entity));
+    }
+}
+
+void  AnswerCache::setDocument(const std::string &id, uint64_t hash)
+{
+    m_documents[id] = hash;
+
+    for (size_t i = m_entries.size(); i-- > 0; )
+    {
+        if (isStale(m_entries[i]))
+        {
+            remove(i);
+        }
+    }
+}
+
+bool  AnswerCache::lookup(const QString &question, std::string &answer)
+{
+    const std::string  key = normalize(question);
+
+    m_stats.lookups++;
+    m_lastKey.clear();
+    m_lastEmbedding.clear();
+
+    if (key.empty())
+    {
+        return false;
+    }
+
+    auto  it = m_exact.find(key);
+
+    if (it != m_exact.end())
+    {
+        m_stats.exactHits++;
+        hit(m_entries[it->second], answer);
+
+        return true;
+    }
+
+    if (!embed(key, m_lastEmbedding))
+    {
+        return false;
+    }
+
+    m_lastKey = key;
+
+    const std::string  keyFacts  = facts(key);
+    Entry             *best      = nullptr;
+    float              bestScore = m_threshold;
+
+    for (auto &entry : m_entries)
+    {
+        if (entry.embedding.size() != m_lastEmbedding.size())
+        {
+            continue;
+        }
+
+        const float  score = dot(entry.embedding, m_lastEmbedding);
+
+        if ((score >= bestScore) && (facts(entry.key) == keyFacts))
+        {
+            best      = &entry;
+            bestScore = score;
+        }
+    }
+
+    if (!best)
+    {
+        return false;
+    }
+
+    qDebug() << "Answer cache: semantic match" << QString::fromStdString(best->key) << "score" << bestScore;
+
+    m_stats.semanticHits++;
+    hit(*best, answer);
+
+    return true;
+}
+
+void  AnswerCache::insert(const QString &question, const std::string &answer,
+                          const std::vector<std::string> &documents, qint64 generationMs)
+{
+    const std::string  key = normalize(question);
+
+    if (key.empty() || answer.empty() || (m_capacity <= 0))
+    {
+        return;
+    }
+
+    auto  it = m_exact.find(key);
+
+    if (it != m_exact.end())
+    {
+        remove(it->second);
+    }
+
+    Entry  entry;
+
+    entry.key          = key;
+    entry.answer       = answer;
+    entry.generationMs = generationMs;
+    entry.lastUse      = ++m_clock;
+
+    for (const auto &id : documents)
+    {
+        auto  document = m_documents.find(id);
+
+        entry.documents.push_back({ id, document != m_documents.end() ? document->second : 0 });
+    }
+
+    if (key == m_lastKey)
+    {
+        entry.embedding.swap(m_lastEmbedding);
+        m_lastKey.clear();
+    }
+    else
+    {
+        embed(key, entry.embedding);
+    }
+
+    if ((int)m_entries.size() >= m_capacity)
+    {
+        size_t  oldest = 0;
+
+        for (size_t i = 1; i < m_entries.size(); ++i)
+        {
+            if (m_entries[i].lastUse < m_entries[oldest].lastUse)
+            {
+                oldest = i;
+            }
+        }
+
+        remove(oldest);
+    }
+
+    m_exact[key] = m_entries.size();
+    m_entries.push_back(std::move(entry));
+}
+
+void  AnswerCache::clear()
+{
+    m_entries.clear();
+    m_exact.clear();
+    m_lastKey.clear();
+    m_lastEmbedding.clear();
+}
+
+int  AnswerCache::size() const
+{
+    return m_entries.size();
+}
+
+AnswerCache::Stats  AnswerCache::stats() const
+{
+    return m_stats;
+}
+
+bool  AnswerCache::load(const QString &path)
+{
+    QFile  file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+
+    QDataStream  in(&file);
+    quint32      magic   = 0;
+    quint32      version = 0;
+    quint32      count   = 0;
+
+    in >> magic >> version >> count;
+
+    if ((magic != CACHE_MAGIC) || (version != CACHE_VERSION))
+    {
+        qWarning() << "Ignoring answer cache with unknown format:" << path;
+
+        return false;
+    }
+
+    clear();
+
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+    {
+        QByteArray    key;
+        QByteArray    answer;
+        QList<float>  embedding;
+        quint32       documents = 0;
+        Entry         entry;
+
+        in >> key >> answer >> embedding >> entry.generationMs >> documents;
+
+        for (quint32 d = 0; d < documents && in.status() == QDataStream::Ok; ++d)
+        {
+            QByteArray  id;
+            quint64     hash = 0;
+
+            in >> id >> hash;
+            entry.documents.push_back({ id.toStdString(), hash });
+        }
+
+        entry.key     = key.toStdString();
+        entry.answer  = answer.toStdString();
+        entry.lastUse = ++m_clock;
+        entry.embedding.assign(embedding.begin(), embedding.end());
+
+        if (isStale(entry))
+        {
+            continue;
+        }
+
+        m_exact[entry.key] = m_entries.size();
+        m_entries.push_back(std::move(entry));
+    }
+
+    if (in.status() != QDataStream::Ok)
+    {
+        qWarning() << "Answer cache is truncated:" << path;
+        clear();
+
+        return false;
+    }
+
+    return true;
+}
+
+bool  AnswerCache::save(const QString &path) const
+{
+    QSaveFile  file(path);
+
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        return false;
+    }
+
+    QDataStream  out(&file);
+
+    out << CACHE_MAGIC << CACHE_VERSION << quint32(m_entries.size());
+
+    for (const auto &entry : m_entries)
+    {
+        out << QByteArray::fromStdString(entry.key) << QByteArray::fromStdString(entry.answer)
+            << QList<float>(entry.embedding.begin(), entry.embedding.end()) << entry.generationMs
+            << quint32(entry.documents.size());
+
+        for (const auto &document : entry.documents)
+        {
+            out << QByteArray::fromStdString(document.first) << quint64(document.second);
+        }
+    }
+
+    return file.commit();
+}
+
+std::string  AnswerCache::normalize(const QString &question)
+{
+    QString  text;
+
+    text.reserve(question.size());
+
+    for (QChar c : question)
+    {
+        // harakat and other combining marks
+        if (c.category() == QChar::Mark_NonSpacing)
+        {
+            continue;
+        }
+
+        switch (c.unicode())
+        {
+        case 0x064A: // Arabic yeh
+        case 0x0649: // alef maksura
+            c = QChar(0x06CC);
+            break;
+        case 0x0643: // Arabic kaf
+            c = QChar(0x06A9);
+            break;
+        case 0x200C: // zero width non-joiner
+            c = QChar(' ');
+            break;
+        default:
+            break;
+        }
+
+        text.append((c.isPunct() || c.isSymbol()) ? QChar(' ') : c.toLower());
+    }
+
+    return text.simplified().toStdString();
+}
+
+bool  AnswerCache::embed(const std::string &key, std::vector<float> &embedding)
+{
+    embedding.clear();
+
+    return m_embedder && m_embedder->isLoaded() && m_embedder->embed(key, embedding);
+}
+
+std::string  AnswerCache::facts(const std::string &key) const
+{
+    QStringList  words;
+
+    for (const QString &word : QString::fromStdString(key).split(' ', Qt::SkipEmptyParts))
+    {
+        QString  ascii;
+        bool     number = false;
+
+        // Persian and Arabic-Indic digits count as their value
+        for (QChar c : word)
+        {
+            if (c.isDigit())
+            {
+                ascii.append(QChar('0' + c.digitValue()));
+                number = true;
+            }
+            else
+            {
+                ascii.append(c);
+            }
+        }
+
+        if (number || m_entities.count(word.toStdString()))
+        {
+            words.append(ascii);
+        }
+    }
+
+    words.sort();
+
+    return words.join(' ').toStdString();
+}
+
+bool  AnswerCache::isStale(const Entry &entry) const
+{
+    for (const auto &document : entry.documents)
+    {
+        auto  it = m_documents.find(document.first);
+
+        if ((it != m_documents.end()) && (it->second != document.second))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void  AnswerCache::hit(Entry &entry, std::string &answer)
+{
+    entry.lastUse    = ++m_clock;
+    answer           = entry.answer;
+    m_stats.savedMs += entry.generationMs;
+
+    const int  hits = m_stats.exactHits + m_stats.semanticHits;
+
+    qDebug() << "Answer cache hit rate" << hits << "/" << m_stats.lookups << "(" << m_stats.exactHits << "exact),"
+             << m_stats.savedMs << "ms of generation saved";
+}
+
+void  AnswerCache::remove(size_t index)
+{
+    m_exact.erase(m_entries[index].key);
+
+    // move the last entry into the gap
+    if (index + 1 != m_entries.size())
+    {
+        m_entries[index]              = std::move(m_entries.back());
+        m_exact[m_entries[index].key] = index;
+    }
+
+    m_entries.pop_back();
+}
@@ -0,0 +1,109 @@
+#ifndef ANSWERCACHE_H
+#define ANSWERCACHE_H
+
+#include <QString>
+#include <QStringList>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class TextEmbedder;
+
+// Answers to questions that were already asked, so repeated questions skip
+// generation.
+//
+// The exact tier matches the normalized question text (case, punctuation,
+// diacritics and Arabic/Persian letter variants are ignored). The semantic
+// tier, available when an embedder is set, matches the closest earlier
+// question whose cosine similarity is at least the threshold and that has
+// the same numbers and entity names, as "unit 1" and "unit 2" embed alike.
+// Every entry records the hashes of the documents its answer was based on and
+// is dropped when one of them changes. The least recently used entry is
+// dropped when the cache is full.
+class AnswerCache
+{
+public:
+    struct Stats
+    {
+        int     lookups;
+        int     exactHits;
+        int     semanticHits;
+        qint64  savedMs;    // generation time of the answers served from the cache
+    };
+
+    explicit AnswerCache(int capacity = 256);
+
+    // Enables the semantic tier, nullptr disables it.
+    void                setEmbedder(TextEmbedder *embedder);
+
+    void                setThreshold(float threshold);
+
+    // Words (unit kinds, equipment, places) a semantic match must share.
+    void                setEntities(const QStringList &entities);
+
+    // Current hash of a document, entries based on an older version are dropped.
+    void                setDocument(const std::string &id, uint64_t hash);
+
+    bool                lookup(const QString &question, std::string &answer);
+
+    // Store the answer generated for question in generationMs from documents.
+    void                insert(const QString &question, const std::string &answer,
+                               const std::vector<std::string> &documents, qint64 generationMs);
+
+    void                clear();
+
+    int                 size() const;
+
+    Stats               stats() const;
+
+    // Keep answers across restarts. Entries based on documents that changed
+    // since are dropped.
+    bool                load(const QString &path);
+
+    bool                save(const QString &path) const;
+
+    static std::string  normalize(const QString &question);
+
+private:
+    struct Entry
+    {
+        std::string                                    key;
+        std::string                                    answer;
+        std::vector<float>                             embedding;
+        std::vector<std::pair<std::string, uint64_t>>  documents;
+        qint64                                         generationMs;
+        uint64_t                                       lastUse;
+    };
+
+    bool  embed(const std::string &key, std::vector<float> &embedding);
+
+    // Numbers and entity names of a normalized question, sorted.
+    std::string  facts(const std::string &key) const;
+
+    // Based on a document whose current hash is different.
+    bool  isStale(const Entry &entry) const;
+
+    void  hit(Entry &entry, std::string &answer);
+
+    void  remove(size_t index);
+
+private:
+    TextEmbedder                                  *m_embedder  = nullptr;
+    float                                          m_threshold = 0.92f;
+    int                                            m_capacity;
+    uint64_t                                       m_clock = 0;
+    std::vector<Entry>                             m_entries;
+    std::unordered_map<std::string, size_t>        m_exact;
+    std::unordered_map<std::string, uint64_t>      m_documents;
+    std::unordered_set<std::string>                m_entities;
+    Stats                                          m_stats = { };
+
+    // embedding of the last missed question, reused by insert()
+    std::string                                    m_lastKey;
+    std::vector<float>                             m_lastEmbedding;
+};
+
+#endif // ANSWERCACHE_H
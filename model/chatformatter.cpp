@@ -0,0 +1,156 @@
+#include "chatformatter.h"
+
+#include "llama.h"
+#include <QDebug>
+
+#include <algorithm>
+
+namespace
+{
+// incremental turns compared with a full render before it is trusted
+const int  SELF_CHECKS = 2;
+}
+
+ChatFormatter::ChatFormatter(const char *tmpl):
+    m_template(tmpl)
+{
+}
+
+void  ChatFormatter::setTemplate(const char *tmpl)
+{
+    m_template    = tmpl;
+    m_incremental = true;
+    m_checks      = 0;
+}
+
+bool  ChatFormatter::delta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                           std::string &text)
+{
+    if (m_incremental && (first > 0) && (first <= messages.size()) && anchoredDelta(messages, first, addAssistant, text))
+    {
+        if (m_checks >= SELF_CHECKS)
+        {
+            m_incrementalCount++;
+
+            return true;
+        }
+
+        std::string  expected;
+
+        if (!fullDelta(messages, first, addAssistant, expected))
+        {
+            return false;
+        }
+
+        if (expected == text)
+        {
+            m_checks++;
+            m_incrementalCount++;
+
+            return true;
+        }
+
+        qWarning() << "Chat template depends on earlier messages, using full renders";
+        m_incremental = false;
+        m_fullCount++;
+        text.swap(expected);
+
+        return true;
+    }
+
+    if (!fullDelta(messages, first, addAssistant, text))
+    {
+        return false;
+    }
+
+    m_fullCount++;
+
+    return true;
+}
+
+bool  ChatFormatter::isIncremental() const
+{
+    return m_incremental;
+}
+
+int  ChatFormatter::incrementalCount() const
+{
+    return m_incrementalCount;
+}
+
+int  ChatFormatter::fullCount() const
+{
+    return m_fullCount;
+}
+
+int  ChatFormatter::render(const llama_chat_message *messages, size_t count, bool addAssistant)
+{
+    if (m_buffer.empty())
+    {
+        m_buffer.resize(4096);
+    }
+
+    int  len = llama_chat_apply_template(m_template, messages, count, addAssistant, m_buffer.data(), m_buffer.size());
+
+    if (len > (int)m_buffer.size())
+    {
+        m_buffer.resize(len);
+        len = llama_chat_apply_template(m_template, messages, count, addAssistant, m_buffer.data(), m_buffer.size());
+    }
+
+    return len;
+}
+
+bool  ChatFormatter::anchoredDelta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                                   std::string &text)
+{
+    // the last evaluated message is rendered alone and with the new ones
+    const llama_chat_message *anchor    = messages.data() + first - 1;
+    const int                 anchorLen = render(anchor, 1, false);
+
+    if (anchorLen < 0)
+    {
+        return false;
+    }
+
+    const std::string  anchorText(m_buffer.data(), anchorLen);
+    const int          len = render(anchor, messages.size() - first + 1, addAssistant);
+
+    // the anchor must render the same way when followed by other messages
+    if ((len < anchorLen) || (anchorText.compare(0, anchorLen, m_buffer.data(), anchorLen) != 0))
+    {
+        qWarning() << "Chat template does not render messages independently, using full renders";
+        m_incremental = false;
+
+        return false;
+    }
+
+    text.assign(m_buffer.data() + anchorLen, len - anchorLen);
+
+    return true;
+}
+
+bool  ChatFormatter::fullDelta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                               std::string &text)
+{
+    first = std::min(first, messages.size());
+
+    int  prefixLen = 0;
+
+    if (first > 0)
+    {
+        prefixLen = render(messages.data(), first, false);
+    }
+
+    const int  len = render(messages.data(), messages.size(), addAssistant);
+
+    if ((prefixLen < 0) || (len < prefixLen))
+    {
+        return false;
+    }
+
+    // remove previous messages to obtain the new part
+    text.assign(m_buffer.data() + prefixLen, len - prefixLen);
+
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef CHATFORMATTER_H
+#define CHATFORMATTER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct llama_chat_message;
+
+// Renders only the messages appended to a conversation with the model's chat
+// template, so the cost of a turn does not grow with the history.
+//
+// llama_chat_apply_template() can only render whole conversations. The new
+// messages are rendered together with the message before them as an anchor
+// and the anchor's own rendering is cut off, which gives the same text as
+// rendering everything for templates that format each message on its own.
+// The first turns are checked against a full render and the formatter falls
+// back to full renders for templates where the two differ.
+class ChatFormatter
+{
+public:
+    explicit ChatFormatter(const char *tmpl = nullptr);
+
+    void         setTemplate(const char *tmpl);
+
+    // Text for messages[first..] following the already evaluated
+    // messages[0..first), with the assistant prefix if addAssistant is set.
+    // Returns false if the template could not be applied.
+    bool         delta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                       std::string &text);
+
+    bool         isIncremental() const;
+
+    // Turns rendered from the anchor only and with a full render.
+    int          incrementalCount() const;
+
+    int          fullCount() const;
+
+private:
+    // Render count messages into m_buffer, returns the length or -1.
+    int          render(const llama_chat_message *messages, size_t count, bool addAssistant);
+
+    bool         anchoredDelta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                               std::string &text);
+
+    bool         fullDelta(const std::vector<llama_chat_message> &messages, size_t first, bool addAssistant,
+                           std::string &text);
+
+private:
+    const char        *m_template;
+    std::vector<char>  m_buffer;
+    bool               m_incremental = true;
+    int                m_checks      = 0;
+    int                m_incrementalCount = 0;
+    int                m_fullCount        = 0;
+};
+
+#endif // CHATFORMATTER_H
@@ -0,0 +1,183 @@
+#include "chathistory.h"
+
+#include <algorithm>
+#include <cstring>
+
+ChatHistory::ChatHistory(size_t blockSize):
+    m_blockSize(blockSize)
+{
+}
+
+void  ChatHistory::clear()
+{
+    m_blocks.clear();
+    m_blockSizes.clear();
+    m_turns.clear();
+    m_view.clear();
+    m_used  = 0;
+    m_arena = 0;
+    m_live  = 0;
+}
+
+void  ChatHistory::beginTurn(bool pinned)
+{
+    const int  pos = m_turns.empty() ? 0 : m_turns.back().span.end;
+
+    m_turns.push_back({ pinned, { pos, pos }, { } });
+}
+
+void  ChatHistory::add(const char *role, const std::string &content)
+{
+    if (m_turns.empty())
+    {
+        beginTurn();
+    }
+
+    // roles are string literals, only the content is stored
+    m_turns.back().messages.push_back({ role, store(content), content.size() + 1 });
+    m_view.push_back({ role, m_turns.back().messages.back().content });
+}
+
+void  ChatHistory::setSpan(int begin, int end)
+{
+    if (!m_turns.empty())
+    {
+        m_turns.back().span = { begin, end };
+    }
+}
+
+const std::vector<llama_chat_message> & ChatHistory::messages() const
+{
+    return m_view;
+}
+
+int  ChatHistory::turnCount() const
+{
+    return m_turns.size();
+}
+
+int  ChatHistory::tokenCount() const
+{
+    int  count = 0;
+
+    for (const auto &turn : m_turns)
+    {
+        count += turn.span.end - turn.span.begin;
+    }
+
+    return count;
+}
+
+std::vector<ChatHistory::Span>  ChatHistory::evict(int tokenBudget)
+{
+    std::vector<Span>  evicted;
+    int                count = tokenCount();
+
+    for (size_t i = 0; i + 1 < m_turns.size() && count > tokenBudget; )
+    {
+        if (m_turns[i].pinned)
+        {
+            ++i;
+            continue;
+        }
+
+        const Span  span = m_turns[i].span;
+        const int   size = span.end - span.begin;
+
+        for (const auto &message : m_turns[i].messages)
+        {
+            m_live -= message.size;
+        }
+
+        m_turns.erase(m_turns.begin() + i);
+
+        // later turns move down by the evicted size, like the KV cells
+        for (size_t j = i; j < m_turns.size(); ++j)
+        {
+            m_turns[j].span.begin -= size;
+            m_turns[j].span.end   -= size;
+        }
+
+        evicted.push_back(span);
+        count -= size;
+    }
+
+    if (!evicted.empty())
+    {
+        if (m_arena - m_live > m_live)
+        {
+            compact();
+        }
+
+        rebuildView();
+    }
+
+    return evicted;
+}
+
+size_t  ChatHistory::arenaBytes() const
+{
+    return m_arena;
+}
+
+size_t  ChatHistory::liveBytes() const
+{
+    return m_live;
+}
+
+const char * ChatHistory::store(const std::string &text)
+{
+    const size_t  size = text.size() + 1;
+
+    if (m_blocks.empty() || (m_used + size > m_blockSizes.back()))
+    {
+        // oversized messages get a block of their own
+        const size_t  blockSize = std::max(m_blockSize, size);
+
+        m_blocks.emplace_back(new char[blockSize]);
+        m_blockSizes.push_back(blockSize);
+        m_used   = 0;
+        m_arena += blockSize;
+    }
+
+    char *dst = m_blocks.back().get() + m_used;
+
+    std::memcpy(dst, text.c_str(), size);
+    m_used += size;
+    m_live += size;
+
+    return dst;
+}
+
+void  ChatHistory::compact()
+{
+    std::vector<std::unique_ptr<char[]>>  oldBlocks;
+
+    oldBlocks.swap(m_blocks);
+    m_blockSizes.clear();
+    m_used  = 0;
+    m_arena = 0;
+    m_live  = 0;
+
+    // copy the live text into fresh blocks, the old ones go out of scope
+    for (auto &turn : m_turns)
+    {
+        for (auto &message : turn.messages)
+        {
+            message.content = store(std::string(message.content, message.size - 1));
+        }
+    }
+}
+
+void  ChatHistory::rebuildView()
+{
+    m_view.clear();
+
+    for (const auto &turn : m_turns)
+    {
+        for (const auto &message : turn.messages)
+        {
+            m_view.push_back({ message.role, message.content });
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef CHATHISTORY_H
+#define CHATHISTORY_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// Conversation store for LlamaInterface.
+//
+// Message text is owned by an arena of fixed size blocks instead of one heap
+// string per message. Messages are grouped into turns (a question with its
+// retrieved context and the answer) that remember which KV cache positions
+// they occupy, so the oldest turns can be evicted together with their cells
+// when the conversation exceeds its token budget. Pinned turns (the system
+// prompt) are never evicted. Evicted text is reclaimed by compacting the arena
+// once more than half of it is dead.
+class ChatHistory
+{
+public:
+    // Range of KV cache positions [begin, end)
+    struct Span
+    {
+        int  begin;
+        int  end;
+    };
+
+    explicit ChatHistory(size_t blockSize = 64 * 1024);
+
+    void                                    clear();
+
+    // Start a new turn, messages added afterwards belong to it.
+    void                                    beginTurn(bool pinned = false);
+
+    void                                    add(const char *role, const std::string &content);
+
+    // KV cache positions used by the current turn.
+    void                                    setSpan(int begin, int end);
+
+    // The messages in order, valid until the history is modified.
+    const std::vector<llama_chat_message> & messages() const;
+
+    int                                     turnCount() const;
+
+    // KV cache positions used by all turns.
+    int                                     tokenCount() const;
+
+    // Evict the oldest unpinned turns (never the current one) until at most
+    // tokenBudget positions are used. Returns the evicted spans in order; each
+    // span assumes the cells after the previous one were already shifted down.
+    std::vector<Span>                       evict(int tokenBudget);
+
+    // Memory held by the arena and the part of it still referenced.
+    size_t                                  arenaBytes() const;
+
+    size_t                                  liveBytes() const;
+
+private:
+    struct Message
+    {
+        const char *role;
+        const char *content;
+        size_t      size;
+    };
+
+    struct Turn
+    {
+        bool                  pinned;
+        Span                  span;
+        std::vector<Message>  messages;
+    };
+
+    const char *store(const std::string &text);
+
+    void        compact();
+
+    void        rebuildView();
+
+private:
+    size_t                                m_blockSize;
+    std::vector<std::unique_ptr<char[]>>  m_blocks;
+    std::vector<size_t>                   m_blockSizes;
+    size_t                                m_used  = 0; // in the last block
+    size_t                                m_arena = 0;
+    size_t                                m_live  = 0;
+    std::vector<Turn>                     m_turns;
+    std::vector<llama_chat_message>       m_view;
+};
+
+#endif // CHATHISTORY_H
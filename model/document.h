@@ -3,7 +3,7 @@
 
 #include <string>
 
-std::string  documents = "# General Information"
+inline std::string  documents = "# General Information"
                          "The Shams Pasargad Power Plant, formerly known as Andisheh Sazan Bahin Samad, owns the Shariati Power Plant, which covers an area of 32.5 hectares."
                          "The power plant has a total nominal capacity of 501.3 MW under ISO conditions."
                          "It consists of 2 gas units (F9) with a capacity of 123.4 MW each, 1 steam unit with a capacity of 104.5 MW, and 6 gas units (F5) with a capacity of 25 MW each."
@@ -0,0 +1,704 @@
+#include "documentindex.h"
+#include "textembedder.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace
+{
+const char      INDEX_MAGIC[8] = { 'Q', 'V', 'B', 'I', 'D', 'X', '0', '1' };
+const uint32_t  INDEX_VERSION  = 1;
+
+struct IndexHeader
+{
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  dim;
+    uint32_t  documents;
+    uint32_t  chunks;
+    uint32_t  quantized;
+    uint32_t  modelNameSize;
+    uint64_t  dataOffset;
+};
+
+float  dotFloat(const float *a, const float *b, int n)
+{
+    int  i = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+    __m256  acc0 = _mm256_setzero_ps();
+    __m256  acc1 = _mm256_setzero_ps();
+
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+
+    acc0 = _mm256_add_ps(acc0, acc1);
+
+    __m128  sum4 = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+
+    sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+    sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+
+    float  sum = _mm_cvtss_f32(sum4);
+#elif defined(__SSE__)
+    __m128  acc0 = _mm_setzero_ps();
+    __m128  acc1 = _mm_setzero_ps();
+
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+
+    float  sum = _mm_cvtss_f32(acc0);
+#else
+    float  sum = 0.0f;
+#endif
+
+    for (; i < n; ++i)
+    {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+int32_t  dotInt8(const int8_t *a, const int8_t *b, int n)
+{
+    // plain loop, widened to int32 it is vectorized by the compiler
+    int32_t  sum = 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    }
+
+    return sum;
+}
+
+float  quantizeRow(const float *row, int n, int8_t *out)
+{
+    float  maxAbs = 0.0f;
+
+    for (int i = 0; i < n; ++i)
+    {
+        maxAbs = std::max(maxAbs, std::fabs(row[i]));
+    }
+
+    const float  scale = maxAbs > 0.0f ? maxAbs / 127.0f : 1.0f;
+
+    for (int i = 0; i < n; ++i)
+    {
+        out[i] = (int8_t)std::lround(row[i] / scale);
+    }
+
+    return scale;
+}
+
+// Bounds checked reader over the mapped file
+class Reader
+{
+public:
+    Reader(const uchar *data, qint64 size):
+        m_data(data), m_size(size)
+    {
+    }
+
+    template<typename T>
+    bool  read(T &value)
+    {
+        if (m_pos + (qint64)sizeof(T) > m_size)
+        {
+            return false;
+        }
+
+        std::memcpy(&value, m_data + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+
+        return true;
+    }
+
+    bool  readString(std::string &value, uint32_t size)
+    {
+        if (m_pos + size > m_size)
+        {
+            return false;
+        }
+
+        value.assign(reinterpret_cast<const char *>(m_data + m_pos), size);
+        m_pos += size;
+
+        return true;
+    }
+
+private:
+    const uchar *m_data;
+    qint64       m_size;
+    qint64       m_pos = 0;
+};
+
+void  writeBytes(QByteArray &out, const void *data, size_t size)
+{
+    out.append(reinterpret_cast<const char *>(data), size);
+}
+}
+
+DocumentIndex::DocumentIndex(TextEmbedder *embedder):
+    m_embedder(embedder)
+{
+}
+
+DocumentIndex::~DocumentIndex()
+{
+    unmap();
+}
+
+void  DocumentIndex::setQuantized(bool quantized)
+{
+    m_quantized = quantized;
+}
+
+void  DocumentIndex::setChunkSize(int bytes)
+{
+    m_chunkSize = std::max(64, bytes);
+}
+
+bool  DocumentIndex::load(const QString &path)
+{
+    unmap();
+    m_documents.clear();
+    m_chunks.clear();
+    m_floatRows.clear();
+    m_int8Rows.clear();
+    m_rowScales.clear();
+
+    m_file.setFileName(path);
+
+    if (!m_file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+
+    const qint64  size = m_file.size();
+
+    m_mapped = m_file.map(0, size);
+
+    if (!m_mapped)
+    {
+        qWarning() << "Failed to map document index:" << path;
+        m_file.close();
+
+        return false;
+    }
+
+    Reader       reader(m_mapped, size);
+    IndexHeader  header;
+    std::string  modelName;
+
+    bool  ok = reader.read(header) &&
+               std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+               header.version == INDEX_VERSION &&
+               reader.readString(modelName, header.modelNameSize) &&
+               modelName == m_embedder->modelName() &&
+               (int)header.dim == m_embedder->dimension();
+
+    for (uint32_t i = 0; ok && i < header.documents; ++i)
+    {
+        DocumentEntry  document;
+        uint32_t       idSize = 0;
+
+        ok = reader.read(idSize) && reader.readString(document.id, idSize) && reader.read(document.hash);
+        m_documents.push_back(document);
+    }
+
+    for (uint32_t i = 0; ok && i < header.chunks; ++i)
+    {
+        ChunkEntry  chunk;
+        uint32_t    textSize = 0;
+
+        ok = reader.read(chunk.document) && reader.read(textSize) && reader.readString(chunk.text, textSize) &&
+             chunk.document < header.documents;
+        m_chunks.push_back(chunk);
+    }
+
+    const qint64  rows     = (qint64)header.chunks * header.dim;
+    const qint64  rowBytes = header.quantized ? rows + (qint64)header.chunks * sizeof(float) : rows * sizeof(float);
+
+    ok = ok && (header.dataOffset % sizeof(float)) == 0 && (qint64)header.dataOffset + rowBytes <= size;
+
+    if (!ok)
+    {
+        qWarning() << "Ignoring stale or damaged document index:" << path;
+        unmap();
+        m_documents.clear();
+        m_chunks.clear();
+
+        return false;
+    }
+
+    m_dim = header.dim;
+
+    // rows are used in place, the scales follow the int8 matrix
+    if (header.quantized)
+    {
+        m_int8Data  = reinterpret_cast<const int8_t *>(m_mapped + header.dataOffset);
+        m_scaleData = reinterpret_cast<const float *>(m_mapped + header.dataOffset + rows);
+    }
+    else
+    {
+        m_floatData = reinterpret_cast<const float *>(m_mapped + header.dataOffset);
+    }
+
+    return true;
+}
+
+bool  DocumentIndex::save(const QString &path) const
+{
+    const bool   quantized = m_int8Data != nullptr;
+    QByteArray   out;
+    IndexHeader  header;
+    std::string  modelName = m_embedder->modelName();
+
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version       = INDEX_VERSION;
+    header.dim           = m_dim;
+    header.documents     = m_documents.size();
+    header.chunks        = m_chunks.size();
+    header.quantized     = quantized;
+    header.modelNameSize = modelName.size();
+    header.dataOffset    = 0;
+
+    writeBytes(out, &header, sizeof(header));
+    writeBytes(out, modelName.data(), modelName.size());
+
+    for (const auto &document : m_documents)
+    {
+        uint32_t  idSize = document.id.size();
+
+        writeBytes(out, &idSize, sizeof(idSize));
+        writeBytes(out, document.id.data(), idSize);
+        writeBytes(out, &document.hash, sizeof(document.hash));
+    }
+
+    for (const auto &chunk : m_chunks)
+    {
+        uint32_t  textSize = chunk.text.size();
+
+        writeBytes(out, &chunk.document, sizeof(chunk.document));
+        writeBytes(out, &textSize, sizeof(textSize));
+        writeBytes(out, chunk.text.data(), textSize);
+    }
+
+    // align the matrix for SIMD loads straight from the mapping
+    while (out.size() % 64 != 0)
+    {
+        out.append('\0');
+    }
+
+    header.dataOffset = out.size();
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    const size_t  rows = m_chunks.size() * (size_t)m_dim;
+
+    if (quantized)
+    {
+        writeBytes(out, m_int8Data, rows);
+        writeBytes(out, m_scaleData, m_chunks.size() * sizeof(float));
+    }
+    else if (rows > 0)
+    {
+        writeBytes(out, m_floatData, rows * sizeof(float));
+    }
+
+    // write next to the target and rename, a mapped old index stays valid
+    QString  tmpPath = path + ".tmp";
+    QFile    file(tmpPath);
+
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || (file.write(out) != out.size()))
+    {
+        qWarning() << "Failed to write document index:" << tmpPath;
+
+        return false;
+    }
+
+    file.close();
+    QFile::remove(path);
+
+    return QFile::rename(tmpPath, path);
+}
+
+int  DocumentIndex::update(const std::vector<Document> &documents)
+{
+    detach();
+
+    const bool  storedQuantized = m_int8Data != nullptr;
+    const bool  reuse           = storedQuantized == m_quantized && m_dim == m_embedder->dimension();
+
+    std::vector<DocumentEntry>  oldDocuments;
+    std::vector<ChunkEntry>     oldChunks;
+    std::vector<float>          oldFloatRows;
+    std::vector<int8_t>         oldInt8Rows;
+    std::vector<float>          oldScales;
+
+    oldDocuments.swap(m_documents);
+    oldChunks.swap(m_chunks);
+    oldFloatRows.swap(m_floatRows);
+    oldInt8Rows.swap(m_int8Rows);
+    oldScales.swap(m_rowScales);
+
+    m_dim       = m_embedder->dimension();
+    m_floatData = nullptr;
+    m_int8Data  = nullptr;
+    m_scaleData = nullptr;
+
+    int                 embedded = 0;
+    std::vector<float>  embedding;
+
+    for (const auto &document : documents)
+    {
+        const uint64_t  hash = hashText(document.text);
+        const uint32_t  docIndex = m_documents.size();
+        int             oldIndex = -1;
+
+        for (size_t i = 0; reuse && i < oldDocuments.size(); ++i)
+        {
+            if ((oldDocuments[i].id == document.id) && (oldDocuments[i].hash == hash))
+            {
+                oldIndex = i;
+                break;
+            }
+        }
+
+        m_documents.push_back({ document.id, hash });
+
+        if (oldIndex >= 0)
+        {
+            for (size_t c = 0; c < oldChunks.size(); ++c)
+            {
+                if (oldChunks[c].document != (uint32_t)oldIndex)
+                {
+                    continue;
+                }
+
+                m_chunks.push_back({ docIndex, oldChunks[c].text });
+
+                if (m_quantized)
+                {
+                    m_int8Rows.insert(m_int8Rows.end(), oldInt8Rows.begin() + c * m_dim, oldInt8Rows.begin() + (c + 1) * m_dim);
+                    m_rowScales.push_back(oldScales[c]);
+                }
+                else
+                {
+                    m_floatRows.insert(m_floatRows.end(), oldFloatRows.begin() + c * m_dim, oldFloatRows.begin() + (c + 1) * m_dim);
+                }
+            }
+
+            continue;
+        }
+
+        for (const auto &text : chunkText(document.text, m_chunkSize))
+        {
+            if (!m_embedder->embed(text, embedding))
+            {
+                qWarning() << "Failed to embed chunk of" << QString::fromStdString(document.id);
+                continue;
+            }
+
+            m_chunks.push_back({ docIndex, text });
+            appendRow(embedding);
+            embedded++;
+        }
+    }
+
+    if (m_quantized)
+    {
+        m_int8Data  = m_int8Rows.data();
+        m_scaleData = m_rowScales.data();
+    }
+    else
+    {
+        m_floatData = m_floatRows.data();
+    }
+
+    return embedded;
+}
+
+std::vector<DocumentIndex::Hit>  DocumentIndex::search(const std::string &query, int k)
+{
+    std::vector<Hit>    hits;
+    std::vector<float>  embedding;
+
+    if (m_chunks.empty() || (k <= 0) || !m_embedder->embed(query, embedding) || ((int)embedding.size() != m_dim))
+    {
+        return hits;
+    }
+
+    // keep the k best scores in descending order
+    std::vector<std::pair<float, int>>  best;
+    std::vector<int8_t>                 queryInt8;
+    float                               queryScale = 1.0f;
+
+    if (m_int8Data)
+    {
+        queryInt8.resize(m_dim);
+        queryScale = quantizeRow(embedding.data(), m_dim, queryInt8.data());
+    }
+
+    for (int c = 0; c < (int)m_chunks.size(); ++c)
+    {
+        float  score;
+
+        if (m_int8Data)
+        {
+            score = dotInt8(queryInt8.data(), m_int8Data + (size_t)c * m_dim, m_dim) * queryScale * m_scaleData[c];
+        }
+        else
+        {
+            score = dotFloat(embedding.data(), floatRow(c), m_dim);
+        }
+
+        if (((int)best.size() == k) && (score <= best.back().first))
+        {
+            continue;
+        }
+
+        auto  pos = std::upper_bound(best.begin(), best.end(), score, [](float s, const std::pair<float, int> &e)
+        {
+            return s > e.first;
+        });
+
+        best.insert(pos, { score, c });
+
+        if ((int)best.size() > k)
+        {
+            best.pop_back();
+        }
+    }
+
+    for (const auto &entry : best)
+    {
+        const auto &chunk = m_chunks[entry.second];
+
+        hits.push_back({ entry.second, entry.first, m_documents[chunk.document].id, chunk.text });
+    }
+
+    return hits;
+}
+
+int  DocumentIndex::chunkCount() const
+{
+    return m_chunks.size();
+}
+
+uint64_t  DocumentIndex::documentHash(const std::string &id) const
+{
+    for (const auto &document : m_documents)
+    {
+        if (document.id == id)
+        {
+            return document.hash;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t  DocumentIndex::hashText(const std::string &text)
+{
+    // FNV-1a, stable across runs unlike std::hash
+    uint64_t  h = 1469598103934665603ull;
+
+    for (unsigned char c : text)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+std::vector<std::string>  DocumentIndex::chunkText(const std::string &text, int chunkSize)
+{
+    // The documents are concatenated literals, sentences are not separated by
+    // spaces. A sentence ends at '.', '?' or '!' that is followed by an upper
+    // case letter, a "#" heading, a "-" list item or the end of the text, so
+    // decimals like 362.8 stay intact.
+    std::vector<std::string>  sentences;
+    size_t                    start = 0;
+
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const char  c = text[i];
+
+        if ((c == '#') && (i > start))
+        {
+            sentences.push_back(text.substr(start, i - start));
+            start = i;
+            continue;
+        }
+
+        if ((c != '.') && (c != '?') && (c != '!'))
+        {
+            continue;
+        }
+
+        const char  next = i + 1 < text.size() ? text[i + 1] : '\0';
+
+        if ((next == '\0') || std::isupper((unsigned char)next) || (next == '#') || (next == '-') || (next == ' '))
+        {
+            sentences.push_back(text.substr(start, i + 1 - start));
+            start = i + 1;
+        }
+    }
+
+    if (start < text.size())
+    {
+        sentences.push_back(text.substr(start));
+    }
+
+    // Group sentences up to chunkSize, a chunk never spans two sections and
+    // carries its section heading so it is understandable on its own.
+    std::vector<std::string>  chunks;
+    std::string               heading;
+    std::string               current;
+
+    auto  flush = [&]()
+    {
+        if (!current.empty())
+        {
+            chunks.push_back(heading.empty() ? current : heading + "\n" + current);
+            current.clear();
+        }
+    };
+
+    for (auto &sentence : sentences)
+    {
+        size_t  first = sentence.find_first_not_of(' ');
+
+        if (first == std::string::npos)
+        {
+            continue;
+        }
+
+        sentence.erase(0, first);
+
+        if (sentence[0] == '#')
+        {
+            flush();
+
+            // "# Title" runs into the first sentence of the section
+            size_t  end = sentence.find_first_of(".?!");
+
+            heading = sentence.substr(0, end == std::string::npos ? sentence.size() : end);
+
+            // split "# Operational UnitsThe operational units..." at the case change
+            for (size_t i = 2; i + 1 < heading.size(); ++i)
+            {
+                if (std::islower((unsigned char)heading[i]) && std::isupper((unsigned char)heading[i + 1]) &&
+                    ((i + 2 >= heading.size()) || std::islower((unsigned char)heading[i + 2])))
+                {
+                    sentence = sentence.substr(i + 1);
+                    heading  = heading.substr(0, i + 1);
+                    break;
+                }
+            }
+
+            if (sentence[0] == '#')
+            {
+                continue;
+            }
+        }
+
+        if (!current.empty() && ((int)(current.size() + sentence.size() + 1) > chunkSize))
+        {
+            flush();
+        }
+
+        if (!current.empty())
+        {
+            current += ' ';
+        }
+
+        current += sentence;
+    }
+
+    flush();
+
+    return chunks;
+}
+
+void  DocumentIndex::unmap()
+{
+    if (m_mapped)
+    {
+        m_file.unmap(m_mapped);
+        m_mapped = nullptr;
+    }
+
+    if (m_file.isOpen())
+    {
+        m_file.close();
+    }
+
+    m_floatData = m_floatRows.empty() ? nullptr : m_floatRows.data();
+    m_int8Data  = m_int8Rows.empty() ? nullptr : m_int8Rows.data();
+    m_scaleData = m_rowScales.empty() ? nullptr : m_rowScales.data();
+}
+
+void  DocumentIndex::detach()
+{
+    if (!m_mapped)
+    {
+        return;
+    }
+
+    const size_t  rows = m_chunks.size() * (size_t)m_dim;
+
+    if (m_int8Data)
+    {
+        m_int8Rows.assign(m_int8Data, m_int8Data + rows);
+        m_rowScales.assign(m_scaleData, m_scaleData + m_chunks.size());
+    }
+    else if (m_floatData)
+    {
+        m_floatRows.assign(m_floatData, m_floatData + rows);
+    }
+
+    unmap();
+}
+
+void  DocumentIndex::appendRow(const std::vector<float> &embedding)
+{
+    if (m_quantized)
+    {
+        const size_t  offset = m_int8Rows.size();
+
+        m_int8Rows.resize(offset + m_dim);
+        m_rowScales.push_back(quantizeRow(embedding.data(), m_dim, m_int8Rows.data() + offset));
+    }
+    else
+    {
+        m_floatRows.insert(m_floatRows.end(), embedding.begin(), embedding.end());
+    }
+}
+
+const float * DocumentIndex::floatRow(int chunk) const
+{
+    return m_floatData + (size_t)chunk * m_dim;
+}
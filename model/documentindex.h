@@ -0,0 +1,114 @@
+#ifndef DOCUMENTINDEX_H
+#define DOCUMENTINDEX_H
+
+#include <QFile>
+#include <QString>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TextEmbedder;
+
+// Retrieval index over the plant documents.
+//
+// Documents are split into chunks that stay inside one "# " section, every
+// chunk is embedded once and the vectors are kept row by row in one contiguous
+// float32 matrix (optionally int8 with a scale per row). The index is saved to
+// a file that is memory-mapped on load, and only documents whose content
+// changed are embedded again.
+class DocumentIndex
+{
+public:
+    struct Document
+    {
+        std::string  id;
+        std::string  text;
+    };
+
+    struct Hit
+    {
+        int          chunk;
+        float        score;
+        std::string  documentId;
+        std::string  text;
+    };
+
+    explicit DocumentIndex(TextEmbedder *embedder);
+
+    ~DocumentIndex();
+
+    DocumentIndex(const DocumentIndex &) = delete;
+    DocumentIndex &operator=(const DocumentIndex &) = delete;
+
+    // Store int8 rows instead of float32, takes effect on the next update.
+    void              setQuantized(bool quantized);
+
+    // Maximum chunk length in bytes.
+    void              setChunkSize(int bytes);
+
+    // Map a saved index. Returns false if missing or built with another model.
+    bool              load(const QString &path);
+
+    bool              save(const QString &path) const;
+
+    // Bring the index in sync with documents. Unchanged documents keep their
+    // vectors, changed or new ones are chunked and embedded, removed ones are
+    // dropped. Returns the number of embedded chunks.
+    int               update(const std::vector<Document> &documents);
+
+    std::vector<Hit>  search(const std::string &query, int k);
+
+    int               chunkCount() const;
+
+    // Hash of the document text as stored in the index, 0 if unknown.
+    uint64_t          documentHash(const std::string &id) const;
+
+    static uint64_t   hashText(const std::string &text);
+
+    static std::vector<std::string>  chunkText(const std::string &text, int chunkSize);
+
+private:
+    struct DocumentEntry
+    {
+        std::string  id;
+        uint64_t     hash;
+    };
+
+    struct ChunkEntry
+    {
+        uint32_t     document;
+        std::string  text;
+    };
+
+    void         unmap();
+
+    // Copy mapped rows into owned storage before modifying them.
+    void         detach();
+
+    void         appendRow(const std::vector<float> &embedding);
+
+    const float *floatRow(int chunk) const;
+
+private:
+    TextEmbedder               *m_embedder;
+    bool                        m_quantized = false;
+    int                         m_chunkSize = 400;
+    int                         m_dim       = 0;
+
+    std::vector<DocumentEntry>  m_documents;
+    std::vector<ChunkEntry>     m_chunks;
+
+    // Either owned or pointing into m_file's mapping
+    std::vector<float>          m_floatRows;
+    std::vector<int8_t>         m_int8Rows;
+    std::vector<float>          m_rowScales;
+    const float                *m_floatData = nullptr;
+    const int8_t               *m_int8Data  = nullptr;
+    const float                *m_scaleData = nullptr;
+
+    QFile                       m_file;
+    uchar                      *m_mapped = nullptr;
+};
+
+#endif // DOCUMENTINDEX_H
@@ -0,0 +1,263 @@
+#include "fusedsampler.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace
+{
+struct FusedState
+{
+    float                 minP;
+    float                 temperature;
+    uint32_t              seed;
+    bool                  greedy;
+    std::mt19937          rng;
+
+    // kept tokens and their weights, sized for the vocabulary once
+    std::vector<int32_t>  ids;
+    std::vector<float>    weights;
+};
+
+float  maxLogit(const float *logits, int n)
+{
+    int  i = 0;
+
+#if defined(__AVX2__)
+    __m256  acc0 = _mm256_set1_ps(-FLT_MAX);
+    __m256  acc1 = acc0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_max_ps(acc0, _mm256_loadu_ps(logits + i));
+        acc1 = _mm256_max_ps(acc1, _mm256_loadu_ps(logits + i + 8));
+    }
+
+    acc0 = _mm256_max_ps(acc0, acc1);
+
+    __m128  max4 = _mm_max_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+#elif defined(__SSE__)
+    __m128  max4 = _mm_set1_ps(-FLT_MAX);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        max4 = _mm_max_ps(max4, _mm_loadu_ps(logits + i));
+    }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE__)
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_shuffle_ps(max4, max4, 1));
+
+    float  result = _mm_cvtss_f32(max4);
+#else
+    float  result = -FLT_MAX;
+#endif
+
+    for (; i < n; ++i)
+    {
+        result = std::max(result, logits[i]);
+    }
+
+    return result;
+}
+
+// first position of value, which is known to be in logits
+int  find(const float *logits, int n, float value)
+{
+    int  i = 0;
+
+#if defined(__AVX2__)
+    const __m256  v = _mm256_set1_ps(value);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        const int  mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i), v, _CMP_EQ_OQ));
+
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        if (logits[i] == value)
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+llama_token  sampleLogits(FusedState &state, const float *logits, int n)
+{
+    const float  max = maxLogit(logits, n);
+
+    if (state.greedy || (state.temperature <= 0.0f))
+    {
+        return find(logits, n, max);
+    }
+
+    if ((int)state.ids.size() < n)
+    {
+        state.ids.resize(n);
+        state.weights.resize(n);
+    }
+
+    // p_i >= minP * p_max  <=>  logit_i >= max + log(minP)
+    const float  threshold = state.minP > 0.0f ? max + std::log(state.minP) : -FLT_MAX;
+    const float  scale     = 1.0f / state.temperature;
+    float        sum       = 0.0f;
+    int          kept      = 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (logits[i] >= threshold)
+        {
+            const float  w = std::exp((logits[i] - max) * scale);
+
+            state.ids[kept]     = i;
+            state.weights[kept] = w;
+            sum                += w;
+            kept++;
+        }
+    }
+
+    float  r = std::uniform_real_distribution<float>(0.0f, sum)(state.rng);
+
+    for (int k = 0; k < kept; ++k)
+    {
+        r -= state.weights[k];
+
+        if (r < 0.0f)
+        {
+            return state.ids[k];
+        }
+    }
+
+    return state.ids[kept - 1];
+}
+
+const char * fusedName(const llama_sampler *)
+{
+    return "fused-min-p";
+}
+
+void  fusedApply(llama_sampler *sampler, llama_token_data_array *cur_p)
+{
+    auto &state = *static_cast<FusedState *>(sampler->ctx);
+    int   best  = 0;
+
+    for (size_t i = 1; i < cur_p->size; ++i)
+    {
+        if (cur_p->data[i].logit > cur_p->data[best].logit)
+        {
+            best = i;
+        }
+    }
+
+    cur_p->selected = best;
+
+    if (state.greedy || (state.temperature <= 0.0f))
+    {
+        return;
+    }
+
+    const float  max       = cur_p->data[best].logit;
+    const float  threshold = state.minP > 0.0f ? max + std::log(state.minP) : -FLT_MAX;
+    float        sum       = 0.0f;
+
+    for (size_t i = 0; i < cur_p->size; ++i)
+    {
+        if (cur_p->data[i].logit >= threshold)
+        {
+            sum += std::exp((cur_p->data[i].logit - max) / state.temperature);
+        }
+    }
+
+    float  r = std::uniform_real_distribution<float>(0.0f, sum)(state.rng);
+
+    for (size_t i = 0; i < cur_p->size; ++i)
+    {
+        if (cur_p->data[i].logit >= threshold)
+        {
+            r -= std::exp((cur_p->data[i].logit - max) / state.temperature);
+
+            if (r < 0.0f)
+            {
+                cur_p->selected = i;
+
+                return;
+            }
+        }
+    }
+}
+
+void  fusedReset(llama_sampler *sampler)
+{
+    auto &state = *static_cast<FusedState *>(sampler->ctx);
+
+    state.rng.seed(state.seed);
+}
+
+llama_sampler * fusedClone(const llama_sampler *sampler);
+
+void  fusedFree(llama_sampler *sampler)
+{
+    delete static_cast<FusedState *>(sampler->ctx);
+}
+
+const llama_sampler_i  FUSED_INTERFACE = {
+    /* .name   = */ fusedName,
+    /* .accept = */ nullptr,
+    /* .apply  = */ fusedApply,
+    /* .reset  = */ fusedReset,
+    /* .clone  = */ fusedClone,
+    /* .free   = */ fusedFree,
+};
+
+llama_sampler * fusedClone(const llama_sampler *sampler)
+{
+    return llama_sampler_init(&FUSED_INTERFACE, new FusedState(*static_cast<const FusedState *>(sampler->ctx)));
+}
+}
+
+llama_sampler * FusedSampler::create(float minP, float temperature, uint32_t seed, bool greedy)
+{
+    if (seed == LLAMA_DEFAULT_SEED)
+    {
+        seed = std::random_device()();
+    }
+
+    auto *state = new FusedState { minP, temperature, seed, greedy, std::mt19937(seed), { }, { } };
+
+    return llama_sampler_init(&FUSED_INTERFACE, state);
+}
+
+llama_token  FusedSampler::sample(llama_sampler *sampler, llama_context *context, int32_t idx)
+{
+    if (sampler->iface != &FUSED_INTERFACE)
+    {
+        return llama_sampler_sample(sampler, context, idx);
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(context));
+
+    return sample(sampler, llama_get_logits_ith(context, idx), llama_vocab_n_tokens(vocab));
+}
+
+llama_token  FusedSampler::sample(llama_sampler *sampler, const float *logits, int32_t nVocab)
+{
+    return sampleLogits(*static_cast<FusedState *>(sampler->ctx), logits, nVocab);
+}
@@ -0,0 +1,33 @@
+#ifndef FUSEDSAMPLER_H
+#define FUSEDSAMPLER_H
+
+#include "llama.h"
+
+#include <cstdint>
+
+// min-p, temperature and sampling in one llama_sampler.
+//
+// The chain min_p -> temp -> dist -> greedy makes one pass over the whole
+// vocabulary per stage and sorts it in dist, and llama_sampler_sample()
+// rebuilds the candidate array for every token. This sampler reads the logits
+// of the context directly: a vectorized pass finds the maximum logit, and
+// either its first position is the token (greedy) or a second pass collects
+// the tokens within min-p of it into preallocated scratch and draws one.
+//
+// In greedy mode it picks the same token as the chain above, whose greedy
+// stage overrides the token drawn by dist. With greedy off it samples from the
+// same distribution as min_p -> temp -> dist.
+class FusedSampler
+{
+public:
+    static llama_sampler * create(float minP, float temperature, uint32_t seed, bool greedy = true);
+
+    // Token for the logits at idx. Falls back to llama_sampler_sample() for
+    // other samplers.
+    static llama_token     sample(llama_sampler *sampler, llama_context *context, int32_t idx);
+
+    // Token for a row of nVocab logits, sampler must come from create().
+    static llama_token     sample(llama_sampler *sampler, const float *logits, int32_t nVocab);
+};
+
+#endif // FUSEDSAMPLER_H
@@ -0,0 +1,125 @@
+#include "generationjob.h"
+#include "tokenstream.h"
+
+GenerationJob::GenerationJob(quint64 id, const QString &prompt, Priority priority, qint64 deadlineMs, int tokenBudget):
+    m_id(id), m_prompt(prompt), m_priority(priority), m_tokenBudget(tokenBudget),
+    m_deadline(deadlineMs < 0 ? QDeadlineTimer(QDeadlineTimer::Forever) : QDeadlineTimer(deadlineMs)),
+    m_state(Queued), m_tokens(0), m_cancelled(false)
+{
+    m_age.start();
+    m_future = m_promise.future();
+    m_promise.start();
+}
+
+GenerationJob::~GenerationJob()
+{
+    if (m_state == Queued || m_state == Running)
+    {
+        m_promise.finish();
+    }
+}
+
+quint64  GenerationJob::id() const
+{
+    return m_id;
+}
+
+QString  GenerationJob::prompt() const
+{
+    return m_prompt;
+}
+
+GenerationJob::Priority  GenerationJob::priority() const
+{
+    return m_priority;
+}
+
+GenerationJob::State  GenerationJob::state() const
+{
+    return (State)m_state.load();
+}
+
+int  GenerationJob::tokenBudget() const
+{
+    return m_tokenBudget;
+}
+
+int  GenerationJob::tokens() const
+{
+    return m_tokens;
+}
+
+bool  GenerationJob::hasExpired() const
+{
+    return m_deadline.hasExpired();
+}
+
+void  GenerationJob::cancel()
+{
+    m_cancelled = true;
+}
+
+bool  GenerationJob::isCancelled() const
+{
+    return m_cancelled;
+}
+
+QFuture<QString>  GenerationJob::future()
+{
+    return m_future;
+}
+
+GenerationJobInfo  GenerationJob::info() const
+{
+    GenerationJobInfo  info;
+
+    info.id          = m_id;
+    info.prompt      = m_prompt;
+    info.priority    = m_priority;
+    info.state       = m_state;
+    info.ageMs       = m_age.elapsed();
+    info.remainingMs = m_deadline.isForever() ? -1 : m_deadline.remainingTime();
+    info.tokenBudget = m_tokenBudget;
+    info.tokens      = m_tokens;
+
+    return info;
+}
+
+void  GenerationJob::start()
+{
+    m_state = Running;
+    emit  stateChanged(Running);
+}
+
+void  GenerationJob::addToken(const std::string &piece)
+{
+    m_tokens++;
+    m_partial += piece;
+
+    const size_t  complete = TokenStream::completeUtf8(m_partial.data(), m_partial.size());
+
+    if (complete > 0)
+    {
+        emit  tokenReady(QString::fromUtf8(m_partial.data(), complete));
+        m_partial.erase(0, complete);
+    }
+}
+
+void  GenerationJob::finish(State state, const QString &answer)
+{
+    m_state = state;
+
+    if (state == Finished)
+    {
+        m_promise.addResult(answer);
+    }
+    else
+    {
+        m_promise.addResult(QString());
+    }
+
+    m_promise.finish();
+
+    emit  stateChanged(state);
+    emit  finished(answer);
+}
@@ -0,0 +1,120 @@
+#ifndef GENERATIONJOB_H
+#define GENERATIONJOB_H
+
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QObject>
+#include <QPromise>
+#include <QSharedPointer>
+#include <QString>
+
+#include <atomic>
+#include <string>
+
+// Snapshot of a job for monitoring
+struct GenerationJobInfo
+{
+    quint64  id;
+    QString  prompt;
+    int      priority;
+    int      state;
+    qint64   ageMs;        // since submission
+    qint64   remainingMs;  // until the deadline, -1 if none
+    int      tokenBudget;  // -1 if unlimited
+    int      tokens;       // generated so far
+};
+
+// A generation request submitted to LlamaInterface.
+//
+// Tokens are streamed through tokenReady() and the whole answer is available
+// from future(). Cancellation is cooperative: the generating thread checks it
+// between llama_decode calls.
+class GenerationJob: public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Priority
+    {
+        Background  = 0, // e.g. summaries
+        Normal      = 1, // typed questions
+        Interactive = 2, // operator voice queries
+    };
+    Q_ENUM(Priority)
+
+    enum State
+    {
+        Queued,
+        Running,
+        Finished,
+        Cancelled,
+        Expired,
+        Failed,
+    };
+    Q_ENUM(State)
+
+    // deadlineMs and tokenBudget < 0 mean no limit
+    GenerationJob(quint64 id, const QString &prompt, Priority priority, qint64 deadlineMs, int tokenBudget);
+
+    ~GenerationJob();
+
+    quint64            id() const;
+
+    QString            prompt() const;
+
+    Priority           priority() const;
+
+    State              state() const;
+
+    int                tokenBudget() const;
+
+    int                tokens() const;
+
+    bool               hasExpired() const;
+
+    // Request cancellation, safe to call from any thread.
+    void               cancel();
+
+    bool               isCancelled() const;
+
+    // Resolves to the full answer, empty if cancelled, expired or failed.
+    QFuture<QString>   future();
+
+    GenerationJobInfo  info() const;
+
+signals:
+    void               tokenReady(const QString &piece);
+
+    void               finished(const QString &answer);
+
+    void               stateChanged(GenerationJob::State state);
+
+private:
+    friend class LlamaInterface;
+
+    // Called by the generating thread
+    void               start();
+
+    // piece is UTF-8 and may end inside a character, tokenReady() gets
+    // whole characters only
+    void               addToken(const std::string &piece);
+
+    void               finish(State state, const QString &answer);
+
+private:
+    const quint64       m_id;
+    const QString       m_prompt;
+    const Priority      m_priority;
+    const int           m_tokenBudget;
+    QDeadlineTimer      m_deadline;
+    QElapsedTimer       m_age;
+    std::atomic<int>    m_state;
+    std::atomic<int>    m_tokens;
+    std::atomic<bool>   m_cancelled;
+    QPromise<QString>   m_promise;
+    std::string         m_partial; // start of a character split across tokens
+    QFuture<QString>    m_future;
+};
+
+#endif // GENERATIONJOB_H
@@ -0,0 +1,258 @@
+#include "intentrouter.h"
+#include "answercache.h"
+#include "statusstore.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QRegularExpression>
+
+#include <algorithm>
+#include <sstream>
+
+namespace
+{
+const char *STOP_WORDS[] = {
+    "what", "whats", "s", "is", "are", "the", "a", "of", "how", "much", "many", "we", "our", "us", "me", "tell",
+    "please", "current", "currently", "now", "right", "at", "plant", "give",
+    "چقدر", "چه", "چند", "چیست", "است", "هست", "در", "را", "که", "از", "به", "الان", "فعلی", "نیروگاه", "ما", "بگو",
+    "لطفا", "حال", "حاضر", "وضع", "چطور", "چگونه", "الآن",
+};
+
+std::vector<std::string>  splitWords(const std::string &text)
+{
+    std::vector<std::string>  words;
+    std::istringstream        stream(text);
+    std::string               word;
+
+    while (stream >> word)
+    {
+        words.push_back(word);
+    }
+
+    return words;
+}
+
+bool  isPersian(const QString &text)
+{
+    for (QChar c : text)
+    {
+        if ((c.unicode() >= 0x0600) && (c.unicode() <= 0x06FF))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+}
+
+IntentRouter::IntentRouter(const StatusStore *store):
+    m_store(store)
+{
+    for (const char *word : STOP_WORDS)
+    {
+        m_stopWords.insert(word);
+    }
+}
+
+void  IntentRouter::addDefaultIntents()
+{
+    addIntent({ "power",
+                { { "power", "generation", "generating", "output", "megawatt", "megawatts", "mw", "load",
+                    "تولید", "توان", "برق", "مگاوات", "بار" } },
+                { "total", "electricity", "producing", "کل", "میزان" },
+                "The plant is generating {power_mw} megawatts.",
+                "نیروگاه در حال حاضر {power_mw} مگاوات تولید می‌کند." });
+
+    addIntent({ "fuel",
+                { { "fuel", "سوخت", "گازوئیل" } },
+                { "status", "level", "reserve", "liquid", "tank", "وضعیت", "ذخیره", "مایع", "مخزن", "میزان", "سطح" },
+                "The liquid fuel reserve is at {liquid_fuel_percent} percent.",
+                "ذخیره سوخت مایع {liquid_fuel_percent} درصد است." });
+
+    addIntent({ "temperature",
+                { { "temperature", "temp", "دما", "دمای", "حرارت" } },
+                { "ambient", "outside", "air", "محیط", "هوا", "بیرون" },
+                "The ambient temperature is {ambient_temperature_c} degrees Celsius.",
+                "دمای محیط {ambient_temperature_c} درجه سانتی‌گراد است." });
+
+    addIntent({ "humidity",
+                { { "humidity", "رطوبت" } },
+                { "ambient", "air", "relative", "محیط", "هوا", "نسبی" },
+                "The humidity is {humidity_percent} percent.",
+                "رطوبت هوا {humidity_percent} درصد است." });
+
+    addIntent({ "pressure",
+                { { "pressure", "فشار" } },
+                { "ambient", "air", "atmospheric", "محیط", "هوا" },
+                "The ambient pressure is {ambient_pressure_bar} bar.",
+                "فشار محیط {ambient_pressure_bar} بار است." });
+}
+
+void  IntentRouter::addIntent(const Intent &intent)
+{
+    Compiled  compiled;
+
+    // keywords go through the same normalization as the transcripts
+    for (const auto &group : intent.groups)
+    {
+        compiled.groups.emplace_back();
+
+        for (const auto &keyword : group)
+        {
+            compiled.groups.back().push_back(utf8_to_utf32(AnswerCache::normalize(QString::fromStdString(keyword))));
+        }
+    }
+
+    for (const auto &keyword : intent.extras)
+    {
+        compiled.extras.push_back(utf8_to_utf32(AnswerCache::normalize(QString::fromStdString(keyword))));
+    }
+
+    m_intents.push_back(intent);
+    m_compiled.push_back(std::move(compiled));
+}
+
+void  IntentRouter::setThreshold(float threshold)
+{
+    m_threshold = threshold;
+}
+
+bool  IntentRouter::route(const QString &transcript, QString &answer)
+{
+    QElapsedTimer  timer;
+
+    timer.start();
+    m_stats.queries++;
+
+    // each word is matched against every keyword, so it is the pattern
+    std::vector<edit_distance_pattern>  words;
+
+    for (const auto &word : splitWords(AnswerCache::normalize(transcript)))
+    {
+        if (m_stopWords.count(word) == 0)
+        {
+            words.emplace_back(word);
+        }
+    }
+
+    const Intent *best      = nullptr;
+    float         bestScore = 0.0f;
+
+    for (size_t i = 0; i < m_intents.size(); ++i)
+    {
+        const float  s = score(m_compiled[i], words);
+
+        if (s > bestScore)
+        {
+            best      = &m_intents[i];
+            bestScore = s;
+        }
+    }
+
+    bool  routed = false;
+
+    if (best && (bestScore >= m_threshold))
+    {
+        routed = render(isPersian(transcript) ? best->persian : best->english, answer);
+    }
+
+    const qint64  elapsed = timer.nsecsElapsed();
+
+    m_stats.totalNs += elapsed;
+
+    if (routed)
+    {
+        m_stats.hits++;
+    }
+
+    qDebug() << "Intent router:" << (best ? QString::fromStdString(best->name) : QString("none"))
+             << "score" << bestScore << (routed ? "answered" : "to LLM") << "in" << elapsed / 1000 << "us, hit rate"
+             << m_stats.hits << "/" << m_stats.queries;
+
+    return routed;
+}
+
+IntentRouter::Stats  IntentRouter::stats() const
+{
+    return m_stats;
+}
+
+float  IntentRouter::score(const Compiled &intent, const std::vector<edit_distance_pattern> &words) const
+{
+    if (words.empty())
+    {
+        return 0.0f;
+    }
+
+    std::vector<bool>  explained(words.size(), false);
+    float              groupScore = 0.0f;
+
+    for (const auto &group : intent.groups)
+    {
+        float  best = 0.0f;
+
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            for (const auto &keyword : group)
+            {
+                const float  s = words[i].similarity(keyword);
+
+                if (s >= m_wordThreshold)
+                {
+                    explained[i] = true;
+                }
+
+                best = std::max(best, s);
+            }
+        }
+
+        // every group has to be there
+        if (best < m_wordThreshold)
+        {
+            return 0.0f;
+        }
+
+        groupScore += best;
+    }
+
+    groupScore /= intent.groups.size();
+
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+        for (size_t k = 0; !explained[i] && k < intent.extras.size(); ++k)
+        {
+            explained[i] = words[i].similarity(intent.extras[k]) >= m_wordThreshold;
+        }
+    }
+
+    const float  coverage = std::count(explained.begin(), explained.end(), true) / float(words.size());
+
+    return 0.6f * groupScore + 0.4f * coverage;
+}
+
+bool  IntentRouter::render(const QString &text, QString &answer) const
+{
+    static const QRegularExpression  placeholder("\\{(\\w+)\\}");
+
+    answer = text;
+
+    auto  it = placeholder.globalMatch(text);
+
+    while (it.hasNext())
+    {
+        auto     match = it.next();
+        QString  value;
+
+        if (!m_store->value(match.captured(1), value))
+        {
+            qWarning() << "Intent router: no status value for" << match.captured(1);
+
+            return false;
+        }
+
+        answer.replace(match.captured(0), value);
+    }
+
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef INTENTROUTER_H
+#define INTENTROUTER_H
+
+#include <QString>
+
+#include "common.h"
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class StatusStore;
+
+// Answers status questions (power output, fuel, weather) from the
+// StatusStore without running the LLM.
+//
+// Every intent has keyword groups in English and Persian. A transcript
+// matches a group when one of its words is close enough to one of the group's
+// keywords (fuzzy, so Whisper spelling variants still match). The score of an
+// intent combines how well its groups matched with how much of the transcript
+// the intent explains, so a question that only mentions fuel in passing goes
+// to the LLM. The answer is the intent's template in the language of the
+// transcript with {key} replaced by store values.
+class IntentRouter
+{
+public:
+    struct Intent
+    {
+        std::string                            name;
+        std::vector<std::vector<std::string>>  groups;   // each one must match
+        std::vector<std::string>               extras;   // may appear, e.g. "status"
+        QString                                english;
+        QString                                persian;
+    };
+
+    struct Stats
+    {
+        int     queries;
+        int     hits;
+        qint64  totalNs;
+    };
+
+    explicit IntentRouter(const StatusStore *store);
+
+    // Power, fuel, temperature, humidity and pressure questions.
+    void   addDefaultIntents();
+
+    // Keywords are normalized like the transcripts.
+    void   addIntent(const Intent &intent);
+
+    // Minimum intent score, below it the transcript goes to the LLM.
+    void   setThreshold(float threshold);
+
+    // Returns true and the answer if the transcript is a status query.
+    bool   route(const QString &transcript, QString &answer);
+
+    Stats  stats() const;
+
+private:
+    // Keywords as code points
+    struct Compiled
+    {
+        std::vector<std::vector<std::u32string>>  groups;
+        std::vector<std::u32string>               extras;
+    };
+
+    // Score of an intent for the content words of a transcript, in [0, 1].
+    float  score(const Compiled &intent, const std::vector<edit_distance_pattern> &words) const;
+
+    // Fill in {key} placeholders, false if a value is missing.
+    bool   render(const QString &text, QString &answer) const;
+
+private:
+    const StatusStore               *m_store;
+    std::vector<Intent>              m_intents;
+    std::vector<Compiled>            m_compiled;
+    std::unordered_set<std::string>  m_stopWords;
+    float                            m_threshold     = 0.8f;
+    float                            m_wordThreshold = 0.75f; // similarity of a word and a keyword
+    Stats                            m_stats         = { };
+};
+
+#endif // INTENTROUTER_H
@@ -0,0 +1,23 @@
+#ifndef LLAMABATCH_H
+#define LLAMABATCH_H
+
+#include "llama.h"
+
+// Helpers for filling a batch created with llama_batch_init(n, 0, 1)
+
+inline void  batchClear(llama_batch &batch)
+{
+    batch.n_tokens = 0;
+}
+
+inline void  batchAdd(llama_batch &batch, llama_token id, llama_pos pos, llama_seq_id seq, bool logits)
+{
+    batch.token[batch.n_tokens]     = id;
+    batch.pos[batch.n_tokens]       = pos;
+    batch.n_seq_id[batch.n_tokens]  = 1;
+    batch.seq_id[batch.n_tokens][0] = seq;
+    batch.logits[batch.n_tokens]    = logits;
+    batch.n_tokens++;
+}
+
+#endif // LLAMABATCH_H
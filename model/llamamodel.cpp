@@ -2,16 +2,78 @@
 
 #include "llama.h"
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <algorithm>
 #include "document.h"
+#include "llamabatch.h"
+#include "documentindex.h"
+#include "fusedsampler.h"
+#include "textembedder.h"
+
+namespace
+{
+std::vector<DocumentIndex::Document>  plantDocuments()
+{
+    return {
+        { "manual", documents },
+        { "status1", documentStatus1 },
+        { "status2", documentStatus2 },
+        { "status4", documentStatus4 },
+        { "status5", documentStatus5 },
+        { "status6", documentStatus6 },
+        { "status7", documentStatus7 },
+        { "status8", documentStatus8 },
+        { "status9", documentStatus9 },
+        { "status10", documentStatus10 },
+    };
+}
+
+// Names that tell questions apart although they embed alike, a semantic
+// answer cache hit needs the same ones (and the same numbers)
+const QStringList  PLANT_ENTITIES = {
+    "gas", "steam", "compressor", "turbine", "transformer", "substation", "line",
+    "hitachi", "brown", "shariati", "kuhsangi", "khajeh", "sarakhs", "attar", "neyshabur",
+    "dizbad", "silo", "rezvan", "chahak", "mashhad",
+    "گازی", "بخار", "بخاری", "کمپرسور", "توربین", "ترانس", "پست", "خط",
+};
+
+const char *RETRIEVAL_INSTRUCTION =
+    "You are the voice assistant of the Shariati power plant. "
+    "Answer briefly, using only the plant documents given before each question.";
+}
 
 LlamaInterface::LlamaInterface(QObject *parent):
     QObject(parent), m_context(nullptr)
 {
     // ggml_backend_load_all();
+
+    for (const auto &document : plantDocuments())
+    {
+        m_documentIds.push_back(document.id);
+        m_answerCache.setDocument(document.id, DocumentIndex::hashText(document.text));
+    }
+
+    m_answerCache.setEntities(PLANT_ENTITIES);
 }
 
 LlamaInterface::~LlamaInterface()
 {
+    if (!m_answerCacheFile.isEmpty())
+    {
+        m_answerCache.save(m_answerCacheFile);
+    }
+
+    if (m_batch)
+    {
+        llama_batch_free(*m_batch);
+        delete m_batch;
+        m_batch = nullptr;
+    }
+
+    delete m_index;
+    delete m_embedder;
+
     // Free the llama model context if it has been created.
     if (m_context)
     {
@@ -49,8 +111,9 @@ bool  LlamaInterface::loadModel(const QString &modelFile)
     // Create a context for the model.
     llama_context_params  ctx_params = llama_context_default_params();
 
-    ctx_params.n_ctx   = 2048;
-    ctx_params.n_batch = 2048;
+    ctx_params.n_ctx     = 2048;
+    ctx_params.n_batch   = 2048;
+    ctx_params.n_seq_max = 2; // seq 1 holds speculative prefills
 
     m_context = llama_init_from_model(m_model, ctx_params);
 
@@ -63,132 +126,776 @@ bool  LlamaInterface::loadModel(const QString &modelFile)
         return false;
     }
 
-    auto  m_samplerParams = llama_sampler_chain_default_params();
-
-    m_sampler = llama_sampler_chain_init(m_samplerParams);
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_min_p(0.05f, 1));
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    // greedy matches the old min_p -> temp -> dist -> greedy chain, where greedy overrode dist
+    m_sampler = FusedSampler::create(0.05f, 0.8f, LLAMA_DEFAULT_SEED, true);
 
-    llama_sampler_chain_add(m_sampler, llama_sampler_init_greedy());
+    m_formatter.setTemplate(llama_model_chat_template(m_model, /* name */ nullptr));
 
-    m_formatted = std::vector<char>(llama_n_ctx(m_context));
+    // Room for a whole prompt, or one sampled token plus its draft
+    m_batch = new llama_batch(llama_batch_init(llama_n_batch(m_context), 0, 1));
 
     emit  modelLoaded();
 
-    m_messages.push_back({ "system", strdup(documents.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus1.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus2.c_str()) });
-    // m_messages.push_back({ "system", strdup(documentStatus3.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus4.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus5.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus5.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus6.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus7.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus8.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus9.c_str()) });
-    m_messages.push_back({ "system", strdup(documentStatus10.c_str()) });
+    if (m_index)
+    {
+        return evalSystemPrompt({ RETRIEVAL_INSTRUCTION });
+    }
+
+    return evalSystemPrompt({
+        documents,
+        documentStatus1,
+        documentStatus2,
+        // documentStatus3,
+        documentStatus4,
+        documentStatus5,
+        documentStatus6,
+        documentStatus7,
+        documentStatus8,
+        documentStatus9,
+        documentStatus10,
+    });
+}
+
+bool  LlamaInterface::evalSystemPrompt(const std::vector<std::string> &messages)
+{
+    m_systemMessages = messages;
+    m_history.clear();
+    m_history.beginTurn(true);
+
+    for (const auto &message : messages)
+    {
+        m_history.add("system", message);
+    }
+
+    std::string  prompt;
+
+    if (!m_formatter.delta(m_history.messages(), 0, false, prompt))
+    {
+        fail("failed to apply the chat template");
+
+        return false;
+    }
+
+    // evaluated once here so the turns after it have their own KV spans
+    if (!evalPrompt(prompt))
+    {
+        return false;
+    }
+
+    m_history.setSpan(0, m_n_past);
 
     return true;
 }
 
+bool  LlamaInterface::loadEmbeddingModel(const QString &modelFile, const QString &indexFile, bool quantized)
+{
+    m_embedder = new TextEmbedder();
+
+    if (!m_embedder->load(modelFile))
+    {
+        delete m_embedder;
+        m_embedder = nullptr;
+
+        return false;
+    }
+
+    m_index = new DocumentIndex(m_embedder);
+    m_index->setQuantized(quantized);
+    m_index->load(indexFile);
+
+    const int  embedded = m_index->update(plantDocuments());
+
+    if (embedded > 0)
+    {
+        m_index->save(indexFile);
+    }
+
+    qDebug() << "Document index:" << m_index->chunkCount() << "chunks," << embedded << "embedded";
+
+    m_answerCache.setEmbedder(m_embedder);
+
+    return true;
+}
+
+bool  LlamaInterface::loadAnswerCache(const QString &file)
+{
+    m_answerCacheFile = file;
+
+    if (!m_answerCache.load(file))
+    {
+        return false;
+    }
+
+    qDebug() << "Answer cache:" << m_answerCache.size() << "answers";
+
+    return true;
+}
+
+llama_model * LlamaInterface::model() const
+{
+    return m_model;
+}
+
+const std::vector<std::string> & LlamaInterface::systemMessages() const
+{
+    return m_systemMessages;
+}
+
+QSharedPointer<GenerationJob>  LlamaInterface::submit(const QString &prompt, GenerationJob::Priority priority,
+                                                      qint64 deadlineMs, int tokenBudget)
+{
+    QSharedPointer<GenerationJob>  job;
+
+    {
+        QMutexLocker  locker(&m_jobsMutex);
+
+        job = QSharedPointer<GenerationJob>::create(m_nextJobId++, prompt, priority, deadlineMs, tokenBudget);
+
+        // behind every job of the same or a higher priority
+        int  pos = 0;
+
+        while (pos < m_jobs.size() && m_jobs[pos]->priority() >= priority)
+        {
+            pos++;
+        }
+
+        m_jobs.insert(pos, job);
+    }
+
+    QMetaObject::invokeMethod(this, "processJobs", Qt::QueuedConnection);
+
+    return job;
+}
+
+TokenStream * LlamaInterface::tokenStream()
+{
+    return &m_stream;
+}
+
+QList<GenerationJobInfo>  LlamaInterface::jobs() const
+{
+    QMutexLocker              locker(&m_jobsMutex);
+    QList<GenerationJobInfo>  infos;
+
+    if (m_currentJob)
+    {
+        infos.append(m_currentJob->info());
+    }
+
+    for (const auto &job : m_jobs)
+    {
+        infos.append(job->info());
+    }
+
+    return infos;
+}
+
 void  LlamaInterface::generate(const QString &msg)
+{
+    submit(msg);
+}
+
+void  LlamaInterface::processJobs()
+{
+    while (true)
+    {
+        QSharedPointer<GenerationJob>  job;
+
+        {
+            QMutexLocker  locker(&m_jobsMutex);
+
+            if (m_currentJob || m_jobs.isEmpty())
+            {
+                return;
+            }
+
+            job          = m_jobs.takeFirst();
+            m_currentJob = job;
+        }
+
+        // a follow-up like "and unit 2?" depends on the earlier turns, so
+        // only questions that open a conversation are cached
+        const bool  cacheable = m_answerCaching && (m_history.turnCount() <= 1);
+
+        if (job->isCancelled())
+        {
+            job->finish(GenerationJob::Cancelled, QString());
+        }
+        else if (job->hasExpired())
+        {
+            job->finish(GenerationJob::Expired, QString());
+        }
+        else if (cacheable && answerFromCache(job))
+        {
+            // answered without generating
+        }
+        else
+        {
+            m_failed = false;
+            job->start();
+
+            QElapsedTimer  timer;
+
+            timer.start();
+
+            std::string  response = runGeneration(job->prompt());
+
+            auto  state = GenerationJob::Finished;
+
+            if (job->isCancelled())
+            {
+                state = GenerationJob::Cancelled;
+            }
+            else if (job->hasExpired())
+            {
+                state = GenerationJob::Expired;
+            }
+            else if (m_failed)
+            {
+                state = GenerationJob::Failed;
+            }
+
+            job->finish(state, QString::fromStdString(response));
+
+            if (state == GenerationJob::Finished)
+            {
+                // answers cut short by the token budget are not reused
+                if (cacheable && (job->tokenBudget() < 0))
+                {
+                    m_answerCache.insert(job->prompt(), response, m_sources, timer.elapsed());
+                }
+
+                emit  generateFinished(response);
+            }
+        }
+
+        flushTokenStream();
+
+        QMutexLocker  locker(&m_jobsMutex);
+
+        m_currentJob.reset();
+    }
+}
+
+void  LlamaInterface::flushTokenStream()
+{
+    // the UI fell behind by a whole stream buffer, try again later
+    if (!m_stream.flush())
+    {
+        QTimer::singleShot(10, this, &LlamaInterface::flushTokenStream);
+    }
+}
+
+std::string  LlamaInterface::runGeneration(const QString &msg)
 {
     std::string  message = msg.toStdString();
 
-    const char *tmpl = llama_model_chat_template(m_model, /* name */ nullptr);
-    m_messages.push_back({ "user", strdup(message.c_str()) });
+    evictHistory();
+
+    const int     turnStart = m_n_past;
+    const size_t  first     = m_history.messages().size();
 
-    int  new_len = llama_chat_apply_template(tmpl, m_messages.data(), m_messages.size(), true, m_formatted.data(), m_formatted.size());
+    m_history.beginTurn();
+    m_sources.clear();
 
-    if (new_len > (int)m_formatted.size())
+    if (m_index)
     {
-        m_formatted.resize(new_len);
-        new_len = llama_chat_apply_template(tmpl, m_messages.data(), m_messages.size(), true, m_formatted.data(), m_formatted.size());
+        std::string  context = retrieveContext(message, m_sources);
+
+        if (!context.empty())
+        {
+            m_history.add("system", context);
+        }
     }
+    else
+    {
+        m_sources = m_documentIds;
+    }
+
+    m_history.add("user", message);
 
-    // remove previous messages to obtain the prompt to generate the response
-    std::string  prompt(m_formatted.begin() + m_prev_len, m_formatted.begin() + new_len);
+    // only the new messages are rendered and tokenized, the earlier ones
+    // are already in the KV cache
+    std::string  prompt;
+
+    if (!m_formatter.delta(m_history.messages(), first, true, prompt))
+    {
+        fail("failed to apply the chat template");
+        m_history.setSpan(turnStart, m_n_past);
+
+        return std::string();
+    }
 
     std::string  response = askQuestion(prompt);
 
-    m_messages.push_back({ "assistant", strdup(response.c_str()) });
-    m_prev_len = llama_chat_apply_template(tmpl, m_messages.data(), m_messages.size(), false, nullptr, 0);
+    m_history.add("assistant", response);
+    m_history.setSpan(turnStart, m_n_past);
 
-    emit  generateFinished(response);
+    return response;
 }
 
-std::string  LlamaInterface::askQuestion(const std::string &prompt)
+void  LlamaInterface::evictHistory()
 {
-    std::string  response;
-    std::string  answer;
+    const int  budget = llama_n_ctx(m_context) - m_turnReserve;
+    const auto spans  = m_history.evict(budget);
 
-    const bool  is_first = llama_get_kv_cache_used_cells(m_context) == 0;
+    if (spans.empty())
+    {
+        return;
+    }
 
-    // tokenize the prompt
-    const int                 n_prompt_tokens = -llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
-    std::vector<llama_token>  prompt_tokens(n_prompt_tokens);
+    discardSpeculation();
 
-    if (llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), prompt_tokens.data(), prompt_tokens.size(), is_first, true) < 0)
+    // each span is relative to the cells left by the previous one, so
+    // remove it and shift the rest of the conversation down over the gap
+    for (const auto &span : spans)
     {
-        emit  errorOccure("failed to tokenize the prompt");
+        const int  size = span.end - span.begin;
+
+        llama_kv_cache_seq_rm(m_context, 0, span.begin, span.end);
+        llama_kv_cache_seq_add(m_context, 0, span.end, -1, -size);
+
+        m_lookup.erase(span.begin, span.end);
+        m_n_past -= size;
+    }
 
+    qDebug() << "evicted" << spans.size() << "turns," << m_n_past << "cells in use, history arena"
+             << m_history.liveBytes() << "of" << m_history.arenaBytes() << "bytes live";
+}
+
+std::string  LlamaInterface::askQuestion(const std::string &prompt)
+{
+    std::string  answer;
+
+    if (!evalPrompt(prompt))
+    {
         return answer;
     }
 
-    // prepare a batch for the prompt
-    llama_batch  batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    llama_token  new_token_id;
+    const int  n_ctx   = llama_n_ctx(m_context);
+    const int  n_batch = llama_n_batch(m_context);
+
+    std::vector<llama_token>  draft;
+    int                       n_drafted  = 0;
+    int                       n_accepted = 0;
+    llama_token               new_token_id = FusedSampler::sample(m_sampler, m_context, m_batch->n_tokens - 1);
 
     while (true)
     {
-        // check if we have enough space in the context to evaluate this batch
-        int  n_ctx      = llama_n_ctx(m_context);
-        int  n_ctx_used = llama_get_kv_cache_used_cells(m_context);
+        // is it an end of generation?
+        if (llama_vocab_is_eog(m_vocab, new_token_id))
+        {
+            break;
+        }
 
-        if (n_ctx_used + batch.n_tokens > n_ctx)
+        if (!appendPiece(new_token_id, answer))
         {
-            emit  errorOccure("context size exceeded");
+            break;
+        }
+
+        m_lookup.append(new_token_id);
 
+        // checked between decode calls, cancellation is cooperative
+        if (stopRequested())
+        {
             break;
         }
 
-        if (llama_decode(m_context, batch))
+        // draft the continuation, leaving room for the sampled token
+        draft.clear();
+
+        if (m_lookupDecoding)
+        {
+            m_lookup.draft(draft, std::min(n_batch, n_ctx - m_n_past) - 1);
+        }
+
+        // check if we have enough space in the context to evaluate this batch
+        if (m_n_past + 1 + (int)draft.size() > n_ctx)
         {
-            emit  errorOccure("failed to decode");
+            fail("context size exceeded");
 
             break;
         }
 
-        // sample the next token
-        new_token_id = llama_sampler_sample(m_sampler, m_context, -1);
+        // the sampled token followed by the draft, logits for every position
+        batchClear(*m_batch);
+        batchAdd(*m_batch, new_token_id, m_n_past, 0, true);
 
-        // is it an end of generation?
-        if (llama_vocab_is_eog(m_vocab, new_token_id))
+        for (size_t i = 0; i < draft.size(); ++i)
+        {
+            batchAdd(*m_batch, draft[i], m_n_past + 1 + i, 0, true);
+        }
+
+        if (llama_decode(m_context, *m_batch))
         {
+            fail("failed to decode");
+
             break;
         }
 
-        // convert the token to a string, print it and add it to the response
-        char  buf[256];
-        int   n = llama_token_to_piece(m_vocab, new_token_id, buf, sizeof(buf), 0, true);
+        m_n_past++;
+
+        // accept draft tokens while they match what the sampler picks at the
+        // same position, so the output is the same as without drafting
+        size_t  n_match = 0;
+        bool    eog     = false;
+
+        new_token_id = FusedSampler::sample(m_sampler, m_context, 0);
+
+        while (n_match < draft.size() && new_token_id == draft[n_match])
+        {
+            if (llama_vocab_is_eog(m_vocab, new_token_id) || stopRequested() || !appendPiece(new_token_id, answer))
+            {
+                eog = true;
+                break;
+            }
+
+            m_lookup.append(new_token_id);
+            n_match++;
+            new_token_id = FusedSampler::sample(m_sampler, m_context, n_match);
+        }
+
+        m_n_past   += n_match;
+        n_drafted  += draft.size();
+        n_accepted += n_match;
 
-        if (n < 0)
+        // drop the rejected part of the draft from the KV cache
+        if (n_match < draft.size())
         {
-            emit  errorOccure("failed to convert token to piece");
+            llama_kv_cache_seq_rm(m_context, 0, m_n_past, -1);
+        }
 
+        if (eog)
+        {
             break;
         }
+    }
+
+    // the token appended before a stop or a failed decode never reached the
+    // KV cache, keep the lookup aligned with its positions
+    m_lookup.truncate(m_n_past);
 
-        std::string  piece(buf, n);
+    if (n_drafted > 0)
+    {
+        qDebug() << "lookup decoding accepted" << n_accepted << "of" << n_drafted << "drafted tokens";
+    }
 
-        answer.append(piece);
+    return answer;
+}
 
-        emit  answerReady(QString::fromStdString(piece));
+bool  LlamaInterface::evalPrompt(const std::string &prompt)
+{
+    std::vector<llama_token>  prompt_tokens;
 
-        // prepare the next batch with the sampled token
-        batch = llama_batch_get_one(&new_token_id, 1);
+    if (!tokenize(prompt, prompt_tokens))
+    {
+        fail("failed to tokenize the prompt");
+
+        return false;
     }
 
-    return answer;
+    const int  n_prompt_tokens = prompt_tokens.size();
+
+    if (m_n_past + n_prompt_tokens > (int)llama_n_ctx(m_context))
+    {
+        fail("context size exceeded");
+
+        return false;
+    }
+
+    // the start of the prompt may already be decoded from a partial transcript
+    const int  reused = adoptSpeculation(prompt_tokens);
+
+    if (!decodeTokens(prompt_tokens.data() + reused, n_prompt_tokens - reused, m_n_past + reused, 0, true))
+    {
+        fail("failed to decode");
+
+        return false;
+    }
+
+    m_n_past += n_prompt_tokens;
+
+    // everything in the context is a source for lookup drafts, the system
+    // documents included
+    m_lookup.append(prompt_tokens);
+
+    return true;
+}
+
+bool  LlamaInterface::tokenize(const std::string &text, std::vector<llama_token> &tokens) const
+{
+    const bool  is_first = llama_get_kv_cache_used_cells(m_context) == 0;
+    const int   n_tokens = -llama_tokenize(m_vocab, text.c_str(), text.size(), NULL, 0, is_first, true);
+
+    tokens.resize(n_tokens);
+
+    return llama_tokenize(m_vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), is_first, true) >= 0;
+}
+
+bool  LlamaInterface::decodeTokens(const llama_token *tokens, int count, int pos, int seq, bool lastLogits)
+{
+    const int  n_batch = llama_n_batch(m_context);
+
+    // evaluate in n_batch sized chunks, logits at most for the last token
+    for (int i = 0; i < count; i += n_batch)
+    {
+        const int  n_eval = std::min(n_batch, count - i);
+
+        batchClear(*m_batch);
+
+        for (int j = 0; j < n_eval; ++j)
+        {
+            batchAdd(*m_batch, tokens[i + j], pos + i + j, seq, lastLogits && (i + j == count - 1));
+        }
+
+        if (llama_decode(m_context, *m_batch))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void  LlamaInterface::prefillPartial(const QString &transcript, bool complete)
+{
+    {
+        QMutexLocker  locker(&m_jobsMutex);
+
+        // a question is already on its way, the KV cache is busy
+        if (m_currentJob || !m_jobs.isEmpty())
+        {
+            return;
+        }
+    }
+
+    if (!m_context)
+    {
+        return;
+    }
+
+    // the last word of audio cut mid-speech is the least stable
+    QString  text = transcript.trimmed();
+
+    if (!complete)
+    {
+        text.truncate(qMax<qsizetype>(0, text.lastIndexOf(' ')));
+    }
+
+    if (text.isEmpty())
+    {
+        return;
+    }
+
+    // render the turn as runGeneration() will, without adding it to the history
+    evictHistory();
+
+    std::string                      message  = text.toStdString();
+    std::vector<llama_chat_message>  messages = m_history.messages();
+    std::vector<std::string>         sources;
+    std::string                      context;
+    std::string                      prompt;
+    std::vector<llama_token>         tokens;
+
+    if (m_index)
+    {
+        context = retrieveContext(message, sources);
+
+        if (!context.empty())
+        {
+            messages.push_back({ "system", context.c_str() });
+        }
+    }
+
+    messages.push_back({ "user", message.c_str() });
+
+    if (!m_formatter.delta(messages, m_history.messages().size(), true, prompt) || !tokenize(prompt, tokens))
+    {
+        return;
+    }
+
+    if (m_specBase != m_n_past)
+    {
+        discardSpeculation();
+    }
+
+    // room for the answer is left to the real turn
+    if (m_n_past + (int)tokens.size() + m_turnReserve / 2 > (int)llama_n_ctx(m_context))
+    {
+        return;
+    }
+
+    // only the part that differs from the previous partial is decoded again
+    size_t  common = 0;
+
+    while (common < tokens.size() && common < m_specTokens.size() && tokens[common] == m_specTokens[common])
+    {
+        common++;
+    }
+
+    if (m_specBase != m_n_past)
+    {
+        // seq 1 attends to the system prompt, the documents and the
+        // conversation of seq 0, the cells are shared rather than decoded again
+        llama_kv_cache_seq_rm(m_context, 1, -1, -1);
+        llama_kv_cache_seq_cp(m_context, 0, 1, 0, m_n_past);
+        m_specBase = m_n_past;
+    }
+
+    llama_kv_cache_seq_rm(m_context, 1, m_n_past + common, -1);
+    m_specTokens.resize(common);
+
+    if (!decodeTokens(tokens.data() + common, tokens.size() - common, m_n_past + common, 1, false))
+    {
+        discardSpeculation();
+
+        return;
+    }
+
+    m_specTokens = tokens;
+}
+
+int  LlamaInterface::adoptSpeculation(const std::vector<llama_token> &tokens)
+{
+    if (m_specTokens.empty())
+    {
+        discardSpeculation();
+
+        return 0;
+    }
+
+    int  common = 0;
+
+    if (m_specBase == m_n_past)
+    {
+        // the last token is decoded again for its logits
+        const int  limit = std::min(tokens.size(), m_specTokens.size() + 1) - 1;
+
+        while (common < limit && tokens[common] == m_specTokens[common])
+        {
+            common++;
+        }
+    }
+
+    if (common > 0)
+    {
+        llama_kv_cache_seq_cp(m_context, 1, 0, m_n_past, m_n_past + common);
+    }
+
+    discardSpeculation();
+
+    m_specTurns++;
+    m_specSaved += common;
+
+    qDebug() << "speculative prefill reused" << common << "of" << tokens.size() << "prompt tokens,"
+             << m_specSaved << "in" << m_specTurns << "turns";
+
+    return common;
+}
+
+void  LlamaInterface::discardSpeculation()
+{
+    // seq 1 holds the shared prefix as soon as a speculation started
+    if (m_context && (m_specBase >= 0 || !m_specTokens.empty()))
+    {
+        llama_kv_cache_seq_rm(m_context, 1, -1, -1);
+    }
+
+    m_specTokens.clear();
+    m_specBase = -1;
+}
+
+bool  LlamaInterface::appendPiece(int32_t token, std::string &answer)
+{
+    // convert the token to a string, print it and add it to the response
+    char  buf[256];
+    int   n = llama_token_to_piece(m_vocab, token, buf, sizeof(buf), 0, true);
+
+    if (n < 0)
+    {
+        fail("failed to convert token to piece");
+
+        return false;
+    }
+
+    std::string  piece(buf, n);
+
+    answer.append(piece);
+
+    // the UI picks the bytes up at its own rate
+    m_stream.write(buf, n);
+
+    if (m_currentJob)
+    {
+        m_currentJob->addToken(piece);
+    }
+
+    return true;
+}
+
+bool  LlamaInterface::answerFromCache(const QSharedPointer<GenerationJob> &job)
+{
+    std::string  answer;
+
+    if (!m_answerCache.lookup(job->prompt(), answer))
+    {
+        return false;
+    }
+
+    // straight to speech, the question is not added to the conversation
+    job->start();
+    job->addToken(answer);
+    m_stream.write(answer.data(), answer.size());
+    job->finish(GenerationJob::Finished, QString::fromStdString(answer));
+    emit  generateFinished(answer);
+
+    return true;
+}
+
+bool  LlamaInterface::stopRequested() const
+{
+    if (!m_currentJob)
+    {
+        return false;
+    }
+
+    const int  budget = m_currentJob->tokenBudget();
+
+    return m_currentJob->isCancelled() || m_currentJob->hasExpired() ||
+           ((budget >= 0) && (m_currentJob->tokens() >= budget));
+}
+
+void  LlamaInterface::fail(const QString &error)
+{
+    m_failed = true;
+
+    emit  errorOccure(error);
+}
+
+std::string  LlamaInterface::retrieveContext(const std::string &question, std::vector<std::string> &documentIds)
+{
+    std::string  context;
+
+    for (const auto &hit : m_index->search(question, m_retrievalTopK))
+    {
+        context += hit.text;
+        context += "\n";
+
+        if (std::find(documentIds.begin(), documentIds.end(), hit.documentId) == documentIds.end())
+        {
+            documentIds.push_back(hit.documentId);
+        }
+    }
+
+    return context;
+}
+
+void  LlamaInterface::setLookupDecoding(bool enabled)
+{
+    m_lookupDecoding = enabled;
+}
+
+void  LlamaInterface::setAnswerCaching(bool enabled)
+{
+    m_answerCaching = enabled;
 }
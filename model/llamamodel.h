@@ -1,9 +1,19 @@
 #ifndef LLAMAMODEL_H
 #define LLAMAMODEL_H
 
+#include <QList>
+#include <QMutex>
 #include <QObject>
+#include <QSharedPointer>
 #include <QString>
 
+#include "answercache.h"
+#include "chatformatter.h"
+#include "chathistory.h"
+#include "generationjob.h"
+#include "ngramdraft.h"
+#include "tokenstream.h"
+
 
 // Forward declarations: use the appropriate types if they’re defined in the llama headers
 struct llama_model;
@@ -11,7 +21,10 @@ struct llama_context;
 struct llama_vocab;
 struct llama_sampler_chain_params;
 struct llama_sampler;
-struct llama_chat_message;
+struct llama_batch;
+
+class TextEmbedder;
+class DocumentIndex;
 
 class LlamaInterface: public QObject
 {
@@ -25,24 +38,111 @@ public:
     // Load the model from the given file path. Returns true if loaded.
     bool  loadModel(const QString &modelFile);
 
+    // Load a GGUF embedding model and answer from the document chunks that
+    // match each question instead of the whole manual. The index is kept in
+    // indexFile and only changed documents are embedded again. Call before
+    // loadModel().
+    bool  loadEmbeddingModel(const QString &modelFile, const QString &indexFile, bool quantized = false);
+
+    // Answer repeated questions from a cache kept in file, see AnswerCache.
+    // The semantic tier is used when an embedding model is loaded.
+    bool  loadAnswerCache(const QString &file);
+
+    // Loaded model, e.g. to serve more conversations from a LlamaSessionManager
+    // without loading the weights again.
+    llama_model *model() const;
+
+    // System messages decoded by loadModel(), for the sessions of a
+    // LlamaSessionManager.
+    const std::vector<std::string> &systemMessages() const;
+
+    // Queue a question. Jobs run one at a time, highest priority first and in
+    // submission order within a priority. deadlineMs is relative to now and
+    // tokenBudget limits the answer length, negative values mean no limit.
+    // Safe to call from any thread.
+    QSharedPointer<GenerationJob>  submit(const QString &prompt, GenerationJob::Priority priority = GenerationJob::Normal,
+                                          qint64 deadlineMs = -1, int tokenBudget = -1);
+
+    // The running job followed by the queued ones, for monitoring.
+    QList<GenerationJobInfo>       jobs() const;
+
+    // Text of the answers as it is generated, read it from the GUI thread
+    // e.g. once per frame.
+    TokenStream                   *tokenStream();
+
 public  slots:
-    // Ask a question and return an answer. (This is a simple synchronous method;
-    // in a production app you might want asynchronous generation.)
+    // Queue a question with normal priority, see submit().
     void         generate(const QString &prompt);
 
     std::string  askQuestion(const std::string &prompt);
 
+    // Enable prompt lookup decoding: continuations found in the documents or
+    // in the conversation are drafted and verified in a single batch.
+    void         setLookupDecoding(bool enabled);
+
+    void         setAnswerCaching(bool enabled);
+
+    // Decode the user turn for a partial transcript into a scratch sequence
+    // while the user is still talking. The next question reuses the tokens it
+    // has in common with it. complete means the audio ended in silence, so
+    // its last word is kept. Ignored while a question is queued or running.
+    void         prefillPartial(const QString &transcript, bool complete);
+
 signals:
     // Emitted when the model is loaded
     void         modelLoaded();
 
-    // Emitted when a generated answer is ready
-    void         answerReady(const QString &answer);
-
     void         generateFinished(std::string);
 
     void         errorOccure(QString);
 
+private slots:
+    // Run queued jobs until the queue is empty.
+    void         processJobs();
+
+    // Write the bytes that did not fit into the token stream.
+    void         flushTokenStream();
+
+private:
+    // Add the question to the conversation and answer it.
+    std::string  runGeneration(const QString &prompt);
+
+    // Finish the job with a cached answer if there is one.
+    bool         answerFromCache(const QSharedPointer<GenerationJob> &job);
+
+    // The running job was cancelled, expired or used up its token budget.
+    bool         stopRequested() const;
+
+    void         fail(const QString &error);
+
+    // Convert token to text, append it to answer and emit it.
+    bool         appendPiece(int32_t token, std::string &answer);
+
+    // Tokenize the prompt and evaluate it after the cached positions. The
+    // logits of the last token are left in m_batch.
+    bool         evalPrompt(const std::string &prompt);
+
+    bool         tokenize(const std::string &text, std::vector<int32_t> &tokens) const;
+
+    bool         decodeTokens(const int32_t *tokens, int count, int pos, int seq, bool lastLogits);
+
+    // Move the speculative tokens that start tokens from seq 1 to seq 0 and
+    // drop the rest. Returns how many can be skipped.
+    int          adoptSpeculation(const std::vector<int32_t> &tokens);
+
+    void         discardSpeculation();
+
+    // Add the system messages as the pinned first turn and evaluate them.
+    bool         evalSystemPrompt(const std::vector<std::string> &messages);
+
+    // Drop the oldest turns and their KV cells so the next question and its
+    // answer fit in the context.
+    void         evictHistory();
+
+    // Document chunks relevant to the question, formatted as a system message.
+    // Ids of the documents the chunks came from are added to documentIds.
+    std::string  retrieveContext(const std::string &question, std::vector<std::string> &documentIds);
+
 private:
     // Pointer to the underlying llama context.
     // (Depending on your version of llama.cpp, this might be a
@@ -51,10 +151,36 @@ private:
     llama_model                     *m_model   = nullptr;
     llama_sampler                   *m_sampler = nullptr;
     const struct llama_vocab        *m_vocab   = nullptr;
-    std::vector<llama_chat_message>  m_messages;
-    std::vector<char>                m_formatted;
+    ChatHistory                      m_history;
+    ChatFormatter                    m_formatter;
     int                              m_n_prompt = 0;
-    int                              m_prev_len = 0;
+    llama_batch                     *m_batch    = nullptr;
+    int                              m_n_past   = 0;
+    NgramDraft                       m_lookup;
+    bool                             m_lookupDecoding = true;
+    TextEmbedder                    *m_embedder       = nullptr;
+    DocumentIndex                   *m_index          = nullptr;
+    int                              m_retrievalTopK  = 3;
+    int                              m_turnReserve    = 768; // KV cells kept free for the next turn
+    AnswerCache                      m_answerCache;
+    QString                          m_answerCacheFile;
+    bool                             m_answerCaching = true;
+    std::vector<std::string>         m_documentIds;
+    std::vector<std::string>         m_systemMessages;
+    std::vector<std::string>         m_sources; // documents the last answer was based on
+    TokenStream                      m_stream;
+
+    // speculative prefill in seq 1, starting at position m_specBase
+    std::vector<int32_t>             m_specTokens;
+    int                              m_specBase  = -1;
+    int                              m_specTurns = 0;
+    qint64                           m_specSaved = 0;
+
+    mutable QMutex                   m_jobsMutex;
+    QList<QSharedPointer<GenerationJob>>  m_jobs;
+    QSharedPointer<GenerationJob>    m_currentJob;
+    quint64                          m_nextJobId = 1;
+    bool                             m_failed    = false;
 };
 
 #endif // LLAMAMODEL_H
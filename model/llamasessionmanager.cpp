@@ -0,0 +1,510 @@
+#include "llamasessionmanager.h"
+
+#include "llama.h"
+#include "llamabatch.h"
+#include "fusedsampler.h"
+#include <QDebug>
+
+#include <algorithm>
+
+LlamaSessionManager::LlamaSessionManager(llama_model *model, int maxSessions, int contextPerSession, QObject *parent):
+    QObject(parent), m_model(model), m_maxSessions(maxSessions), m_contextPerSession(contextPerSession)
+{
+    m_vocab = llama_model_get_vocab(m_model);
+
+    // The shared prefix is stored once, so this is an upper bound.
+    // Sequence 0 holds the prefix, sessions use 1..maxSessions.
+    llama_context_params  ctx_params = llama_context_default_params();
+
+    ctx_params.n_ctx     = contextPerSession * maxSessions;
+    ctx_params.n_batch   = 2048;
+    ctx_params.n_seq_max = maxSessions + 1;
+
+    m_context = llama_init_from_model(m_model, ctx_params);
+
+    if (!m_context)
+    {
+        qWarning() << "Failed to create context for" << maxSessions << "sessions";
+
+        return;
+    }
+
+    m_batch     = new llama_batch(llama_batch_init(llama_n_batch(m_context), 0, 1));
+    m_formatted = std::vector<char>(contextPerSession);
+}
+
+LlamaSessionManager::~LlamaSessionManager()
+{
+    for (auto &entry : m_sessions)
+    {
+        llama_sampler_free(entry.second.sampler);
+    }
+
+    if (m_batch)
+    {
+        llama_batch_free(*m_batch);
+        delete m_batch;
+        m_batch = nullptr;
+    }
+
+    if (m_context)
+    {
+        llama_free(m_context);
+        m_context = nullptr;
+    }
+}
+
+bool  LlamaSessionManager::isValid() const
+{
+    return m_context != nullptr;
+}
+
+bool  LlamaSessionManager::setSystemMessages(const std::vector<std::string> &messages)
+{
+    if (!m_context || !m_sessions.empty())
+    {
+        return false;
+    }
+
+    m_system.clear();
+
+    for (const auto &message : messages)
+    {
+        m_system.push_back({ "system", message });
+    }
+
+    // format the system turns alone, the first user turn is formatted as the
+    // difference to this
+    std::vector<llama_chat_message>  chat;
+
+    for (const auto &turn : m_system)
+    {
+        chat.push_back({ turn.role.c_str(), turn.content.c_str() });
+    }
+
+    const char *tmpl = llama_model_chat_template(m_model, /* name */ nullptr);
+    int         len  = llama_chat_apply_template(tmpl, chat.data(), chat.size(), false, m_formatted.data(), m_formatted.size());
+
+    if (len > (int)m_formatted.size())
+    {
+        m_formatted.resize(len);
+        len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), false, m_formatted.data(), m_formatted.size());
+    }
+
+    if (len < 0)
+    {
+        qWarning() << "Failed to apply the chat template";
+
+        return false;
+    }
+
+    const std::string         prefix(m_formatted.begin(), m_formatted.begin() + len);
+    const int                 n_tokens = -llama_tokenize(m_vocab, prefix.c_str(), prefix.size(), NULL, 0, true, true);
+    std::vector<llama_token>  tokens(n_tokens);
+
+    if ((llama_tokenize(m_vocab, prefix.c_str(), prefix.size(), tokens.data(), tokens.size(), true, true) < 0) ||
+        (n_tokens >= m_contextPerSession))
+    {
+        qWarning() << "System prompt does not fit into a session";
+
+        return false;
+    }
+
+    llama_kv_cache_clear(m_context);
+
+    const int  n_batch = llama_n_batch(m_context);
+
+    for (int i = 0; i < n_tokens; i += n_batch)
+    {
+        const int  n_eval = std::min(n_batch, n_tokens - i);
+
+        batchClear(*m_batch);
+
+        for (int j = 0; j < n_eval; ++j)
+        {
+            batchAdd(*m_batch, tokens[i + j], i + j, 0, false);
+        }
+
+        if (llama_decode(m_context, *m_batch))
+        {
+            qWarning() << "Failed to decode the system prompt";
+
+            return false;
+        }
+    }
+
+    m_prefixLen   = n_tokens;
+    m_prefixChars = len;
+
+    return true;
+}
+
+int  LlamaSessionManager::openSession(int maxTokens)
+{
+    if (!m_context || ((int)m_sessions.size() >= m_maxSessions))
+    {
+        return -1;
+    }
+
+    // lowest free sequence id
+    int  seq = 1;
+
+    for (bool used = true; used; )
+    {
+        used = false;
+
+        for (const auto &entry : m_sessions)
+        {
+            if (entry.second.seq == seq)
+            {
+                used = true;
+                seq++;
+                break;
+            }
+        }
+    }
+
+    const int  id      = m_nextId++;
+    Session   &session = m_sessions[id];
+
+    session.seq       = seq;
+    session.maxTokens = maxTokens;
+    session.nPast     = m_prefixLen;
+    session.prevLen   = m_prefixChars;
+    session.sampler   = createSampler();
+
+    // share the decoded system prompt instead of evaluating it again
+    llama_kv_cache_seq_rm(m_context, seq, -1, -1);
+    llama_kv_cache_seq_cp(m_context, 0, seq, -1, -1);
+
+    return id;
+}
+
+void  LlamaSessionManager::closeSession(int session)
+{
+    auto  it = m_sessions.find(session);
+
+    if (it == m_sessions.end())
+    {
+        return;
+    }
+
+    llama_kv_cache_seq_rm(m_context, it->second.seq, -1, -1);
+    llama_sampler_free(it->second.sampler);
+    m_sessions.erase(it);
+}
+
+int  LlamaSessionManager::activeSessions() const
+{
+    return m_sessions.size();
+}
+
+void  LlamaSessionManager::ask(int session, const QString &prompt)
+{
+    auto  it = m_sessions.find(session);
+
+    if (it == m_sessions.end())
+    {
+        emit  errorOccure(session, "unknown session");
+
+        return;
+    }
+
+    Session &s = it->second;
+
+    s.queued.push_back(prompt.toStdString());
+
+    if (!s.generating && s.pending.empty())
+    {
+        nextTurn(session, s);
+    }
+
+    scheduleStep();
+}
+
+void  LlamaSessionManager::step()
+{
+    m_stepQueued = false;
+
+    if (m_sessions.empty())
+    {
+        return;
+    }
+
+    const int  n_batch = llama_n_batch(m_context);
+
+    // rotate the order so no session always gets the remainder of the batch
+    std::vector<int>  order;
+
+    for (const auto &entry : m_sessions)
+    {
+        order.push_back(entry.first);
+    }
+
+    std::rotate(order.begin(), order.begin() + (m_roundRobin++ % order.size()), order.end());
+
+    batchClear(*m_batch);
+
+    // sessions with tokens in this batch
+    std::vector<int>  touched;
+
+    // the next token of every generating session
+    for (int id : order)
+    {
+        Session &s = m_sessions[id];
+
+        s.logitsIdx = -1;
+
+        if (!s.generating)
+        {
+            continue;
+        }
+
+        if (s.nPast + 1 > m_contextPerSession)
+        {
+            // the next prompt is prefilled below, in this batch
+            failTurn(id, s, "context size exceeded");
+            nextTurn(id, s);
+            continue;
+        }
+
+        s.logitsIdx = m_batch->n_tokens;
+        batchAdd(*m_batch, s.next, s.nPast++, s.seq, true);
+        touched.push_back(id);
+    }
+
+    // pending prompts share the rest of the batch
+    std::vector<int>  prefilling;
+
+    for (int id : order)
+    {
+        if (!m_sessions[id].pending.empty())
+        {
+            prefilling.push_back(id);
+        }
+    }
+
+    while (!prefilling.empty() && (m_batch->n_tokens < n_batch))
+    {
+        const int  share = std::max(1, (n_batch - m_batch->n_tokens) / (int)prefilling.size());
+
+        for (auto it = prefilling.begin(); it != prefilling.end() && m_batch->n_tokens < n_batch; )
+        {
+            Session  &s    = m_sessions[*it];
+            const int take = std::min({ share, (int)s.pending.size(), n_batch - m_batch->n_tokens });
+
+            for (int j = 0; j < take; ++j)
+            {
+                const bool  last = j + 1 == (int)s.pending.size();
+
+                if (last)
+                {
+                    s.logitsIdx = m_batch->n_tokens;
+                }
+
+                batchAdd(*m_batch, s.pending[j], s.nPast++, s.seq, last);
+            }
+
+            s.pending.erase(s.pending.begin(), s.pending.begin() + take);
+
+            if (std::find(touched.begin(), touched.end(), *it) == touched.end())
+            {
+                touched.push_back(*it);
+            }
+
+            if (s.pending.empty())
+            {
+                it = prefilling.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    if (m_batch->n_tokens == 0)
+    {
+        return;
+    }
+
+    if (llama_decode(m_context, *m_batch))
+    {
+        bool  busy = false;
+
+        for (int id : touched)
+        {
+            Session &s = m_sessions[id];
+
+            failTurn(id, s, "failed to decode");
+            nextTurn(id, s);
+            busy = busy || !s.pending.empty();
+        }
+
+        if (busy)
+        {
+            scheduleStep();
+        }
+
+        return;
+    }
+
+    bool  busy = false;
+
+    for (int id : order)
+    {
+        Session &s = m_sessions[id];
+
+        if (s.logitsIdx >= 0)
+        {
+            const llama_token  token = FusedSampler::sample(s.sampler, m_context, s.logitsIdx);
+
+            s.generating = true;
+            s.logitsIdx  = -1;
+
+            char  buf[256];
+            int   n = llama_token_to_piece(m_vocab, token, buf, sizeof(buf), 0, true);
+
+            if (llama_vocab_is_eog(m_vocab, token) || (n < 0) || (s.generated >= s.maxTokens))
+            {
+                finishTurn(id, s);
+            }
+            else
+            {
+                std::string  piece(buf, n);
+
+                s.response.append(piece);
+                s.next = token;
+                s.generated++;
+
+                emit  answerReady(id, QString::fromStdString(piece));
+            }
+        }
+
+        busy = busy || s.generating || !s.pending.empty();
+    }
+
+    if (busy)
+    {
+        scheduleStep();
+    }
+}
+
+llama_sampler * LlamaSessionManager::createSampler() const
+{
+    // same sampling as LlamaInterface
+    return FusedSampler::create(0.05f, 0.8f, LLAMA_DEFAULT_SEED, true);
+}
+
+bool  LlamaSessionManager::startTurn(int id, Session &session)
+{
+    if (session.queued.empty())
+    {
+        return false;
+    }
+
+    session.turnStart = session.nPast;
+    session.turns.push_back({ "user", session.queued.front() });
+    session.queued.erase(session.queued.begin());
+
+    const int  new_len = format(session, true);
+
+    // only the new part of the conversation is evaluated
+    const std::string         prompt(m_formatted.begin() + session.prevLen, m_formatted.begin() + new_len);
+    const int                 n_tokens = -llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), NULL, 0, false, true);
+    std::vector<llama_token>  tokens(n_tokens);
+
+    if (llama_tokenize(m_vocab, prompt.c_str(), prompt.size(), tokens.data(), tokens.size(), false, true) < 0)
+    {
+        failTurn(id, session, "failed to tokenize the prompt");
+
+        return false;
+    }
+
+    if (session.nPast + n_tokens > m_contextPerSession)
+    {
+        failTurn(id, session, "context size exceeded");
+
+        return false;
+    }
+
+    session.pending.assign(tokens.begin(), tokens.end());
+    session.response.clear();
+    session.generated = 0;
+
+    return true;
+}
+
+void  LlamaSessionManager::finishTurn(int id, Session &session)
+{
+    session.generating = false;
+    session.turns.push_back({ "assistant", session.response });
+
+    session.prevLen = format(session, false);
+
+    emit  generateFinished(id, session.response);
+
+    nextTurn(id, session);
+}
+
+void  LlamaSessionManager::nextTurn(int id, Session &session)
+{
+    // a prompt that cannot start is failed, the one after it gets its turn
+    while (!session.queued.empty() && !startTurn(id, session))
+    {
+    }
+}
+
+void  LlamaSessionManager::failTurn(int id, Session &session, const QString &error)
+{
+    session.generating = false;
+    session.logitsIdx  = -1;
+    session.pending.clear();
+
+    // forget the unanswered user turn and whatever was decoded for it
+    if (!session.turns.empty() && (session.turns.back().role == "user"))
+    {
+        session.turns.pop_back();
+    }
+
+    session.prevLen = format(session, false);
+    session.nPast   = session.turnStart;
+    llama_kv_cache_seq_rm(m_context, session.seq, session.turnStart, -1);
+
+    emit  errorOccure(id, error);
+}
+
+int  LlamaSessionManager::format(const Session &session, bool addAss)
+{
+    std::vector<llama_chat_message>  chat;
+
+    for (const auto &turn : m_system)
+    {
+        chat.push_back({ turn.role.c_str(), turn.content.c_str() });
+    }
+
+    for (const auto &turn : session.turns)
+    {
+        chat.push_back({ turn.role.c_str(), turn.content.c_str() });
+    }
+
+    const char *tmpl = llama_model_chat_template(m_model, /* name */ nullptr);
+    int         len  = llama_chat_apply_template(tmpl, chat.data(), chat.size(), addAss, m_formatted.data(), m_formatted.size());
+
+    if (len > (int)m_formatted.size())
+    {
+        m_formatted.resize(len);
+        len = llama_chat_apply_template(tmpl, chat.data(), chat.size(), addAss, m_formatted.data(), m_formatted.size());
+    }
+
+    return len;
+}
+
+void  LlamaSessionManager::scheduleStep()
+{
+    if (!m_stepQueued)
+    {
+        m_stepQueued = true;
+        QMetaObject::invokeMethod(this, "step", Qt::QueuedConnection);
+    }
+}
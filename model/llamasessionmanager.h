@@ -0,0 +1,126 @@
+#ifndef LLAMASESSIONMANAGER_H
+#define LLAMASESSIONMANAGER_H
+
+#include <QObject>
+#include <QString>
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+struct llama_vocab;
+struct llama_sampler;
+struct llama_batch;
+
+// Serves several conversations (e.g. one per operator station) from one
+// model and one llama_context.
+//
+// Every session owns a llama sequence id. The system prompt is decoded once
+// into sequence 0 and copied into new sessions with a KV sequence copy, so
+// the shared cells are stored once. Generation uses continuous batching: one
+// llama_decode advances the next token of every generating session and
+// prefills pending prompts of the others with what is left of the batch.
+class LlamaSessionManager: public QObject
+{
+    Q_OBJECT
+
+public:
+    // contextPerSession is the most tokens one session may hold, including
+    // the shared system prompt.
+    explicit LlamaSessionManager(llama_model *model, int maxSessions = 4, int contextPerSession = 2048, QObject *parent = nullptr);
+
+    ~LlamaSessionManager();
+
+    bool  isValid() const;
+
+    // Decode the system messages shared by all sessions. Call before opening
+    // sessions.
+    bool  setSystemMessages(const std::vector<std::string> &messages);
+
+    // Open a conversation. maxTokens limits the length of each answer.
+    // Returns the session id or -1 when every sequence is in use.
+    int   openSession(int maxTokens = 512);
+
+    void  closeSession(int session);
+
+    int   activeSessions() const;
+
+public slots:
+    // Queue a user turn for the session. Answers stream through answerReady.
+    void  ask(int session, const QString &prompt);
+
+signals:
+    void  answerReady(int session, const QString &piece);
+
+    void  generateFinished(int session, std::string answer);
+
+    void  errorOccure(int session, QString error);
+
+private slots:
+    // Decode one batch for all sessions that have work and reschedule itself.
+    void  step();
+
+private:
+    struct Turn
+    {
+        std::string  role;
+        std::string  content;
+    };
+
+    struct Session
+    {
+        int                       seq       = 0;
+        int                       maxTokens = 0;
+        int                       nPast     = 0;
+        int                       turnStart = 0;
+        int                       prevLen   = 0;
+        int                       generated = 0;
+        int                       logitsIdx = -1;
+        bool                      generating = false;
+        std::vector<Turn>         turns;
+        std::vector<int32_t>      pending; // prompt tokens not decoded yet
+        std::vector<std::string>  queued;  // prompts waiting for the answer
+        std::string               response;
+        int32_t                   next = 0; // sampled, not decoded token
+        llama_sampler            *sampler = nullptr;
+    };
+
+    llama_sampler *createSampler() const;
+
+    // Tokenize the first queued prompt for prefilling, fails the turn if it
+    // does not fit.
+    bool           startTurn(int id, Session &session);
+
+    // Start queued prompts until one starts or none is left.
+    void           nextTurn(int id, Session &session);
+
+    void           finishTurn(int id, Session &session);
+
+    // Drop the current turn and its cells, the caller moves on with nextTurn().
+    void           failTurn(int id, Session &session, const QString &error);
+
+    // Format system and session turns into m_formatted, returns the length.
+    int            format(const Session &session, bool addAss);
+
+    void           scheduleStep();
+
+private:
+    llama_model              *m_model   = nullptr;
+    llama_context            *m_context = nullptr;
+    const struct llama_vocab *m_vocab   = nullptr;
+    llama_batch              *m_batch   = nullptr;
+    int                       m_maxSessions;
+    int                       m_contextPerSession;
+    std::vector<Turn>         m_system;
+    int                       m_prefixLen    = 0; // tokens in sequence 0
+    int                       m_prefixChars  = 0; // formatted system prompt length
+    int                       m_nextId       = 1;
+    int                       m_roundRobin   = 0;
+    bool                      m_stepQueued   = false;
+    std::map<int, Session>    m_sessions;
+    std::vector<char>         m_formatted;
+};
+
+#endif // LLAMASESSIONMANAGER_H
@@ -0,0 +1,499 @@
+// Tests and benchmarks of the model code, kept out of the application. Built
+// with -DQVOICEBRIDGE_BENCH=ON:
+//
+//   model_bench [options]
+//
+// Returns 1 if a test fails.
+
+#include <QDebug>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "chathistory.h"
+#include "common.h"
+#include "fusedsampler.h"
+
+namespace
+{
+// Append, evict and compact a ChatHistory for rounds turns, as
+// LlamaInterface::runGeneration() and evictHistory() do. After every step the
+// KV positions are checked against a mirror of m_n_past, the text against a
+// copy, and the arena against twice the live text.
+bool  testChatHistory(int rounds)
+{
+    // KV cache of LlamaInterface: context size and the room kept for a turn
+    const size_t  blockSize   = 4096;
+    const int     nCtx        = 2048;
+    const int     turnReserve = 512;
+
+    std::mt19937  rng(42);
+
+    // shorter than a quarter of a block, so a closed block is at least 3/4 full
+    auto  randomText = [&]()
+    {
+        std::string  text(1 + rng() % 1000, ' ');
+
+        for (auto &c : text)
+        {
+            c = 'a' + rng() % 26;
+        }
+
+        return text;
+    };
+
+    struct Turn
+    {
+        int                       tokens;
+        std::vector<std::string>  texts;
+    };
+
+    ChatHistory  history(blockSize);
+
+    // what the history should hold, and the KV positions in use as
+    // LlamaInterface::m_n_past counts them
+    std::vector<Turn>  expected;
+    int                nPast     = 0;
+    int                failures  = 0;
+    int                evicted   = 0;
+    size_t             arenaPeak = 0;
+
+    auto  fail = [&](int round, const char *what)
+    {
+        if (failures++ < 10)
+        {
+            qWarning() << "chat history: round" << round << what;
+        }
+    };
+
+    auto  check = [&](int round)
+    {
+        if (history.tokenCount() != nPast)
+        {
+            fail(round, "token count differs from n_past");
+        }
+
+        if (history.turnCount() != int(expected.size()))
+        {
+            fail(round, "wrong number of turns");
+        }
+
+        // dead text is compacted once it outgrows the live text, closed
+        // blocks are at least 3/4 full
+        if (history.arenaBytes() > 2 * history.liveBytes() + blockSize)
+        {
+            fail(round, "arena exceeds twice the live text");
+        }
+
+        arenaPeak = std::max(arenaPeak, history.arenaBytes());
+
+        const auto &messages = history.messages();
+        size_t      i        = 0;
+
+        for (const auto &turn : expected)
+        {
+            for (const auto &text : turn.texts)
+            {
+                if ((i >= messages.size()) || (std::strcmp(messages[i].content, text.c_str()) != 0))
+                {
+                    fail(round, "message text differs");
+
+                    return;
+                }
+
+                i++;
+            }
+        }
+
+        if (i != messages.size())
+        {
+            fail(round, "extra messages");
+        }
+    };
+
+    // pinned system prompt
+    expected.push_back({ 50 + int(rng() % 200), { randomText() } });
+    history.beginTurn(true);
+    history.add("system", expected.back().texts.back());
+    nPast = expected.back().tokens;
+    history.setSpan(0, nPast);
+    check(0);
+
+    for (int round = 1; round <= rounds; round++)
+    {
+        // LlamaInterface::evictHistory()
+        const auto  spans = history.evict(nCtx - turnReserve);
+
+        for (const auto &span : spans)
+        {
+            // the oldest turn after the system prompt, shifted down like the cells
+            if ((expected.size() < 2) || (span.begin != expected[0].tokens) ||
+                (span.end - span.begin != expected[1].tokens) || (span.end > nPast))
+            {
+                fail(round, "unexpected evicted span");
+                break;
+            }
+
+            nPast -= expected[1].tokens;
+            expected.erase(expected.begin() + 1);
+        }
+
+        evicted += spans.size();
+        check(round);
+
+        // LlamaInterface::runGeneration(), with or without retrieved context
+        const int  turnStart = nPast;
+
+        expected.push_back({ 20 + int(rng() % 400), { } });
+        history.beginTurn();
+
+        if (rng() % 2)
+        {
+            expected.back().texts.push_back(randomText());
+            history.add("system", expected.back().texts.back());
+        }
+
+        expected.back().texts.push_back(randomText());
+        history.add("user", expected.back().texts.back());
+
+        expected.back().texts.push_back(randomText());
+        history.add("assistant", expected.back().texts.back());
+
+        nPast += expected.back().tokens;
+        history.setSpan(turnStart, nPast);
+
+        if (nPast > nCtx)
+        {
+            fail(round, "context overflow");
+        }
+
+        check(round);
+    }
+
+    qDebug() << "chat history:" << failures << "failures in" << rounds << "rounds," << evicted << "turns evicted";
+    qDebug() << "chat history: arena peak" << arenaPeak << "bytes," << history.liveBytes() << "of"
+             << history.arenaBytes() << "bytes live at the end";
+
+    return failures == 0;
+}
+
+// Classic O(n*m) DP, the reference for testEditDistance()
+int  levenshteinDp(const std::u32string &s0, const std::u32string &s1)
+{
+    const size_t  len0 = s0.size() + 1;
+    const size_t  len1 = s1.size() + 1;
+
+    std::vector<int>  col(len1, 0);
+    std::vector<int>  prevCol(len1, 0);
+
+    for (size_t i = 0; i < len1; i++)
+    {
+        prevCol[i] = i;
+    }
+
+    for (size_t i = 0; i < len0; i++)
+    {
+        col[0] = i;
+
+        for (size_t j = 1; j < len1; j++)
+        {
+            col[j] = std::min(std::min(1 + col[j - 1], 1 + prevCol[j]),
+                              prevCol[j - 1] + ((i > 0) && (s0[i - 1] == s1[j - 1]) ? 0 : 1));
+        }
+
+        col.swap(prevCol);
+    }
+
+    return prevCol[len1 - 1];
+}
+
+// Compare edit_distance_pattern with the DP on random phrases, with and
+// without a maximum distance, and time both.
+bool  testEditDistance(int candidateCount, int rounds)
+{
+    // Latin and Persian letters, phrases of 3 to 100 characters
+    const std::u32string  alphabet = U"abcdefghijklmnop qrstuvwxyzابپتثجچحخدذرزژسشصضطظعغفقکگلمنوهی";
+
+    std::mt19937  rng(42);
+
+    auto  randomPhrase = [&]()
+    {
+        std::u32string  phrase(3 + rng() % 98, U' ');
+
+        for (auto &c : phrase)
+        {
+            c = alphabet[rng() % alphabet.size()];
+        }
+
+        return phrase;
+    };
+
+    std::vector<std::u32string>  candidates;
+
+    for (int i = 0; i < candidateCount; i++)
+    {
+        candidates.push_back(randomPhrase());
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    size_t   failures = 0;
+    int64_t  dpUs     = 0;
+    int64_t  bitsUs   = 0;
+    int64_t  maxUs    = 0;
+    int64_t  sink     = 0;
+
+    for (int round = 0; round < rounds; round++)
+    {
+        const std::u32string  query = randomPhrase();
+        std::vector<int>      expected(candidates.size());
+
+        const auto  t0 = Clock::now();
+
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            expected[i] = levenshteinDp(query, candidates[i]);
+        }
+
+        const auto                   t1 = Clock::now();
+        const edit_distance_pattern  pattern(query);
+
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (pattern.distance(candidates[i]) != expected[i])
+            {
+                failures++;
+            }
+        }
+
+        const auto  t2 = Clock::now();
+
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            const int  d = pattern.distance(candidates[i], 10);
+
+            if (((expected[i] <= 10) && (d != expected[i])) || ((expected[i] > 10) && (d != 11)))
+            {
+                failures++;
+            }
+
+            sink += d;
+        }
+
+        const auto  t3 = Clock::now();
+
+        dpUs   += std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+        bitsUs += std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+        maxUs  += std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count();
+    }
+
+    const double  pairs = double(rounds) * candidateCount;
+
+    qDebug() << "edit distance:" << failures << "mismatches in" << pairs << "pairs (" << sink << ")";
+    qDebug() << "edit distance: dp" << dpUs / pairs << "us/pair, bit-parallel" << bitsUs / pairs
+             << "us/pair, with max distance 10" << maxUs / pairs << "us/pair";
+
+    return failures == 0;
+}
+
+// Compare FusedSampler with the llama.cpp chain it replaces: the tokens and
+// time per token in greedy mode on random logits of nVocab tokens, and the
+// token frequencies when sampling from a small vocabulary.
+bool  testFusedSampler(int nVocab, int rounds)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::mt19937                     rng(42);
+    std::normal_distribution<float>  normal(0.0f, 3.0f);
+    std::vector<float>               logits(nVocab);
+    std::vector<llama_token_data>    candidates(nVocab);
+
+    llama_sampler *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(0.05f, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(0.8f));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(1234));
+    llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+
+    llama_sampler *fused    = FusedSampler::create(0.05f, 0.8f, 1234, true);
+    int            mismatch = 0;
+    int64_t        chainNs  = 0;
+    int64_t        fusedNs  = 0;
+
+    for (int round = 0; round < rounds; ++round)
+    {
+        for (auto &logit : logits)
+        {
+            logit = normal(rng);
+        }
+
+        // what llama_sampler_sample() does before applying the chain
+        const auto  t0 = Clock::now();
+
+        for (int i = 0; i < nVocab; ++i)
+        {
+            candidates[i] = { i, logits[i], 0.0f };
+        }
+
+        llama_token_data_array  cur_p = { candidates.data(), candidates.size(), -1, false };
+
+        llama_sampler_apply(chain, &cur_p);
+
+        const llama_token  expected = cur_p.data[cur_p.selected].id;
+        const auto         t1       = Clock::now();
+        const llama_token  token    = FusedSampler::sample(fused, logits.data(), nVocab);
+        const auto         t2       = Clock::now();
+
+        chainNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        fusedNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count();
+
+        if (token != expected)
+        {
+            mismatch++;
+        }
+    }
+
+    qDebug() << "sampler: greedy" << mismatch << "of" << rounds << "tokens differ, chain"
+             << chainNs / 1000.0 / rounds << "us/token, fused" << fusedNs / 1000.0 / rounds << "us/token";
+
+    llama_sampler_free(chain);
+    llama_sampler_free(fused);
+
+    // sampling: token frequencies on a small vocabulary with fixed logits
+    const int  nSmall = 64;
+    const int  draws  = 200000;
+
+    chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(0.05f, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(0.8f));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(1234));
+    fused = FusedSampler::create(0.05f, 0.8f, 1234, false);
+
+    std::vector<double>  chainCount(nSmall, 0.0);
+    std::vector<double>  fusedCount(nSmall, 0.0);
+
+    logits.resize(nSmall);
+    candidates.resize(nSmall);
+
+    for (auto &logit : logits)
+    {
+        logit = normal(rng) * 0.5f;
+    }
+
+    for (int d = 0; d < draws; ++d)
+    {
+        for (int i = 0; i < nSmall; ++i)
+        {
+            candidates[i] = { i, logits[i], 0.0f };
+        }
+
+        llama_token_data_array  cur_p = { candidates.data(), candidates.size(), -1, false };
+
+        llama_sampler_apply(chain, &cur_p);
+        chainCount[cur_p.data[cur_p.selected].id] += 1.0;
+        fusedCount[FusedSampler::sample(fused, logits.data(), nSmall)] += 1.0;
+    }
+
+    double  distance = 0.0;
+
+    for (int i = 0; i < nSmall; ++i)
+    {
+        distance += std::abs(chainCount[i] - fusedCount[i]) / draws;
+    }
+
+    distance /= 2;
+
+    qDebug() << "sampler: total variation distance" << distance << "over" << draws << "draws";
+
+    llama_sampler_free(chain);
+    llama_sampler_free(fused);
+
+    // two runs of the same distribution stay well below 0.02 at this many draws
+    return (mismatch == 0) && (distance < 0.02);
+}
+
+void  printUsage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "\n"
+            "options:\n"
+            "  --chat-history N        append/evict/compact soak test over N turns\n"
+            "  --edit-distance N,M     N random phrases against M queries, with the DP\n"
+            "  --sampler N,M           FusedSampler against the llama.cpp chain, M tokens\n"
+            "                          of an N token vocabulary (e.g. 128256,1000)\n",
+            program);
+}
+}
+
+int  main(int argc, char *argv[])
+{
+    int  chatHistoryRounds = 0;
+    int  editCandidates    = 0;
+    int  editRounds        = 0;
+    int  samplerVocab      = 0;
+    int  samplerRounds     = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string  arg      = argv[i];
+        const bool         hasValue = (i + 1 < argc);
+
+        if ((arg == "--chat-history") && hasValue)
+        {
+            chatHistoryRounds = std::stoi(argv[++i]);
+        }
+        else if ((arg == "--edit-distance") && hasValue && std::strchr(argv[i + 1], ','))
+        {
+            const std::string  value = argv[++i];
+
+            editCandidates = std::stoi(value);
+            editRounds     = std::stoi(value.substr(value.find(',') + 1));
+        }
+        else if ((arg == "--sampler") && hasValue && std::strchr(argv[i + 1], ','))
+        {
+            const std::string  value = argv[++i];
+
+            samplerVocab  = std::stoi(value);
+            samplerRounds = std::stoi(value.substr(value.find(',') + 1));
+        }
+        else
+        {
+            printUsage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    if (argc < 2)
+    {
+        printUsage(argv[0]);
+
+        return 1;
+    }
+
+    bool  passed = true;
+
+    if (chatHistoryRounds > 0)
+    {
+        passed = testChatHistory(chatHistoryRounds) && passed;
+    }
+
+    if ((editCandidates > 0) && (editRounds > 0))
+    {
+        passed = testEditDistance(editCandidates, editRounds) && passed;
+    }
+
+    if ((samplerVocab > 0) && (samplerRounds > 0))
+    {
+        passed = testFusedSampler(samplerVocab, samplerRounds) && passed;
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,153 @@
+#include "ngramdraft.h"
+
+#include <algorithm>
+
+NgramDraft::NgramDraft(int minNgram, int maxNgram, int maxDraft):
+    m_minNgram(std::max(1, minNgram)),
+    m_maxNgram(std::max(m_minNgram, maxNgram)),
+    m_maxDraft(maxDraft),
+    m_tables(m_maxNgram - m_minNgram + 1)
+{
+}
+
+void  NgramDraft::clear()
+{
+    m_tokens.clear();
+
+    for (auto &table : m_tables)
+    {
+        table.clear();
+    }
+}
+
+void  NgramDraft::append(int32_t token)
+{
+    m_tokens.push_back(token);
+    index(m_tokens.size() - 1);
+}
+
+void  NgramDraft::append(const std::vector<int32_t> &tokens)
+{
+    m_tokens.reserve(m_tokens.size() + tokens.size());
+
+    for (int32_t token : tokens)
+    {
+        append(token);
+    }
+}
+
+void  NgramDraft::truncate(size_t size)
+{
+    // Stale table entries are rejected by draft(), so only the tokens go.
+    if (size < m_tokens.size())
+    {
+        m_tokens.resize(size);
+    }
+}
+
+void  NgramDraft::erase(size_t begin, size_t end)
+{
+    end = std::min(end, m_tokens.size());
+
+    if (begin >= end)
+    {
+        return;
+    }
+
+    m_tokens.erase(m_tokens.begin() + begin, m_tokens.begin() + end);
+
+    for (auto &table : m_tables)
+    {
+        table.clear();
+    }
+
+    for (size_t pos = 0; pos < m_tokens.size(); ++pos)
+    {
+        index(pos);
+    }
+}
+
+int  NgramDraft::draft(std::vector<int32_t> &draft, int maxTokens) const
+{
+    draft.clear();
+
+    const size_t  count = m_tokens.size();
+    const int     limit = std::min(maxTokens, m_maxDraft);
+
+    if (limit <= 0)
+    {
+        return 0;
+    }
+
+    for (int n = m_maxNgram; n >= m_minNgram; --n)
+    {
+        if (count <= (size_t)n)
+        {
+            continue;
+        }
+
+        const size_t  tail  = count - n;
+        const auto   &table = m_tables[n - m_minNgram];
+        const auto    it    = table.find(hash(tail, n));
+
+        if (it == table.end())
+        {
+            continue;
+        }
+
+        const size_t  next = it->second;
+
+        // Entries may point past a truncation or collide, verify the match.
+        if ((next >= count) || (next < (size_t)n) ||
+            !std::equal(m_tokens.begin() + (next - n), m_tokens.begin() + next, m_tokens.begin() + tail))
+        {
+            continue;
+        }
+
+        const size_t  end = std::min(count, next + limit);
+
+        draft.assign(m_tokens.begin() + next, m_tokens.begin() + end);
+
+        return (int)draft.size();
+    }
+
+    return 0;
+}
+
+size_t  NgramDraft::size() const
+{
+    return m_tokens.size();
+}
+
+int  NgramDraft::maxDraft() const
+{
+    return m_maxDraft;
+}
+
+uint64_t  NgramDraft::hash(size_t begin, int n) const
+{
+    // FNV-1a over the token ids
+    uint64_t  h = 1469598103934665603ull;
+
+    for (int i = 0; i < n; ++i)
+    {
+        h ^= (uint32_t)m_tokens[begin + i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+void  NgramDraft::index(size_t pos)
+{
+    // Register the token at pos as the continuation of each n-gram before it
+    for (int n = m_minNgram; n <= m_maxNgram; ++n)
+    {
+        if (pos < (size_t)n)
+        {
+            break;
+        }
+
+        m_tables[n - m_minNgram][hash(pos - n, n)] = (uint32_t)pos;
+    }
+}
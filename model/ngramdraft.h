@@ -0,0 +1,58 @@
+#ifndef NGRAMDRAFT_H
+#define NGRAMDRAFT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Draft-model-free speculation (prompt lookup decoding).
+//
+// Every token that enters the context (system documents, user turns and
+// accepted answers) is appended here and indexed by the n-grams that precede
+// it. When the tail of the sequence matches an earlier n-gram, the tokens that
+// followed it are proposed as a draft that the caller verifies in one batch.
+// Token ids are the same as llama_token.
+class NgramDraft
+{
+public:
+    explicit NgramDraft(int minNgram = 2, int maxNgram = 4, int maxDraft = 8);
+
+    void    clear();
+
+    void    append(int32_t token);
+
+    void    append(const std::vector<int32_t> &tokens);
+
+    // Forget every token at or after position size, e.g. after a KV rollback.
+    void    truncate(size_t size);
+
+    // Remove the tokens in [begin, end) and index the rest again, e.g. after
+    // a turn was evicted from the KV cache.
+    void    erase(size_t begin, size_t end);
+
+    // Fill draft with at most maxTokens continuation tokens. Longer n-grams are
+    // tried first. Returns the number of drafted tokens.
+    int     draft(std::vector<int32_t> &draft, int maxTokens) const;
+
+    size_t  size() const;
+
+    int     maxDraft() const;
+
+private:
+    uint64_t  hash(size_t begin, int n) const;
+
+    void      index(size_t pos);
+
+private:
+    int                   m_minNgram;
+    int                   m_maxNgram;
+    int                   m_maxDraft;
+    std::vector<int32_t>  m_tokens;
+
+    // One table per n-gram size: n-gram hash -> position of the token that
+    // followed its most recent occurrence.
+    std::vector<std::unordered_map<uint64_t, uint32_t>>  m_tables;
+};
+
+#endif // NGRAMDRAFT_H
@@ -0,0 +1,99 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. The capacity is rounded up to a power of two. Head and tail live on
+// their own cache lines so the two threads do not share a line on every
+// element.
+template<typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity)
+    {
+        while (m_capacity < capacity)
+        {
+            m_capacity *= 2;
+        }
+
+        m_data.reset(new T[m_capacity]);
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // Producer: copy up to count elements, returns how many fit.
+    size_t  push(const T *data, size_t count)
+    {
+        const size_t  tail = m_tail.load(std::memory_order_relaxed);
+        const size_t  head = m_head.load(std::memory_order_acquire);
+        const size_t  n    = std::min(count, m_capacity - (tail - head));
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_data[(tail + i) & (m_capacity - 1)] = data[i];
+        }
+
+        m_tail.store(tail + n, std::memory_order_release);
+
+        return n;
+    }
+
+    // Consumer: move up to count elements out, returns how many there were.
+    size_t  pop(T *data, size_t count)
+    {
+        const size_t  head = m_head.load(std::memory_order_relaxed);
+        const size_t  tail = m_tail.load(std::memory_order_acquire);
+        const size_t  n    = std::min(count, tail - head);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            data[i] = m_data[(head + i) & (m_capacity - 1)];
+        }
+
+        m_head.store(head + n, std::memory_order_release);
+
+        return n;
+    }
+
+    // Elements pushed since the ring was made, a position for discardTo().
+    size_t  mark() const
+    {
+        return m_tail.load(std::memory_order_acquire);
+    }
+
+    // Consumer: drop the elements pushed before mark, later ones stay queued.
+    void  discardTo(size_t mark)
+    {
+        const size_t  head = m_head.load(std::memory_order_relaxed);
+
+        if (mark > head)
+        {
+            m_head.store(mark, std::memory_order_release);
+        }
+    }
+
+    // Exact for the calling side, a snapshot for the other one.
+    size_t  size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    size_t  capacity() const
+    {
+        return m_capacity;
+    }
+
+private:
+    size_t                            m_capacity = 1;
+    std::unique_ptr<T[]>              m_data;
+    alignas(64) std::atomic<size_t>   m_head { 0 }; // next element to pop
+    alignas(64) std::atomic<size_t>   m_tail { 0 }; // next free slot
+};
+
+#endif // SPSCRING_H
@@ -0,0 +1,52 @@
+#include "statusstore.h"
+
+StatusStore::StatusStore()
+{
+    m_clock.start();
+}
+
+void  StatusStore::loadDefaults()
+{
+    // from documentStatus1 and documentStatus2 in document.h
+    setValue("power_mw", "362.8");
+    setValue("liquid_fuel_percent", "2.31");
+    setValue("humidity_percent", "86.75");
+    setValue("ambient_temperature_c", "7.61");
+    setValue("ambient_pressure_bar", "0.89");
+}
+
+void  StatusStore::setValue(const QString &key, const QString &value)
+{
+    QWriteLocker  locker(&m_lock);
+
+    m_values.insert(key, { value, m_clock.elapsed() });
+}
+
+bool  StatusStore::value(const QString &key, QString &value, qint64 *ageMs) const
+{
+    QReadLocker  locker(&m_lock);
+    auto         it = m_values.constFind(key);
+
+    if (it == m_values.constEnd())
+    {
+        return false;
+    }
+
+    value = it->value;
+
+    if (ageMs)
+    {
+        *ageMs = m_clock.elapsed() - it->updated;
+    }
+
+    return true;
+}
+
+QString  StatusStore::value(const QString &key) const
+{
+    QString  result;
+
+    value(key, result);
+
+    return result;
+}
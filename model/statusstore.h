@@ -0,0 +1,38 @@
+#ifndef STATUSSTORE_H
+#define STATUSSTORE_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QString>
+
+// Live plant values (e.g. "power_mw" -> "362.8") read by the IntentRouter.
+// Safe to update from a feed thread while the router reads.
+class StatusStore
+{
+public:
+    StatusStore();
+
+    // The values of the status documents, until a live feed updates them.
+    void     loadDefaults();
+
+    void     setValue(const QString &key, const QString &value);
+
+    // ageMs, if given, is the time since the value was set.
+    bool     value(const QString &key, QString &value, qint64 *ageMs = nullptr) const;
+
+    QString  value(const QString &key) const;
+
+private:
+    struct Entry
+    {
+        QString  value;
+        qint64   updated;
+    };
+
+    mutable QReadWriteLock  m_lock;
+    QHash<QString, Entry>   m_values;
+    QElapsedTimer           m_clock;
+};
+
+#endif // STATUSSTORE_H
@@ -0,0 +1,145 @@
+#include "textembedder.h"
+
+#include "llama.h"
+#include <QDebug>
+#include <QFileInfo>
+
+#include <cmath>
+
+TextEmbedder::TextEmbedder()
+{
+}
+
+TextEmbedder::~TextEmbedder()
+{
+    if (m_context)
+    {
+        llama_free(m_context);
+        m_context = nullptr;
+    }
+
+    if (m_model)
+    {
+        llama_model_free(m_model);
+        m_model = nullptr;
+    }
+}
+
+bool  TextEmbedder::load(const QString &modelFile)
+{
+    llama_model_params  params = llama_model_default_params();
+
+    params.n_gpu_layers = 99;
+
+    m_model = llama_model_load_from_file(modelFile.toUtf8().constData(), params);
+
+    if (!m_model)
+    {
+        qWarning() << "Failed to load embedding model:" << modelFile;
+
+        return false;
+    }
+
+    m_vocab = llama_model_get_vocab(m_model);
+
+    // Encoder style models need the whole text in one ubatch
+    llama_context_params  ctx_params = llama_context_default_params();
+
+    ctx_params.n_ctx        = 512;
+    ctx_params.n_batch      = 512;
+    ctx_params.n_ubatch     = 512;
+    ctx_params.embeddings   = true;
+    ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+
+    m_context = llama_init_from_model(m_model, ctx_params);
+
+    if (!m_context)
+    {
+        qWarning() << "Failed to create embedding context for model:" << modelFile;
+        llama_model_free(m_model);
+        m_model = nullptr;
+
+        return false;
+    }
+
+    m_dim       = llama_model_n_embd(m_model);
+    m_modelName = QFileInfo(modelFile).fileName().toStdString();
+
+    return true;
+}
+
+bool  TextEmbedder::isLoaded() const
+{
+    return m_context != nullptr;
+}
+
+int  TextEmbedder::dimension() const
+{
+    return m_dim;
+}
+
+int  TextEmbedder::maxTokens() const
+{
+    return m_context ? (int)llama_n_batch(m_context) : 0;
+}
+
+std::string  TextEmbedder::modelName() const
+{
+    return m_modelName;
+}
+
+bool  TextEmbedder::embed(const std::string &text, std::vector<float> &embedding)
+{
+    if (!m_context)
+    {
+        return false;
+    }
+
+    const int                 n_tokens = -llama_tokenize(m_vocab, text.c_str(), text.size(), NULL, 0, true, true);
+    std::vector<llama_token>  tokens(n_tokens);
+
+    if (llama_tokenize(m_vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, true) < 0)
+    {
+        return false;
+    }
+
+    if ((int)tokens.size() > maxTokens())
+    {
+        tokens.resize(maxTokens());
+    }
+
+    // each text is embedded on its own, start from an empty cache
+    llama_kv_cache_clear(m_context);
+
+    if (llama_decode(m_context, llama_batch_get_one(tokens.data(), tokens.size())))
+    {
+        qWarning() << "Failed to embed text";
+
+        return false;
+    }
+
+    const float *pooled = llama_get_embeddings_seq(m_context, 0);
+
+    if (!pooled)
+    {
+        return false;
+    }
+
+    double  norm = 0.0;
+
+    for (int i = 0; i < m_dim; ++i)
+    {
+        norm += (double)pooled[i] * pooled[i];
+    }
+
+    const float  scale = norm > 0.0 ? (float)(1.0 / std::sqrt(norm)) : 0.0f;
+
+    embedding.resize(m_dim);
+
+    for (int i = 0; i < m_dim; ++i)
+    {
+        embedding[i] = pooled[i] * scale;
+    }
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef TEXTEMBEDDER_H
+#define TEXTEMBEDDER_H
+
+#include <QString>
+
+#include <string>
+#include <vector>
+
+struct llama_model;
+struct llama_context;
+struct llama_vocab;
+
+// Sentence embeddings from a GGUF embedding model (e.g. bge, nomic-embed)
+// through llama.cpp. Vectors are L2 normalized so a dot product is the cosine
+// similarity.
+class TextEmbedder
+{
+public:
+    TextEmbedder();
+
+    ~TextEmbedder();
+
+    TextEmbedder(const TextEmbedder &) = delete;
+    TextEmbedder &operator=(const TextEmbedder &) = delete;
+
+    // Load the model from the given file path. Returns true if loaded.
+    bool         load(const QString &modelFile);
+
+    bool         isLoaded() const;
+
+    // Size of an embedding vector, 0 before load().
+    int          dimension() const;
+
+    // Maximum number of tokens embedded per text, longer texts are truncated.
+    int          maxTokens() const;
+
+    // File name of the loaded model, used to tell stale indexes apart.
+    std::string  modelName() const;
+
+    bool         embed(const std::string &text, std::vector<float> &embedding);
+
+private:
+    llama_model              *m_model   = nullptr;
+    llama_context            *m_context = nullptr;
+    const struct llama_vocab *m_vocab   = nullptr;
+    int                       m_dim     = 0;
+    std::string               m_modelName;
+};
+
+#endif // TEXTEMBEDDER_H
@@ -0,0 +1,79 @@
+#include "tokenstream.h"
+
+TokenStream::TokenStream(size_t capacity):
+    m_ring(capacity)
+{
+}
+
+void  TokenStream::write(const char *data, size_t size)
+{
+    if (!flush())
+    {
+        m_pending.append(data, size);
+
+        return;
+    }
+
+    const size_t  written = m_ring.push(data, size);
+
+    if (written < size)
+    {
+        m_pending.append(data + written, size - written);
+    }
+}
+
+bool  TokenStream::flush()
+{
+    if (!m_pending.empty())
+    {
+        m_pending.erase(0, m_ring.push(m_pending.data(), m_pending.size()));
+    }
+
+    return m_pending.empty();
+}
+
+QString  TokenStream::read()
+{
+    const size_t  carried   = m_buffer.size();
+    const size_t  available = m_ring.size();
+
+    if (available == 0)
+    {
+        return QString();
+    }
+
+    m_buffer.resize(carried + available);
+    m_buffer.resize(carried + m_ring.pop(&m_buffer[carried], available));
+
+    const size_t  complete = completeUtf8(m_buffer.data(), m_buffer.size());
+    QString       text     = QString::fromUtf8(m_buffer.data(), complete);
+
+    m_buffer.erase(0, complete);
+
+    return text;
+}
+
+bool  TokenStream::isEmpty() const
+{
+    return m_ring.size() == 0;
+}
+
+size_t  TokenStream::completeUtf8(const char *data, size_t size)
+{
+    // look back over at most three continuation bytes for the lead byte
+    for (size_t back = 1; back <= 4 && back <= size; ++back)
+    {
+        const unsigned char  c = data[size - back];
+
+        if ((c & 0xC0) == 0x80)
+        {
+            continue;
+        }
+
+        const size_t  length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+
+        return length > back ? size - back : size;
+    }
+
+    return size;
+}
@@ -0,0 +1,44 @@
+#ifndef TOKENSTREAM_H
+#define TOKENSTREAM_H
+
+#include <QString>
+
+#include <string>
+
+#include "spscring.h"
+
+// Generated text on its way from the decode thread to the UI.
+//
+// The decode thread writes the raw bytes of every token piece, the UI reads
+// whatever has arrived at its own pace and gets it as one QString. Neither
+// side takes a lock or waits for the other. A token can end in the middle of
+// a UTF-8 sequence (common for Persian), so read() only converts complete
+// sequences and keeps the rest for the next read.
+class TokenStream
+{
+public:
+    explicit TokenStream(size_t capacity = 64 * 1024);
+
+    // Producer: never blocks. Bytes that do not fit are kept and written
+    // before the next ones.
+    void           write(const char *data, size_t size);
+
+    // Producer: retry the kept bytes, returns true when none are left.
+    bool           flush();
+
+    // Consumer: the complete text that arrived since the last read.
+    QString        read();
+
+    bool           isEmpty() const;
+
+    // Length of the longest prefix of data that does not end inside a UTF-8
+    // sequence.
+    static size_t  completeUtf8(const char *data, size_t size);
+
+private:
+    SpscRing<char>  m_ring;
+    std::string     m_pending; // producer side
+    std::string     m_buffer;  // consumer side, starts with an incomplete sequence
+};
+
+#endif // TOKENSTREAM_H
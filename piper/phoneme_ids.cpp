@@ -6,16 +6,98 @@
 
 namespace piper {
 
+PhonemeIdTable::PhonemeIdTable() : spans(256) {}
+
+PhonemeIdTable::PhonemeIdTable(const PhonemeIdMap &phonemeIdMap)
+    : spans(256) {
+  for (auto const &phonemeIds : phonemeIdMap) {
+    Span span;
+    span.offset = (uint32_t)ids.size();
+    span.count = (uint32_t)phonemeIds.second.size();
+    ids.insert(ids.end(), phonemeIds.second.begin(), phonemeIds.second.end());
+
+    Phoneme phoneme = phonemeIds.first;
+    if (phoneme >= 0x10000) {
+      // Map is ordered, so this stays sorted
+      astral.emplace_back(phoneme, span);
+      continue;
+    }
+
+    uint16_t &page = pageIndex[phoneme >> 8];
+    if (page == 0) {
+      page = (uint16_t)(spans.size() / 256);
+      spans.resize(spans.size() + 256);
+    }
+
+    spans[(std::size_t)page * 256 + (phoneme & 0xFF)] = span;
+  }
+}
+
+PIPERPHONEMIZE_EXPORT const PhonemeIdTable &default_phoneme_id_table() {
+  static const PhonemeIdTable table(DEFAULT_PHONEME_ID_MAP);
+  return table;
+}
+
+PIPERPHONEMIZE_EXPORT void
+phonemes_to_ids(const std::vector<Phoneme> &phonemes,
+                const PhonemeIdTable &table, const PhonemeIdConfig &config,
+                std::vector<PhonemeId> &phonemeIds,
+                std::map<Phoneme, std::size_t> &missingPhonemes) {
+  switch ((config.interspersePad ? 4 : 0) | (config.addBos ? 2 : 0) |
+          (config.addEos ? 1 : 0)) {
+  case 0:
+    phonemes_to_ids<false, false, false>(phonemes, table, config, phonemeIds,
+                                         missingPhonemes);
+    break;
+  case 1:
+    phonemes_to_ids<false, false, true>(phonemes, table, config, phonemeIds,
+                                        missingPhonemes);
+    break;
+  case 2:
+    phonemes_to_ids<false, true, false>(phonemes, table, config, phonemeIds,
+                                        missingPhonemes);
+    break;
+  case 3:
+    phonemes_to_ids<false, true, true>(phonemes, table, config, phonemeIds,
+                                       missingPhonemes);
+    break;
+  case 4:
+    phonemes_to_ids<true, false, false>(phonemes, table, config, phonemeIds,
+                                        missingPhonemes);
+    break;
+  case 5:
+    phonemes_to_ids<true, false, true>(phonemes, table, config, phonemeIds,
+                                       missingPhonemes);
+    break;
+  case 6:
+    phonemes_to_ids<true, true, false>(phonemes, table, config, phonemeIds,
+                                       missingPhonemes);
+    break;
+  default:
+    phonemes_to_ids<true, true, true>(phonemes, table, config, phonemeIds,
+                                      missingPhonemes);
+    break;
+  }
+}
+
 PIPERPHONEMIZE_EXPORT void
 phonemes_to_ids(const std::vector<Phoneme> &phonemes, PhonemeIdConfig &config,
                 std::vector<PhonemeId> &phonemeIds,
                 std::map<Phoneme, std::size_t> &missingPhonemes) {
+  if (config.phonemeIdTable) {
+    phonemes_to_ids(phonemes, *config.phonemeIdTable, config, phonemeIds,
+                    missingPhonemes);
+    return;
+  }
 
-  auto phonemeIdMap = std::make_shared<PhonemeIdMap>(DEFAULT_PHONEME_ID_MAP);
-  if (config.phonemeIdMap) {
-    phonemeIdMap = config.phonemeIdMap;
+  if (!config.phonemeIdMap) {
+    phonemes_to_ids(phonemes, default_phoneme_id_table(), config, phonemeIds,
+                    missingPhonemes);
+    return;
   }
 
+  const PhonemeIdMap *phonemeIdMap = config.phonemeIdMap.get();
+
   // Beginning of sentence symbol (^)
   if (config.addBos) {
     auto const bosIds = &(phonemeIdMap->at(config.bos));
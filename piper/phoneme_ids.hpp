@@ -1,7 +1,11 @@
 #ifndef PHONEME_IDS_H_
 #define PHONEME_IDS_H_
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -13,6 +17,50 @@ namespace piper {
 typedef int64_t PhonemeId;
 typedef std::map<Phoneme, std::vector<PhonemeId>> PhonemeIdMap;
 
+// PhonemeIdMap compiled once for lookups without tree walks.
+//
+// Code points of the Basic Multilingual Plane are looked up directly: the high
+// byte selects a 256 entry page (page 0 is all missing, so unused pages cost
+// nothing), the low byte the entry. Code points above it are binary searched.
+// The ids of all phonemes live in one array.
+class PIPERPHONEMIZE_EXPORT PhonemeIdTable {
+public:
+  PhonemeIdTable();
+  explicit PhonemeIdTable(const PhonemeIdMap &phonemeIdMap);
+
+  // Ids of a phoneme, count is 0 if it is missing
+  inline const PhonemeId *find(Phoneme phoneme, std::size_t &count) const {
+    const Span *span;
+    if (phoneme < 0x10000) {
+      span = &spans[(std::size_t)pageIndex[phoneme >> 8] * 256 +
+                    (phoneme & 0xFF)];
+    } else {
+      auto it = std::lower_bound(
+          astral.begin(), astral.end(), phoneme,
+          [](const std::pair<Phoneme, Span> &entry, Phoneme p) {
+            return entry.first < p;
+          });
+      span = ((it != astral.end()) && (it->first == phoneme)) ? &it->second
+                                                              : &missing;
+    }
+
+    count = span->count;
+    return ids.data() + span->offset;
+  }
+
+private:
+  struct Span {
+    uint32_t offset = 0;
+    uint32_t count = 0;
+  };
+
+  std::array<uint16_t, 256> pageIndex{};
+  std::vector<Span> spans;
+  std::vector<std::pair<Phoneme, Span>> astral; // sorted, above the BMP
+  std::vector<PhonemeId> ids;
+  Span missing;
+};
+
 struct PhonemeIdConfig {
   Phoneme pad = U'_';
   Phoneme bos = U'^';
@@ -30,6 +78,9 @@ struct PhonemeIdConfig {
   // Map from phonemes to phoneme id(s).
   // Not set means to use DEFAULT_PHONEME_ID_MAP.
   std::shared_ptr<PhonemeIdMap> phonemeIdMap;
+
+  // phonemeIdMap compiled, used instead of it when set
+  std::shared_ptr<PhonemeIdTable> phonemeIdTable;
 };
 
 static const size_t MAX_PHONEMES = 256;
@@ -229,6 +280,75 @@ phonemes_to_ids(const std::vector<Phoneme> &phonemes, PhonemeIdConfig &config,
                 std::vector<PhonemeId> &phonemeIds,
                 std::map<Phoneme, std::size_t> &missingPhonemes);
 
+// DEFAULT_PHONEME_ID_MAP compiled
+PIPERPHONEMIZE_EXPORT const PhonemeIdTable &default_phoneme_id_table();
+
+// phonemes_to_ids with the padding/bos/eos choices fixed at compile time, so
+// the loop over phonemes is a table lookup and a copy per phoneme.
+// Missing phonemes are counted and skipped.
+template <bool interspersePad, bool addBos, bool addEos>
+void phonemes_to_ids(const std::vector<Phoneme> &phonemes,
+                     const PhonemeIdTable &table, const PhonemeIdConfig &config,
+                     std::vector<PhonemeId> &phonemeIds,
+                     std::map<Phoneme, std::size_t> &missingPhonemes) {
+  std::size_t padCount = 0;
+  std::size_t count = 0;
+  const PhonemeId *padIds = table.find(config.pad, padCount);
+  const PhonemeId *mappedIds;
+
+  // Most phonemes have a single id
+  phonemeIds.reserve(phonemeIds.size() +
+                     phonemes.size() * (interspersePad ? 2 : 1) + 4);
+
+  // Beginning of sentence symbol (^)
+  if constexpr (addBos) {
+    mappedIds = table.find(config.bos, count);
+    phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + count);
+
+    if constexpr (interspersePad) {
+      // Pad after bos (_)
+      phonemeIds.insert(phonemeIds.end(), padIds, padIds + padCount);
+    }
+  }
+
+  for (auto const phoneme : phonemes) {
+    mappedIds = table.find(phoneme, count);
+    if (count == 0) {
+      // Phoneme is missing from id map
+      missingPhonemes[phoneme] += 1;
+      continue;
+    }
+
+    if (count == 1) {
+      phonemeIds.push_back(*mappedIds);
+    } else {
+      phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + count);
+    }
+
+    if constexpr (interspersePad) {
+      // pad (_)
+      if (padCount == 1) {
+        phonemeIds.push_back(*padIds);
+      } else {
+        phonemeIds.insert(phonemeIds.end(), padIds, padIds + padCount);
+      }
+    }
+  }
+
+  // End of sentence symbol ($)
+  if constexpr (addEos) {
+    mappedIds = table.find(config.eos, count);
+    phonemeIds.insert(phonemeIds.end(), mappedIds, mappedIds + count);
+  }
+}
+
+// Picks the phonemes_to_ids specialization for the config
+PIPERPHONEMIZE_EXPORT void
+phonemes_to_ids(const std::vector<Phoneme> &phonemes,
+                const PhonemeIdTable &table, const PhonemeIdConfig &config,
+                std::vector<PhonemeId> &phonemeIds,
+                std::map<Phoneme, std::size_t> &missingPhonemes);
+
 } // namespace piper
 
 #endif // PHONEME_IDS_H_
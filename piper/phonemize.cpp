@@ -15,26 +15,16 @@ std::map<std::string, PhonemeMap> DEFAULT_PHONEME_MAP = {
     {"pt-br", {{U'c', {U'k'}}}}};
 
 PIPERPHONEMIZE_EXPORT void
-phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
-                 std::vector<std::vector<Phoneme>> &phonemes) {
-
-  auto voice = config.voice;
+phonemize_eSpeak_clauses(const std::string &text, const std::string &voice,
+                         std::vector<eSpeakClause> &clauses) {
   int result = espeak_SetVoiceByName(voice.c_str());
   if (result != 0) {
     throw std::runtime_error("Failed to set eSpeak-ng voice");
   }
 
-  std::shared_ptr<PhonemeMap> phonemeMap;
-  if (config.phonemeMap) {
-    phonemeMap = config.phonemeMap;
-  } else if (DEFAULT_PHONEME_MAP.count(voice) > 0) {
-    phonemeMap = std::make_shared<PhonemeMap>(DEFAULT_PHONEME_MAP[voice]);
-  }
-
   // Modified by eSpeak
   std::string textCopy(text);
 
-  std::vector<Phoneme> *sentencePhonemes = nullptr;
   const char *inputTextPointer = textCopy.c_str();
   int terminator = 0;
 
@@ -49,16 +39,38 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
     auto phonemesNorm = una::norm::to_nfd_utf8(clausePhonemes);
     auto phonemesRange = una::ranges::utf8_view{phonemesNorm};
 
-    if (!sentencePhonemes) {
+    clauses.emplace_back();
+    clauses.back().phonemes.assign(phonemesRange.begin(), phonemesRange.end());
+    clauses.back().terminator = terminator;
+  } // while inputTextPointer != NULL
+
+} /* phonemize_eSpeak_clauses */
+
+PIPERPHONEMIZE_EXPORT void
+assemble_eSpeak_clauses(const std::vector<eSpeakClause> &clauses,
+                        eSpeakPhonemeConfig &config,
+                        std::vector<std::vector<Phoneme>> &phonemes,
+                        bool &inSentence) {
+  std::shared_ptr<PhonemeMap> phonemeMap;
+  if (config.phonemeMap) {
+    phonemeMap = config.phonemeMap;
+  } else if (DEFAULT_PHONEME_MAP.count(config.voice) > 0) {
+    phonemeMap = std::make_shared<PhonemeMap>(DEFAULT_PHONEME_MAP[config.voice]);
+  }
+
+  for (auto const &clause : clauses) {
+    if (!inSentence || phonemes.empty()) {
       // Start new sentence
       phonemes.emplace_back();
-      sentencePhonemes = &phonemes[phonemes.size() - 1];
+      inSentence = true;
     }
 
+    std::vector<Phoneme> *sentencePhonemes = &phonemes[phonemes.size() - 1];
+
     // Maybe use phoneme map
     std::vector<Phoneme> mappedSentPhonemes;
     if (phonemeMap) {
-      for (auto phoneme : phonemesRange) {
+      for (auto phoneme : clause.phonemes) {
         if (phonemeMap->count(phoneme) < 1) {
           // No mapping for phoneme
           mappedSentPhonemes.push_back(phoneme);
@@ -72,8 +84,7 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
       }
     } else {
       // No phoneme map
-      mappedSentPhonemes.insert(mappedSentPhonemes.end(), phonemesRange.begin(),
-                                phonemesRange.end());
+      mappedSentPhonemes = clause.phonemes;
     }
 
     auto phonemeIter = mappedSentPhonemes.begin();
@@ -106,6 +117,7 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
     }
 
     // Add appropriate punctuation depending on terminator type
+    int terminator = clause.terminator;
     int punctuation = terminator & 0x000FFFFF;
     if (punctuation == CLAUSE_PERIOD) {
       sentencePhonemes->push_back(config.period);
@@ -126,10 +138,20 @@ phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
 
     if ((terminator & CLAUSE_TYPE_SENTENCE) == CLAUSE_TYPE_SENTENCE) {
       // End of sentence
-      sentencePhonemes = nullptr;
+      inSentence = false;
     }
+  }
 
-  } // while inputTextPointer != NULL
+} /* assemble_eSpeak_clauses */
+
+PIPERPHONEMIZE_EXPORT void
+phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
+                 std::vector<std::vector<Phoneme>> &phonemes) {
+  std::vector<eSpeakClause> clauses;
+  phonemize_eSpeak_clauses(text, config.voice, clauses);
+
+  bool inSentence = false;
+  assemble_eSpeak_clauses(clauses, config, phonemes, inSentence);
 
 } /* phonemize_eSpeak */
 
@@ -54,6 +54,28 @@ PIPERPHONEMIZE_EXPORT void
 phonemize_eSpeak(std::string text, eSpeakPhonemeConfig &config,
                  std::vector<std::vector<Phoneme>> &phonemes);
 
+// One clause as espeak-ng returns it: NFD phonemes (before any phoneme map or
+// language flag filtering) and the clause terminator.
+struct eSpeakClause {
+  std::vector<Phoneme> phonemes;
+  int terminator = 0;
+};
+
+// The espeak-ng half of phonemize_eSpeak, the expensive part.
+// Assumes espeak_Initialize has already been called.
+PIPERPHONEMIZE_EXPORT void
+phonemize_eSpeak_clauses(const std::string &text, const std::string &voice,
+                         std::vector<eSpeakClause> &clauses);
+
+// The rest of phonemize_eSpeak: phoneme map, language flags, punctuation and
+// sentence breaks. inSentence carries an unfinished sentence from one call to
+// the next, start with false.
+PIPERPHONEMIZE_EXPORT void
+assemble_eSpeak_clauses(const std::vector<eSpeakClause> &clauses,
+                        eSpeakPhonemeConfig &config,
+                        std::vector<std::vector<Phoneme>> &phonemes,
+                        bool &inSentence);
+
 enum TextCasing {
   CASING_IGNORE = 0,
   CASING_LOWER = 1,
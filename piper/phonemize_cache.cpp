@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "phonemize_cache.hpp"
+
+namespace piper {
+
+// File layout: magic, then records of
+//   uint32 key bytes, uint32 payload bytes, key, payload
+// with the payload
+//   uint32 clauses, then per clause: int32 terminator, uint32 n, n x uint32
+static const char CACHE_MAGIC[8] = {'P', 'H', 'O', 'N', 'C', 'C', 'H', '1'};
+
+// Voice and piece do not contain it, it keeps keys unambiguous
+static const char KEY_SEPARATOR = '\n';
+
+static bool isClauseBreak(const std::string &text, std::size_t pos,
+                          std::size_t &length, bool &sentenceEnd) {
+  unsigned char c = (unsigned char)text[pos];
+  length = 1;
+  sentenceEnd = (c == '.') || (c == '!') || (c == '?');
+
+  if (sentenceEnd || (c == ',') || (c == ';') || (c == ':')) {
+    return true;
+  }
+
+  // Arabic script comma, semicolon and question mark
+  if ((c == 0xD8) && (pos + 1 < text.size())) {
+    unsigned char next = (unsigned char)text[pos + 1];
+    length = 2;
+    sentenceEnd = (next == 0x9F);
+    return (next == 0x8C) || (next == 0x9B) || (next == 0x9F);
+  }
+
+  return false;
+}
+
+// Pieces of text ending at clause (or only sentence) punctuation followed by
+// a space, and at line breaks. Whitespace is collapsed.
+static std::vector<std::string> splitText(const std::string &text,
+                                          bool atClauses) {
+  std::vector<std::string> pieces;
+  std::string piece;
+
+  auto finishPiece = [&]() {
+    while (!piece.empty() && (piece.back() == ' ')) {
+      piece.pop_back();
+    }
+
+    if (!piece.empty()) {
+      pieces.push_back(piece);
+    }
+
+    piece.clear();
+  };
+
+  for (std::size_t pos = 0; pos < text.size(); pos++) {
+    char c = text[pos];
+
+    if ((c == '\n') || (c == '\r')) {
+      finishPiece();
+      continue;
+    }
+
+    if ((c == ' ') || (c == '\t')) {
+      // Collapsed, so the key does not depend on the spacing
+      if (!piece.empty() && (piece.back() != ' ')) {
+        piece.push_back(' ');
+      }
+      continue;
+    }
+
+    std::size_t length = 1;
+    bool sentenceEnd = false;
+    bool clauseBreak = isClauseBreak(text, pos, length, sentenceEnd);
+    piece.append(text, pos, length);
+    pos += length - 1;
+
+    if (!clauseBreak || !(atClauses || sentenceEnd)) {
+      continue;
+    }
+
+    // Only before a space: keeps 501.3 and 1363/04 together
+    std::size_t next = pos + 1;
+    if ((next < text.size()) &&
+        ((text[next] == ' ') || (text[next] == '\t') || (text[next] == '\n'))) {
+      // "e.g. the" and "Dr. smith" continue the sentence
+      std::size_t word = next;
+      while ((word < text.size()) && (text[word] == ' ')) {
+        word++;
+      }
+
+      if ((c == '.') && (word < text.size()) &&
+          (((text[word] >= 'a') && (text[word] <= 'z')) ||
+           ((text[word] >= '0') && (text[word] <= '9')))) {
+        continue;
+      }
+
+      finishPiece();
+    }
+  }
+
+  finishPiece();
+  return pieces;
+}
+
+std::vector<std::string> PhonemizeCache::splitClauses(const std::string &text) {
+  return splitText(text, true);
+}
+
+std::vector<std::string>
+PhonemizeCache::splitSentences(const std::string &text) {
+  return splitText(text, false);
+}
+
+PhonemizeCache::PhonemizeCache(std::size_t maxEntries)
+    : maxEntries(std::max<std::size_t>(1, maxEntries)) {}
+
+PhonemizeCache::~PhonemizeCache() { closeFile(); }
+
+void PhonemizeCache::closeFile() {
+#ifndef _WIN32
+  if (mapped) {
+    munmap((void *)mapped, mappedSize);
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+
+  mapped = nullptr;
+  mappedSize = 0;
+  fileSize = 0;
+  fd = -1;
+  diskIndex.clear();
+  counters.diskEntries = 0;
+}
+
+bool PhonemizeCache::remap() {
+#ifdef _WIN32
+  return false;
+#else
+  struct stat fileInfo;
+  if (fstat(fd, &fileInfo) != 0) {
+    return false;
+  }
+
+  if (mapped) {
+    munmap((void *)mapped, mappedSize);
+    mapped = nullptr;
+    mappedSize = 0;
+  }
+
+  if (fileInfo.st_size <= 0) {
+    return true;
+  }
+
+  void *data = mmap(nullptr, (std::size_t)fileInfo.st_size, PROT_READ,
+                    MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  mapped = (const char *)data;
+  mappedSize = (std::size_t)fileInfo.st_size;
+  return true;
+#endif
+}
+
+bool PhonemizeCache::open(const std::string &path, bool readOnly) {
+  std::lock_guard<std::mutex> lock(mutex);
+  closeFile();
+
+#ifdef _WIN32
+  (void)path;
+  (void)readOnly;
+  return false;
+#else
+  this->readOnly = readOnly;
+  fd = ::open(path.c_str(), readOnly ? O_RDONLY : (O_RDWR | O_CREAT | O_APPEND),
+              0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  if (!remap()) {
+    closeFile();
+    return false;
+  }
+
+  if (mappedSize == 0) {
+    if (readOnly || (write(fd, CACHE_MAGIC, sizeof(CACHE_MAGIC)) !=
+                     (ssize_t)sizeof(CACHE_MAGIC))) {
+      closeFile();
+      return false;
+    }
+
+    fileSize = sizeof(CACHE_MAGIC);
+    return true;
+  }
+
+  if ((mappedSize < sizeof(CACHE_MAGIC)) ||
+      (std::memcmp(mapped, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)) {
+    closeFile();
+    return false;
+  }
+
+  // Index the complete records
+  std::size_t offset = sizeof(CACHE_MAGIC);
+  while (offset + 8 <= mappedSize) {
+    uint32_t keyBytes, payloadBytes;
+    std::memcpy(&keyBytes, mapped + offset, 4);
+    std::memcpy(&payloadBytes, mapped + offset + 4, 4);
+
+    std::size_t payloadOffset = offset + 8 + keyBytes;
+    if (payloadOffset + payloadBytes > mappedSize) {
+      break;
+    }
+
+    diskIndex[std::string(mapped + offset + 8, keyBytes)] = payloadOffset;
+    offset = payloadOffset + payloadBytes;
+  }
+
+  fileSize = offset;
+  if ((fileSize < mappedSize) && !readOnly) {
+    // Torn record, appends would be unreachable after it
+    if ((ftruncate(fd, (off_t)fileSize) != 0) || !remap()) {
+      closeFile();
+      return false;
+    }
+  }
+
+  counters.diskEntries = diskIndex.size();
+  return true;
+#endif
+}
+
+bool PhonemizeCache::readRecord(std::size_t offset, Clauses &clauses) {
+  if ((offset + 4 > mappedSize) && !remap()) {
+    return false;
+  }
+
+  auto readU32 = [&](uint32_t &value) {
+    if (offset + 4 > mappedSize) {
+      return false;
+    }
+    std::memcpy(&value, mapped + offset, 4);
+    offset += 4;
+    return true;
+  };
+
+  uint32_t clauseCount;
+  if (!readU32(clauseCount)) {
+    return false;
+  }
+
+  clauses.resize(clauseCount);
+  for (auto &clause : clauses) {
+    uint32_t terminator, phonemeCount;
+    if (!readU32(terminator) || !readU32(phonemeCount) ||
+        (offset + (std::size_t)phonemeCount * 4 > mappedSize)) {
+      return false;
+    }
+
+    clause.terminator = (int)terminator;
+    clause.phonemes.resize(phonemeCount);
+    std::memcpy(clause.phonemes.data(), mapped + offset,
+                (std::size_t)phonemeCount * 4);
+    offset += (std::size_t)phonemeCount * 4;
+  }
+
+  return true;
+}
+
+void PhonemizeCache::appendRecord(const std::string &key,
+                                  const Clauses &clauses) {
+#ifndef _WIN32
+  if ((fd < 0) || readOnly) {
+    return;
+  }
+
+  std::string payload;
+  auto appendU32 = [&payload](uint32_t value) {
+    payload.append((const char *)&value, 4);
+  };
+
+  appendU32((uint32_t)clauses.size());
+  for (auto const &clause : clauses) {
+    appendU32((uint32_t)clause.terminator);
+    appendU32((uint32_t)clause.phonemes.size());
+    payload.append((const char *)clause.phonemes.data(),
+                   clause.phonemes.size() * sizeof(Phoneme));
+  }
+
+  std::string record;
+  uint32_t keyBytes = (uint32_t)key.size();
+  uint32_t payloadBytes = (uint32_t)payload.size();
+  record.append((const char *)&keyBytes, 4);
+  record.append((const char *)&payloadBytes, 4);
+  record.append(key);
+  record.append(payload);
+
+  // One write, so readers never see half a record followed by another
+  if (write(fd, record.data(), record.size()) != (ssize_t)record.size()) {
+    return;
+  }
+
+  diskIndex[key] = fileSize + 8 + keyBytes;
+  fileSize += record.size();
+  counters.diskEntries = diskIndex.size();
+#else
+  (void)key;
+  (void)clauses;
+#endif
+}
+
+const PhonemizeCache::Clauses &
+PhonemizeCache::lookup(const std::string &voice, const std::string &piece,
+                       bool *wasMissing) {
+  std::string key = voice + KEY_SEPARATOR + piece;
+
+  auto memoryIter = memoryIndex.find(key);
+  if (memoryIter != memoryIndex.end()) {
+    counters.memoryHits++;
+    lru.splice(lru.begin(), lru, memoryIter->second);
+    return memoryIter->second->second;
+  }
+
+  Clauses clauses;
+  bool found = false;
+
+  auto diskIter = diskIndex.find(key);
+  if (diskIter != diskIndex.end()) {
+    found = readRecord(diskIter->second, clauses);
+    if (found) {
+      counters.diskHits++;
+    } else {
+      clauses.clear();
+    }
+  }
+
+  if (!found) {
+    counters.misses++;
+    phonemize_eSpeak_clauses(piece, voice, clauses);
+    appendRecord(key, clauses);
+
+    if (wasMissing) {
+      *wasMissing = true;
+    }
+  }
+
+  lru.emplace_front(key, std::move(clauses));
+  memoryIndex[key] = lru.begin();
+
+  while (lru.size() > maxEntries) {
+    memoryIndex.erase(lru.back().first);
+    lru.pop_back();
+  }
+
+  counters.memoryEntries = lru.size();
+  return lru.front().second;
+}
+
+void PhonemizeCache::phonemize(const std::string &text,
+                               eSpeakPhonemeConfig &config,
+                               std::vector<std::vector<Phoneme>> &phonemes) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  bool inSentence = false;
+  for (auto const &piece : splitClauses(text)) {
+    assemble_eSpeak_clauses(lookup(config.voice, piece, nullptr), config,
+                            phonemes, inSentence);
+  }
+}
+
+std::size_t PhonemizeCache::prewarm(const std::string &text,
+                                    const std::string &voice) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::size_t added = 0;
+  for (auto const &piece : splitClauses(text)) {
+    bool wasMissing = false;
+    lookup(voice, piece, &wasMissing);
+    if (wasMissing) {
+      added++;
+    }
+  }
+
+  return added;
+}
+
+PhonemizeCacheStats PhonemizeCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+} // namespace piper
@@ -0,0 +1,103 @@
+#ifndef PHONEMIZE_CACHE_H_
+#define PHONEMIZE_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "phonemize.hpp"
+
+namespace piper {
+
+struct PhonemizeCacheStats {
+  std::size_t memoryHits = 0;
+  std::size_t diskHits = 0;
+  std::size_t misses = 0;
+  std::size_t memoryEntries = 0;
+  std::size_t diskEntries = 0;
+
+  double hitRate() const {
+    std::size_t lookups = memoryHits + diskHits + misses;
+    return lookups > 0 ? (double)(memoryHits + diskHits) / lookups : 0.0;
+  }
+};
+
+// Caches espeak-ng output per clause, keyed by espeak voice and the clause
+// text with whitespace collapsed.
+//
+// Text is split at clause punctuation followed by a space (and at line
+// breaks); each piece is phonemized on its own, which is what espeak-ng does
+// at those boundaries anyway. Words are not cached separately: stress and
+// linking depend on the neighbouring words. Phoneme maps and language flag
+// filtering run on every call (see assemble_eSpeak_clauses), so one entry
+// serves every voice config using the same espeak voice.
+//
+// Two tiers: an in-memory LRU, and optionally an append-only file that is
+// memory-mapped and survives restarts. One process appends to the file, any
+// number may open it read-only.
+class PIPERPHONEMIZE_EXPORT PhonemizeCache {
+public:
+  explicit PhonemizeCache(std::size_t maxEntries = 4096);
+  ~PhonemizeCache();
+
+  PhonemizeCache(const PhonemizeCache &) = delete;
+  PhonemizeCache &operator=(const PhonemizeCache &) = delete;
+
+  // Use the file at path as the disk tier, created if missing. A torn record
+  // at the end (from a crash) is cut off unless readOnly.
+  bool open(const std::string &path, bool readOnly = false);
+
+  // Same result as phonemize_eSpeak, espeak-ng only runs for clauses missing
+  // from both tiers. Assumes espeak_Initialize has already been called.
+  void phonemize(const std::string &text, eSpeakPhonemeConfig &config,
+                 std::vector<std::vector<Phoneme>> &phonemes);
+
+  // Phonemize every clause of text into the cache, returns the number of
+  // clauses that were not cached yet.
+  std::size_t prewarm(const std::string &text, const std::string &voice);
+
+  PhonemizeCacheStats stats() const;
+
+  // Pieces of text phonemized and cached separately
+  static std::vector<std::string> splitClauses(const std::string &text);
+
+  // The same split at sentence ends only
+  static std::vector<std::string> splitSentences(const std::string &text);
+
+private:
+  typedef std::vector<eSpeakClause> Clauses;
+  typedef std::list<std::pair<std::string, Clauses>> LruList;
+
+  // Clauses of one piece, phonemized with espeak-ng on a miss
+  const Clauses &lookup(const std::string &voice, const std::string &piece,
+                        bool *wasMissing);
+
+  bool readRecord(std::size_t offset, Clauses &clauses);
+  void appendRecord(const std::string &key, const Clauses &clauses);
+  bool remap();
+  void closeFile();
+
+  mutable std::mutex mutex;
+
+  std::size_t maxEntries;
+  LruList lru; // most recent first
+  std::unordered_map<std::string, LruList::iterator> memoryIndex;
+
+  // key -> offset of the record payload in the file
+  std::unordered_map<std::string, std::size_t> diskIndex;
+  int fd = -1;
+  bool readOnly = true;
+  const char *mapped = nullptr;
+  std::size_t mappedSize = 0;
+  std::size_t fileSize = 0;
+
+  PhonemizeCacheStats counters;
+};
+
+} // namespace piper
+
+#endif // PHONEMIZE_CACHE_H_
@@ -1,9 +1,24 @@
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
 #include <fstream>
 #include <limits>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <espeak-ng/speak_lib.h>
 #include <onnxruntime_cxx_api.h>
@@ -11,6 +26,7 @@
 
 #include "json.hpp"
 #include "piper.hpp"
+#include "sample_convert.hpp"
 #include "utf8.h"
 #include "wavfile.hpp"
 
@@ -129,6 +145,10 @@ void parsePhonemizeConfig(json &configRoot, PhonemizeConfig &phonemizeConfig) {
     }
   }
 
+  // Compiled once here instead of looked up in the map for every phoneme
+  phonemizeConfig.phonemeIdTable =
+      std::make_shared<PhonemeIdTable>(phonemizeConfig.phonemeIdMap);
+
 } /* parsePhonemizeConfig */
 
 // Load JSON config for audio synthesis
@@ -249,6 +269,9 @@ void initialize(PiperConfig &config) {
 }
 
 void terminate(PiperConfig &config) {
+  // Its phonemizer thread uses espeak-ng
+  config.synthesisPool.reset();
+
   if (config.useESpeak) {
     // Clean up espeak-ng
     spdlog::debug("Terminating eSpeak");
@@ -259,52 +282,270 @@ void terminate(PiperConfig &config) {
   spdlog::info("Terminated piper");
 }
 
-void loadModel(std::string modelPath, ModelSession &session, bool useCuda) {
-  spdlog::debug("Loading onnx model from {}", modelPath);
-  session.env = Ort::Env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING,
-                         instanceName.c_str());
-  session.env.DisableTelemetryEvents();
+std::string modelCachePath(const PiperConfig &config,
+                           const std::string &modelPath, bool useCuda) {
+  std::string levelName;
+  switch (config.graphOptimizationLevel) {
+  case ORT_DISABLE_ALL:
+    levelName = "none";
+    break;
+  case ORT_ENABLE_BASIC:
+    levelName = "basic";
+    break;
+  case ORT_ENABLE_EXTENDED:
+    levelName = "extended";
+    break;
+  default:
+    levelName = "all";
+    break;
+  }
+
+  // Fused kernels of ORT_ENABLE_ALL depend on the execution provider and CPU
+  // features of this machine, which is fine for a local cache
+  std::stringstream cachePath;
+  cachePath << modelPath << "." << OrtGetApiBase()->GetVersionString() << "-"
+            << levelName << (useCuda ? "-cuda" : "-cpu") << ".ort";
+
+  return cachePath.str();
+}
+
+// Map a file read-only, unmapped with the last reference
+static std::shared_ptr<const char> mapFile(const std::string &path,
+                                           std::size_t &size) {
+#ifdef _WIN32
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return nullptr;
+  }
+
+  size = (std::size_t)file.tellg();
+  std::shared_ptr<char> bytes(new char[size], std::default_delete<char[]>());
+  file.seekg(0);
+  if (!file.read(bytes.get(), size)) {
+    return nullptr;
+  }
+
+  return bytes;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat fileInfo;
+  if ((fstat(fd, &fileInfo) != 0) || (fileInfo.st_size <= 0)) {
+    close(fd);
+    return nullptr;
+  }
 
+  std::size_t mappedSize = (std::size_t)fileInfo.st_size;
+  void *data = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  size = mappedSize;
+  return std::shared_ptr<const char>(
+      (const char *)data,
+      [mappedSize](const char *p) { munmap((void *)p, mappedSize); });
+#endif
+}
+
+// Cached model exists and is not older than the .onnx file
+static bool isModelCacheFresh(const std::string &cachePath,
+                              const std::string &modelPath) {
+  std::error_code error;
+  auto cacheTime = std::filesystem::last_write_time(cachePath, error);
+  if (error) {
+    return false;
+  }
+
+  auto modelTime = std::filesystem::last_write_time(modelPath, error);
+  return !error && (cacheTime >= modelTime);
+}
+
+static void setSessionOptions(Ort::SessionOptions &options,
+                              const PiperConfig &config, bool useCuda) {
   if (useCuda) {
     // Use CUDA provider
     OrtCUDAProviderOptions cuda_options{};
     cuda_options.cudnn_conv_algo_search = OrtCudnnConvAlgoSearchHeuristic;
-    session.options.AppendExecutionProvider_CUDA(cuda_options);
+    options.AppendExecutionProvider_CUDA(cuda_options);
   }
 
-  // Slows down performance by ~2x
-  // session.options.SetIntraOpNumThreads(1);
-
-  // Roughly doubles load time for no visible inference benefit
-  // session.options.SetGraphOptimizationLevel(
-  //     GraphOptimizationLevel::ORT_ENABLE_EXTENDED);
+  // Slows down performance by ~2x for a single sentence, but leaves cores to
+  // the other synthesis workers (see PiperConfig::synthesisWorkers)
+  if (config.intraOpThreads > 0) {
+    options.SetIntraOpNumThreads(config.intraOpThreads);
+  }
 
-  session.options.SetGraphOptimizationLevel(
-      GraphOptimizationLevel::ORT_DISABLE_ALL);
+  // Roughly doubles load time of the .onnx file, paid once with the cache
+  options.SetGraphOptimizationLevel(config.graphOptimizationLevel);
 
   // Slows down performance very slightly
-  // session.options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
+  // options.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
 
-  session.options.DisableCpuMemArena();
-  session.options.DisableMemPattern();
-  session.options.DisableProfiling();
+  if (!config.useCpuMemArena) {
+    options.DisableCpuMemArena();
+  }
 
-  auto startTime = std::chrono::steady_clock::now();
+  // Input shapes change with every phrase, planned patterns never match
+  options.DisableMemPattern();
+  options.DisableProfiling();
+}
 
 #ifdef _WIN32
-  auto modelPathW = std::wstring(modelPath.begin(), modelPath.end());
-  auto modelPathStr = modelPathW.c_str();
+#define ORT_PATH(path) std::wstring((path).begin(), (path).end()).c_str()
 #else
-  auto modelPathStr = modelPath.c_str();
+#define ORT_PATH(path) (path).c_str()
 #endif
 
-  session.onnx = Ort::Session(session.env, modelPathStr, session.options);
+static std::shared_ptr<Ort::Env> sharedEnv() {
+  static std::mutex envMutex;
+  static std::weak_ptr<Ort::Env> envRef;
+
+  std::lock_guard<std::mutex> lock(envMutex);
+  std::shared_ptr<Ort::Env> env = envRef.lock();
+  if (!env) {
+    env = std::make_shared<Ort::Env>(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING,
+                                     instanceName.c_str());
+    env->DisableTelemetryEvents();
+    envRef = env;
+  }
+
+  return env;
+}
+
+void loadModel(std::string modelPath, ModelSession &session, bool useCuda,
+               const PiperConfig &config) {
+  spdlog::debug("Loading onnx model from {}", modelPath);
+
+  // Bound to the session being replaced
+  session.idleContexts.clear();
+  session.env = sharedEnv();
+
+  auto startTime = std::chrono::steady_clock::now();
+
+  bool useCache = config.useModelCache &&
+                  (config.graphOptimizationLevel != ORT_DISABLE_ALL);
+  std::string cachePath = modelCachePath(config, modelPath, useCuda);
+
+  if (useCache && isModelCacheFresh(cachePath, modelPath)) {
+    session.modelBytes = mapFile(cachePath, session.modelSize);
+    if (session.modelBytes) {
+      session.options = Ort::SessionOptions();
+      setSessionOptions(session.options, config, useCuda);
+
+      // Run from the mapping instead of copying the model and its weights
+      session.options.AddConfigEntry("session.load_model_format", "ORT");
+      session.options.AddConfigEntry("session.use_ort_model_bytes_directly",
+                                     "1");
+      session.options.AddConfigEntry(
+          "session.use_ort_model_bytes_for_initializers", "1");
+
+      try {
+        session.onnx =
+            Ort::Session(*session.env, session.modelBytes.get(),
+                         session.modelSize, session.options);
+      } catch (const Ort::Exception &e) {
+        spdlog::warn("Discarding unusable model cache {}: {}", cachePath,
+                     e.what());
+        session.onnx = Ort::Session(nullptr);
+        session.modelBytes.reset();
+        session.modelSize = 0;
+
+        std::error_code error;
+        std::filesystem::remove(cachePath, error);
+      }
+    }
+  }
+
+  if (!session.onnx) {
+    session.options = Ort::SessionOptions();
+    setSessionOptions(session.options, config, useCuda);
+
+    std::string tempCachePath = cachePath + ".tmp";
+    if (useCache) {
+      // Written while the session is created
+      session.options.AddConfigEntry("session.save_model_format", "ORT");
+      session.options.SetOptimizedModelFilePath(ORT_PATH(tempCachePath));
+    }
+
+    try {
+      session.onnx =
+          Ort::Session(*session.env, ORT_PATH(modelPath), session.options);
+    } catch (const Ort::Exception &e) {
+      if (!useCache) {
+        throw;
+      }
+
+      // Some execution providers cannot be saved in ORT format
+      spdlog::warn("Not caching optimized model {}: {}", modelPath, e.what());
+      session.options = Ort::SessionOptions();
+      setSessionOptions(session.options, config, useCuda);
+      session.onnx =
+          Ort::Session(*session.env, ORT_PATH(modelPath), session.options);
+      useCache = false;
+    }
+
+    if (useCache) {
+      // Renamed so other processes never map a partly written file
+      std::error_code error;
+      std::filesystem::rename(tempCachePath, cachePath, error);
+      if (error) {
+        spdlog::warn("Failed to cache optimized model at {}: {}", cachePath,
+                     error.message());
+        std::filesystem::remove(tempCachePath, error);
+      } else {
+        spdlog::debug("Cached optimized model at {}", cachePath);
+      }
+    }
+  }
 
   auto endTime = std::chrono::steady_clock::now();
-  spdlog::debug("Loaded onnx model in {} second(s)",
+  spdlog::debug("Loaded {} model in {} second(s)",
+                session.modelBytes ? "cached" : "onnx",
                 std::chrono::duration<double>(endTime - startTime).count());
 }
 
+// FNV-1a over the voice config, the model size and the start and end of the
+// model, which hold the graph and the last weights. Reading all of it would
+// add a second to every load.
+static std::string modelFingerprint(const std::string &modelPath,
+                                    const json &configRoot) {
+  uint64_t hash = 14695981039346656037ull;
+  auto addBytes = [&hash](const char *data, std::size_t size) {
+    for (std::size_t i = 0; i < size; i++) {
+      hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+    }
+  };
+
+  std::string configText = configRoot.dump();
+  addBytes(configText.data(), configText.size());
+
+  std::ifstream modelFile(modelPath, std::ios::binary | std::ios::ate);
+  if (modelFile) {
+    std::streamoff modelSize = modelFile.tellg();
+    addBytes((const char *)&modelSize, sizeof(modelSize));
+
+    const std::streamoff sampleSize =
+        std::min<std::streamoff>(modelSize, 64 * 1024);
+    std::vector<char> sample(sampleSize);
+    for (std::streamoff offset : {(std::streamoff)0, modelSize - sampleSize}) {
+      modelFile.clear();
+      modelFile.seekg(offset);
+      modelFile.read(sample.data(), sampleSize);
+      addBytes(sample.data(), (std::size_t)modelFile.gcount());
+    }
+  }
+
+  std::stringstream fingerprint;
+  fingerprint << std::hex << hash;
+  return fingerprint.str();
+}
+
 // Load Onnx model and JSON config file
 void loadVoice(PiperConfig &config, std::string modelPath,
                std::string modelConfigPath, Voice &voice,
@@ -329,131 +570,531 @@ void loadVoice(PiperConfig &config, std::string modelPath,
 
   spdlog::debug("Voice contains {} speaker(s)", voice.modelConfig.numSpeakers);
 
-  loadModel(modelPath, voice.session, useCuda);
+  loadModel(modelPath, voice.session, useCuda, config);
+
+  voice.modelFingerprint = modelFingerprint(modelPath, voice.configRoot);
 
 } /* loadVoice */
 
-// Phoneme ids to WAV audio
+// ----------------------------------------------------------------------------
+
+// Phoneme ids are padded to a multiple of this with the pad id, input_lengths
+// masks the padding. Phrases of similar length then share an input tensor.
+static const std::size_t PHONEME_ID_BUCKET = 32;
+
+// Inputs and output of one model run at a time, made once and reused.
+//
+// The phoneme id buffer grows geometrically to the largest phrase seen. When
+// it grows, the inputs of every padded length that fits are made over it:
+// the input tensor over the first paddedLength ids, and input_lengths, scales
+// and sid over the single values below. The output is returned by
+// onnxruntime into the context's value, placed in the session's arena, which
+// grows in powers of two and keeps its memory between runs (a preallocated
+// output tensor would need the audio length before the run). Once the buffer
+// has reached the largest phrase piper allocates nothing per phrase;
+// piper_bench --allocations counts what is left, onnxruntime's own.
+struct InferenceContext {
+  InferenceContext()
+      : memoryInfo(Ort::MemoryInfo::CreateCpu(
+            OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault)) {
+    reserve(MIN_PHONEME_IDS);
+  }
+
+  // Buffer and inputs for phrases of up to paddedLength ids
+  void reserve(std::size_t paddedLength) {
+    if (paddedLength <= phonemeIds.size()) {
+      return;
+    }
+
+    // Tensors point into the buffer, so they go with it
+    inputs.clear();
+    phonemeIds.assign(std::max(paddedLength, phonemeIds.size() * 2), 0);
+
+    const std::size_t buckets = phonemeIds.size() / PHONEME_ID_BUCKET;
+    inputs.reserve(buckets);
+    for (std::size_t bucket = 1; bucket <= buckets; bucket++) {
+      const int64_t idsShape[2] = {1, (int64_t)(bucket * PHONEME_ID_BUCKET)};
+
+      // From export_onnx.py: input, input_lengths, scales, sid
+      inputs.push_back({Ort::Value::CreateTensor<int64_t>(
+                            memoryInfo, phonemeIds.data(),
+                            bucket * PHONEME_ID_BUCKET, idsShape, 2),
+                        Ort::Value::CreateTensor<int64_t>(
+                            memoryInfo, &phonemeIdLength, 1, &singleShape, 1),
+                        Ort::Value::CreateTensor<float>(
+                            memoryInfo, scales.data(), scales.size(),
+                            &scalesShape, 1),
+                        Ort::Value::CreateTensor<int64_t>(
+                            memoryInfo, &speakerId, 1, &singleShape, 1)});
+    }
+  }
+
+  // Phrases shorter than this never grow the buffer
+  static const std::size_t MIN_PHONEME_IDS = 8 * PHONEME_ID_BUCKET;
+
+  Ort::MemoryInfo memoryInfo;
+
+  std::vector<int64_t> phonemeIds;
+  std::vector<std::array<Ort::Value, 4>> inputs; // by padded length
+
+  int64_t phonemeIdLength = 0;
+  std::array<float, 3> scales{};
+  int64_t speakerId = 0;
+
+  const int64_t singleShape = 1;
+  const int64_t scalesShape = 3;
+
+  Ort::Value output{nullptr};
+};
+
+// A context of the session for the calling thread, returned to the session's
+// idle list when done. Workers synthesizing at the same time each get one.
+class InferenceLease {
+public:
+  explicit InferenceLease(ModelSession &session) : session(session) {
+    {
+      std::lock_guard<std::mutex> lock(session.contextsMutex);
+      if (!session.idleContexts.empty()) {
+        context = std::move(session.idleContexts.back());
+        session.idleContexts.pop_back();
+      }
+    }
+
+    if (!context) {
+      context = std::make_unique<InferenceContext>();
+    }
+  }
+
+  ~InferenceLease() {
+    // The output's arena memory goes back before the next run
+    context->output = Ort::Value{nullptr};
+
+    std::lock_guard<std::mutex> lock(session.contextsMutex);
+    session.idleContexts.push_back(std::move(context));
+  }
+
+  InferenceContext *operator->() { return context.get(); }
+
+private:
+  ModelSession &session;
+  std::unique_ptr<InferenceContext> context;
+};
+
+ModelSession::ModelSession() : onnx(nullptr) {}
+
+// Out of line, InferenceContext is only complete here
+ModelSession::~ModelSession() = default;
+
+// Phoneme ids -> model output, raw float audio in the context's output
+static void infer(std::vector<PhonemeId> &phonemeIds,
+                  SynthesisConfig &synthesisConfig, ModelSession &session,
+                  InferenceLease &context, SynthesisResult &result) {
+  static const char *inputNames[] = {"input", "input_lengths", "scales",
+                                     "sid"};
+  static const char *outputNames[] = {"output"};
+
+  spdlog::debug("Synthesizing audio for {} phoneme id(s)", phonemeIds.size());
+
+  std::size_t paddedLength =
+      std::max<std::size_t>(1, (phonemeIds.size() + PHONEME_ID_BUCKET - 1) /
+                                   PHONEME_ID_BUCKET) *
+      PHONEME_ID_BUCKET;
+  context->reserve(paddedLength);
+
+  std::copy(phonemeIds.begin(), phonemeIds.end(), context->phonemeIds.begin());
+  std::fill(context->phonemeIds.begin() + phonemeIds.size(),
+            context->phonemeIds.begin() + paddedLength, 0);
+  context->phonemeIdLength = (int64_t)phonemeIds.size();
+  context->scales = {synthesisConfig.noiseScale, synthesisConfig.lengthScale,
+                     synthesisConfig.noiseW};
+  context->speakerId = (int64_t)synthesisConfig.speakerId.value_or(0);
+
+  // Only multi-speaker models have the sid input
+  const std::array<Ort::Value, 4> &inputs =
+      context->inputs[paddedLength / PHONEME_ID_BUCKET - 1];
+  const std::size_t inputCount = synthesisConfig.speakerId ? 4 : 3;
+
+  // Infer, a null output value is allocated by onnxruntime
+  context->output = Ort::Value{nullptr};
+  auto startTime = std::chrono::steady_clock::now();
+  session.onnx.Run(Ort::RunOptions{nullptr}, inputNames, inputs.data(),
+                   inputCount, outputNames, &context->output, 1);
+  auto endTime = std::chrono::steady_clock::now();
+
+  if (!context->output || !context->output.IsTensor()) {
+    throw std::runtime_error("Invalid output tensors");
+  }
+  auto inferDuration = std::chrono::duration<double>(endTime - startTime);
+  result.inferSeconds = inferDuration.count();
+
+  // [1, 1, samples]
+  std::size_t audioCount =
+      context->output.GetTensorTypeAndShapeInfo().GetElementCount();
+
+  result.audioSeconds = (double)audioCount / (double)synthesisConfig.sampleRate;
+  result.realTimeFactor = 0.0;
+  if (result.audioSeconds > 0) {
+    result.realTimeFactor = result.inferSeconds / result.audioSeconds;
+  }
+  spdlog::debug("Synthesized {} second(s) of audio in {} second(s)",
+                result.audioSeconds, result.inferSeconds);
+}
+
+// Model output -> audio scaled to fill the int16 range, then silenceSamples
+// of silence. One resize for both, which reuses the buffer's capacity.
+static void appendAudio(const float *audio, std::size_t audioCount,
+                        std::size_t silenceSamples,
+                        std::vector<int16_t> &audioBuffer) {
+  float maxAudioValue = peak_abs(audio, audioCount, 0.01f);
+  float audioScale = (MAX_WAV_VALUE / std::max(0.01f, maxAudioValue));
+
+  std::size_t offset = audioBuffer.size();
+  audioBuffer.resize(offset + audioCount + silenceSamples);
+  scale_to_int16(audio, audioCount, audioScale, audioBuffer.data() + offset);
+}
+
+// Model output -> float audio at the same level as the int16 output, in
+// [-1, 1), then silenceSamples of silence
+static void appendAudio(const float *audio, std::size_t audioCount,
+                        std::size_t silenceSamples,
+                        std::vector<float> &audioBuffer) {
+  float maxAudioValue = peak_abs(audio, audioCount, 0.01f);
+  float audioScale = (MAX_WAV_VALUE / std::max(0.01f, maxAudioValue)) *
+                     (1.0f / 32768.0f);
+
+  std::size_t offset = audioBuffer.size();
+  audioBuffer.resize(offset + audioCount + silenceSamples);
+  scale_to_float(audio, audioCount, audioScale, audioBuffer.data() + offset);
+}
+
+template <typename Sample>
+static void synthesizeSamples(std::vector<PhonemeId> &phonemeIds,
+                              SynthesisConfig &synthesisConfig,
+                              ModelSession &session,
+                              std::vector<Sample> &audioBuffer,
+                              std::size_t silenceSamples,
+                              SynthesisResult &result) {
+  InferenceLease context(session);
+  infer(phonemeIds, synthesisConfig, session, context, result);
+
+  appendAudio(context->output.GetTensorData<float>(),
+              context->output.GetTensorTypeAndShapeInfo().GetElementCount(),
+              silenceSamples, audioBuffer);
+}
+
+// Phoneme ids -> audio
 void synthesize(std::vector<PhonemeId> &phonemeIds,
                 SynthesisConfig &synthesisConfig, ModelSession &session,
                 std::vector<int16_t> &audioBuffer, SynthesisResult &result) {
-  spdlog::debug("Synthesizing audio for {} phoneme id(s)", phonemeIds.size());
+  synthesizeSamples(phonemeIds, synthesisConfig, session, audioBuffer, 0,
+                    result);
+}
+
+void synthesize(std::vector<PhonemeId> &phonemeIds,
+                SynthesisConfig &synthesisConfig, ModelSession &session,
+                std::vector<float> &audioBuffer, SynthesisResult &result) {
+  synthesizeSamples(phonemeIds, synthesisConfig, session, audioBuffer, 0,
+                    result);
+}
+
+// Phoneme ids of several phrases -> their audio from one model run, padded to
+// the longest one: [batch, 1, samples] in outputTensors. False if the model
+// does not take batches (exported with a fixed batch size).
+static bool inferBatch(const std::vector<const std::vector<PhonemeId> *> &batch,
+                       SynthesisConfig &synthesisConfig, ModelSession &session,
+                       std::vector<Ort::Value> &outputTensors,
+                       std::size_t &itemSamples, double &inferSeconds) {
+  std::size_t maxLength = 0;
+  for (auto phonemeIds : batch) {
+    maxLength = std::max(maxLength, phonemeIds->size());
+  }
+
+  spdlog::debug("Synthesizing {} phrase(s) of up to {} phoneme id(s) at once",
+                batch.size(), maxLength);
 
   auto memoryInfo = Ort::MemoryInfo::CreateCpu(
       OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
 
-  // Allocate
-  std::vector<int64_t> phonemeIdLengths{(int64_t)phonemeIds.size()};
+  // Padded with 0 (the pad id); input_lengths masks it
+  std::vector<int64_t> phonemeIds(batch.size() * maxLength, 0);
+  std::vector<int64_t> phonemeIdLengths(batch.size());
+  for (std::size_t i = 0; i < batch.size(); i++) {
+    std::copy(batch[i]->begin(), batch[i]->end(),
+              phonemeIds.begin() + i * maxLength);
+    phonemeIdLengths[i] = (int64_t)batch[i]->size();
+  }
+
   std::vector<float> scales{synthesisConfig.noiseScale,
                             synthesisConfig.lengthScale,
                             synthesisConfig.noiseW};
+  std::vector<int64_t> speakerId(batch.size(),
+                                 synthesisConfig.speakerId.value_or(0));
+
+  std::vector<int64_t> phonemeIdsShape{(int64_t)batch.size(),
+                                       (int64_t)maxLength};
+  std::vector<int64_t> batchShape{(int64_t)batch.size()};
+  std::vector<int64_t> scalesShape{(int64_t)scales.size()};
 
   std::vector<Ort::Value> inputTensors;
-  std::vector<int64_t> phonemeIdsShape{1, (int64_t)phonemeIds.size()};
   inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
       memoryInfo, phonemeIds.data(), phonemeIds.size(), phonemeIdsShape.data(),
       phonemeIdsShape.size()));
-
-  std::vector<int64_t> phomemeIdLengthsShape{(int64_t)phonemeIdLengths.size()};
   inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
       memoryInfo, phonemeIdLengths.data(), phonemeIdLengths.size(),
-      phomemeIdLengthsShape.data(), phomemeIdLengthsShape.size()));
-
-  std::vector<int64_t> scalesShape{(int64_t)scales.size()};
+      batchShape.data(), batchShape.size()));
   inputTensors.push_back(
       Ort::Value::CreateTensor<float>(memoryInfo, scales.data(), scales.size(),
                                       scalesShape.data(), scalesShape.size()));
-
-  // Add speaker id.
-  // NOTE: These must be kept outside the "if" below to avoid being deallocated.
-  std::vector<int64_t> speakerId{
-      (int64_t)synthesisConfig.speakerId.value_or(0)};
-  std::vector<int64_t> speakerIdShape{(int64_t)speakerId.size()};
-
   if (synthesisConfig.speakerId) {
     inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(
-        memoryInfo, speakerId.data(), speakerId.size(), speakerIdShape.data(),
-        speakerIdShape.size()));
+        memoryInfo, speakerId.data(), speakerId.size(), batchShape.data(),
+        batchShape.size()));
   }
 
-  // From export_onnx.py
   std::array<const char *, 4> inputNames = {"input", "input_lengths", "scales",
                                             "sid"};
   std::array<const char *, 1> outputNames = {"output"};
 
-  // Infer
   auto startTime = std::chrono::steady_clock::now();
-  auto outputTensors = session.onnx.Run(
-      Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
-      inputTensors.size(), outputNames.data(), outputNames.size());
+  try {
+    outputTensors = session.onnx.Run(
+        Ort::RunOptions{nullptr}, inputNames.data(), inputTensors.data(),
+        inputTensors.size(), outputNames.data(), outputNames.size());
+  } catch (const Ort::Exception &e) {
+    spdlog::warn("Voice model does not synthesize batches, synthesizing "
+                 "phrases one at a time: {}",
+                 e.what());
+    session.batchUnsupported = true;
+    return false;
+  }
   auto endTime = std::chrono::steady_clock::now();
+  inferSeconds = std::chrono::duration<double>(endTime - startTime).count();
 
   if ((outputTensors.size() != 1) || (!outputTensors.front().IsTensor())) {
     throw std::runtime_error("Invalid output tensors");
   }
-  auto inferDuration = std::chrono::duration<double>(endTime - startTime);
-  result.inferSeconds = inferDuration.count();
 
-  const float *audio = outputTensors.front().GetTensorData<float>();
   auto audioShape =
       outputTensors.front().GetTensorTypeAndShapeInfo().GetShape();
-  int64_t audioCount = audioShape[audioShape.size() - 1];
-
-  result.audioSeconds = (double)audioCount / (double)synthesisConfig.sampleRate;
-  result.realTimeFactor = 0.0;
-  if (result.audioSeconds > 0) {
-    result.realTimeFactor = result.inferSeconds / result.audioSeconds;
+  itemSamples = (std::size_t)audioShape[audioShape.size() - 1];
+  if (outputTensors.front().GetTensorTypeAndShapeInfo().GetElementCount() !=
+      batch.size() * itemSamples) {
+    throw std::runtime_error("Unexpected batch output shape");
   }
-  spdlog::debug("Synthesized {} second(s) of audio in {} second(s)",
-                result.audioSeconds, result.inferSeconds);
 
-  // Get max audio value for scaling
-  float maxAudioValue = 0.01f;
-  for (int64_t i = 0; i < audioCount; i++) {
-    float audioValue = abs(audio[i]);
-    if (audioValue > maxAudioValue) {
-      maxAudioValue = audioValue;
+  return true;
+}
+
+// The model only outputs the padded audio, not the length of each phrase:
+// the padding decodes to near silence, cut off at vocoder frame granularity
+// below -50 dB of the phrase's peak. One frame is kept for the decay.
+static std::size_t trimmedLength(const float *audio, std::size_t count) {
+  const std::size_t frameSamples = 256;
+  const float threshold = peak_abs(audio, count, 0.0f) * 0.003f;
+
+  std::size_t end = count;
+  while (end > 0) {
+    std::size_t start = end > frameSamples ? end - frameSamples : 0;
+    if (peak_abs(audio + start, end - start, 0.0f) > threshold) {
+      break;
     }
+    end = start;
   }
 
-  // We know the size up front
-  audioBuffer.reserve(audioCount);
+  return std::min(count, end + frameSamples);
+}
 
-  // Scale audio to fill range and convert to int16
-  float audioScale = (MAX_WAV_VALUE / std::max(0.01f, maxAudioValue));
-  for (int64_t i = 0; i < audioCount; i++) {
-    int16_t intAudioValue = static_cast<int16_t>(
-        std::clamp(audio[i] * audioScale,
-                   static_cast<float>(std::numeric_limits<int16_t>::min()),
-                   static_cast<float>(std::numeric_limits<int16_t>::max())));
+// ----------------------------------------------------------------------------
 
-    audioBuffer.push_back(intAudioValue);
+// Audio of one sentence, filled in by a synthesis worker
+template <typename Sample> struct SentenceAudio {
+  std::vector<Sample> audio;
+  SynthesisResult result{};
+  std::map<Phoneme, std::size_t> missingPhonemes;
+  bool ready = false;
+};
+
+// Phoneme ids of each phrase of a sentence and the silence after it
+struct SentencePhrases {
+  std::vector<std::vector<PhonemeId>> phonemeIds;
+  std::vector<std::size_t> silenceSamples;
+};
+
+// Phonemes of one sentence -> phrases -> ids. Phrases end at phonemes the
+// voice puts silence after; empty ones are dropped.
+static void sentenceToPhrases(std::vector<Phoneme> &sentencePhonemes,
+                              Voice &voice, PhonemeIdConfig &idConfig,
+                              SentencePhrases &phrases,
+                              std::map<Phoneme, std::size_t> &missingPhonemes) {
+  if (spdlog::should_log(spdlog::level::debug)) {
+    // DEBUG log for phonemes
+    std::string phonemesStr;
+    for (auto phoneme : sentencePhonemes) {
+      utf8::append(phoneme, std::back_inserter(phonemesStr));
+    }
+
+    spdlog::debug("Converting {} phoneme(s) to ids: {}",
+                  sentencePhonemes.size(), phonemesStr);
   }
 
-  // Clean up
-  for (std::size_t i = 0; i < outputTensors.size(); i++) {
-    Ort::detail::OrtRelease(outputTensors[i].release());
+  std::vector<std::shared_ptr<std::vector<Phoneme>>> phrasePhonemes;
+  std::vector<size_t> phraseSilenceSamples;
+
+  if (voice.synthesisConfig.phonemeSilenceSeconds) {
+    // Split into phrases
+    std::map<Phoneme, float> &phonemeSilenceSeconds =
+        *voice.synthesisConfig.phonemeSilenceSeconds;
+
+    auto currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
+    phrasePhonemes.push_back(currentPhrasePhonemes);
+
+    for (auto sentencePhonemesIter = sentencePhonemes.begin();
+         sentencePhonemesIter != sentencePhonemes.end();
+         sentencePhonemesIter++) {
+      Phoneme &currentPhoneme = *sentencePhonemesIter;
+      currentPhrasePhonemes->push_back(currentPhoneme);
+
+      auto silenceIter = phonemeSilenceSeconds.find(currentPhoneme);
+      if (silenceIter != phonemeSilenceSeconds.end()) {
+        // Split at phrase boundary
+        phraseSilenceSamples.push_back(
+            (std::size_t)(silenceIter->second *
+                          voice.synthesisConfig.sampleRate *
+                          voice.synthesisConfig.channels));
+
+        currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
+        phrasePhonemes.push_back(currentPhrasePhonemes);
+      }
+    }
+  } else {
+    // Use all phonemes
+    phrasePhonemes.push_back(
+        std::make_shared<std::vector<Phoneme>>(sentencePhonemes));
   }
 
-  for (std::size_t i = 0; i < inputTensors.size(); i++) {
-    Ort::detail::OrtRelease(inputTensors[i].release());
+  // Ensure samples are the same size
+  while (phraseSilenceSamples.size() < phrasePhonemes.size()) {
+    phraseSilenceSamples.push_back(0);
+  }
+
+  // phonemes -> ids
+  for (size_t phraseIdx = 0; phraseIdx < phrasePhonemes.size(); phraseIdx++) {
+    if (phrasePhonemes[phraseIdx]->size() <= 0) {
+      continue;
+    }
+
+    phrases.phonemeIds.emplace_back();
+    std::vector<PhonemeId> &phonemeIds = phrases.phonemeIds.back();
+    phonemes_to_ids(*(phrasePhonemes[phraseIdx]), idConfig, phonemeIds,
+                    missingPhonemes);
+    phrases.silenceSamples.push_back(phraseSilenceSamples[phraseIdx]);
+
+    if (spdlog::should_log(spdlog::level::debug)) {
+      // DEBUG log for phoneme ids
+      std::stringstream phonemeIdsStr;
+      for (auto phonemeId : phonemeIds) {
+        phonemeIdsStr << phonemeId << ", ";
+      }
+
+      spdlog::debug("Converted {} phoneme(s) to {} phoneme id(s): {}",
+                    phrasePhonemes[phraseIdx]->size(), phonemeIds.size(),
+                    phonemeIdsStr.str());
+    }
   }
 }
 
-// ----------------------------------------------------------------------------
+// Phonemes of one sentence -> phrases -> ids -> audio.
+// Only reads the voice, so sentences can be synthesized concurrently:
+// onnxruntime allows Run() on one session from several threads.
+template <typename Sample>
+static void synthesizeSentence(std::vector<Phoneme> &sentencePhonemes,
+                               Voice &voice, PhonemeIdConfig &idConfig,
+                               SentenceAudio<Sample> &sentence) {
+  SentencePhrases phrases;
+  sentenceToPhrases(sentencePhonemes, voice, idConfig, phrases,
+                    sentence.missingPhonemes);
+
+  // ids -> audio
+  for (size_t phraseIdx = 0; phraseIdx < phrases.phonemeIds.size();
+       phraseIdx++) {
+    // With the end of phrase silence
+    SynthesisResult phraseResult{};
+    synthesizeSamples(phrases.phonemeIds[phraseIdx], voice.synthesisConfig,
+                      voice.session, sentence.audio,
+                      phrases.silenceSamples[phraseIdx], phraseResult);
+
+    sentence.result.audioSeconds += phraseResult.audioSeconds;
+    sentence.result.inferSeconds += phraseResult.inferSeconds;
+  }
+}
 
-// Phonemize text and synthesize audio
-void textToAudio(PiperConfig &config, Voice &voice, std::string text,
-                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                 const std::function<void()> &audioCallback) {
+// Sentences synthesized in one model run, all their phrases padded into one
+// batch. False if the model does not take batches, nothing is changed then.
+template <typename Sample>
+static bool
+synthesizeBatch(const std::vector<std::vector<Phoneme> *> &phonemes,
+                Voice &voice, PhonemeIdConfig &idConfig,
+                const std::vector<SentenceAudio<Sample> *> &sentences) {
+  std::vector<SentencePhrases> phrases(phonemes.size());
+  std::vector<std::map<Phoneme, std::size_t>> missingPhonemes(phonemes.size());
+  std::vector<const std::vector<PhonemeId> *> batch;
+
+  for (std::size_t i = 0; i < phrases.size(); i++) {
+    sentenceToPhrases(*phonemes[i], voice, idConfig, phrases[i],
+                      missingPhonemes[i]);
+    for (auto &phonemeIds : phrases[i].phonemeIds) {
+      batch.push_back(&phonemeIds);
+    }
+  }
 
-  std::size_t sentenceSilenceSamples = 0;
-  if (voice.synthesisConfig.sentenceSilenceSeconds > 0) {
-    sentenceSilenceSamples = (std::size_t)(
-        voice.synthesisConfig.sentenceSilenceSeconds *
-        voice.synthesisConfig.sampleRate * voice.synthesisConfig.channels);
+  std::vector<Ort::Value> outputTensors;
+  std::size_t itemSamples = 0;
+  double inferSeconds = 0;
+  if (!batch.empty() &&
+      !inferBatch(batch, voice.synthesisConfig, voice.session, outputTensors,
+                  itemSamples, inferSeconds)) {
+    return false;
+  }
+
+  // Phrase audio in batch order, which is sentence and phrase order
+  const float *audio =
+      batch.empty() ? nullptr : outputTensors.front().GetTensorData<float>();
+  std::vector<std::size_t> lengths(batch.size());
+  std::size_t totalSamples = 0;
+  for (std::size_t item = 0; item < batch.size(); item++) {
+    lengths[item] = trimmedLength(audio + item * itemSamples, itemSamples);
+    totalSamples += lengths[item];
+  }
+
+  std::size_t item = 0;
+  for (std::size_t i = 0; i < phrases.size(); i++) {
+    SentenceAudio<Sample> &sentence = *sentences[i];
+
+    for (std::size_t phraseIdx = 0; phraseIdx < phrases[i].phonemeIds.size();
+         phraseIdx++, item++) {
+      appendAudio(audio + item * itemSamples, lengths[item],
+                  phrases[i].silenceSamples[phraseIdx], sentence.audio);
+
+      // The run's time is shared out by audio length
+      sentence.result.audioSeconds +=
+          (double)lengths[item] / voice.synthesisConfig.sampleRate;
+      if (totalSamples > 0) {
+        sentence.result.inferSeconds +=
+            inferSeconds * lengths[item] / totalSamples;
+      }
+    }
+
+    for (auto phonemeCount : missingPhonemes[i]) {
+      sentence.missingPhonemes[phonemeCount.first] += phonemeCount.second;
+    }
   }
 
+  return true;
+}
+
+// Text -> phonemes for each sentence, appended to phonemes
+static void phonemizeText(PiperConfig &config, Voice &voice, std::string text,
+                          std::vector<std::vector<Phoneme>> &phonemes) {
   if (config.useTashkeel) {
     if (!config.tashkeelState) {
       throw std::runtime_error("Tashkeel model is not loaded");
@@ -463,140 +1104,494 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
     text = tashkeel::tashkeel_run(text, *config.tashkeelState);
   }
 
-  // Phonemes for each sentence
   spdlog::debug("Phonemizing text: {}", text);
-  std::vector<std::vector<Phoneme>> phonemes;
 
   if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes) {
     // Use espeak-ng for phonemization
     eSpeakPhonemeConfig eSpeakConfig;
     eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
-    phonemize_eSpeak(text, eSpeakConfig, phonemes);
+    if (config.phonemizeCache) {
+      config.phonemizeCache->phonemize(text, eSpeakConfig, phonemes);
+    } else {
+      phonemize_eSpeak(text, eSpeakConfig, phonemes);
+    }
   } else {
     // Use UTF-8 codepoints as "phonemes"
     CodepointsPhonemeConfig codepointsConfig;
     phonemize_codepoints(text, codepointsConfig, phonemes);
   }
+}
 
-  // Synthesize each sentence independently.
-  std::vector<PhonemeId> phonemeIds;
-  std::map<Phoneme, std::size_t> missingPhonemes;
-  for (auto phonemesIter = phonemes.begin(); phonemesIter != phonemes.end();
-       ++phonemesIter) {
-    std::vector<Phoneme> &sentencePhonemes = *phonemesIter;
+std::string audioCacheKey(const Voice &voice, const std::string &text) {
+  const SynthesisConfig &synthesisConfig = voice.synthesisConfig;
+
+  // Scales as bits, so the key does not depend on float formatting
+  auto bits = [](float value) {
+    uint32_t valueBits;
+    std::memcpy(&valueBits, &value, sizeof(valueBits));
+    return valueBits;
+  };
+
+  std::stringstream key;
+  key << voice.modelFingerprint << "|"
+      << synthesisConfig.speakerId.value_or(0) << "|"
+      << bits(synthesisConfig.noiseScale) << "|"
+      << bits(synthesisConfig.lengthScale) << "|"
+      << bits(synthesisConfig.noiseW) << "|"
+      << bits(synthesisConfig.sentenceSilenceSeconds) << "|" << text;
+
+  return key.str();
+}
 
-    if (spdlog::should_log(spdlog::level::debug)) {
-      // DEBUG log for phonemes
-      std::string phonemesStr;
-      for (auto phoneme : sentencePhonemes) {
-        utf8::append(phoneme, std::back_inserter(phonemesStr));
+// Cached audio is int16, float output converts on the way in and out
+static void appendCachedAudio(const std::vector<int16_t> &audio,
+                              std::vector<int16_t> &audioBuffer) {
+  audioBuffer.insert(audioBuffer.end(), audio.begin(), audio.end());
+}
+
+static void appendCachedAudio(const std::vector<int16_t> &audio,
+                              std::vector<float> &audioBuffer) {
+  std::size_t offset = audioBuffer.size();
+  audioBuffer.resize(offset + audio.size());
+  int16_to_float(audio.data(), audio.size(), audioBuffer.data() + offset);
+}
+
+static void storeCachedAudio(SentenceAudioCache &cache, const std::string &key,
+                             const std::vector<int16_t> &audio) {
+  cache.store(key, audio);
+}
+
+static void storeCachedAudio(SentenceAudioCache &cache, const std::string &key,
+                             const std::vector<float> &audio) {
+  std::vector<int16_t> intAudio(audio.size());
+  scale_to_int16(audio.data(), audio.size(), 32768.0f, intAudio.data());
+  cache.store(key, intAudio);
+}
+
+// ----------------------------------------------------------------------------
+
+// Threads of textToAudio, kept between calls (see PiperConfig::synthesisPool).
+// One thread phonemizes, as espeak-ng is not thread-safe; with more than one
+// synthesis worker the others run the model. Tasks run in the order queued
+// and must not throw.
+class SynthesisPool {
+public:
+  explicit SynthesisPool(int workers) : workerCount(workers) {
+    threads.emplace_back([this]() { run(phonemizeQueue); });
+    for (int i = 0; (workers > 1) && (i < workers); i++) {
+      threads.emplace_back([this]() { run(synthesisQueue); });
+    }
+  }
+
+  ~SynthesisPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    phonemizeQueue.ready.notify_all();
+    synthesisQueue.ready.notify_all();
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  int workers() const { return workerCount; }
+
+  void phonemize(std::function<void()> task) {
+    push(phonemizeQueue, std::move(task));
+  }
+
+  // Only with more than one worker
+  void synthesize(std::function<void()> task) {
+    push(synthesisQueue, std::move(task));
+  }
+
+private:
+  struct Queue {
+    std::deque<std::function<void()>> tasks;
+    std::condition_variable ready;
+  };
+
+  void push(Queue &queue, std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    queue.ready.notify_one();
+  }
+
+  void run(Queue &queue) {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.ready.wait(lock,
+                         [&]() { return stopping || !queue.tasks.empty(); });
+        if (queue.tasks.empty()) {
+          return;
+        }
+
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
       }
 
-      spdlog::debug("Converting {} phoneme(s) to ids: {}",
-                    sentencePhonemes.size(), phonemesStr);
+      task();
     }
+  }
 
-    std::vector<std::shared_ptr<std::vector<Phoneme>>> phrasePhonemes;
-    std::vector<SynthesisResult> phraseResults;
-    std::vector<size_t> phraseSilenceSamples;
+  const int workerCount;
+  std::mutex mutex;
+  Queue phonemizeQueue;
+  Queue synthesisQueue;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};
 
-    // Use phoneme/id map from config
-    PhonemeIdConfig idConfig;
-    idConfig.phonemeIdMap =
-        std::make_shared<PhonemeIdMap>(voice.phonemizeConfig.phonemeIdMap);
+template <typename Sample>
+static void textToSamples(PiperConfig &config, Voice &voice, std::string text,
+                          std::vector<Sample> &audioBuffer,
+                          SynthesisResult &result,
+                          const std::function<void()> &audioCallback,
+                          const std::atomic<bool> *cancel) {
 
-    if (voice.synthesisConfig.phonemeSilenceSeconds) {
-      // Split into phrases
-      std::map<Phoneme, float> &phonemeSilenceSeconds =
-          *voice.synthesisConfig.phonemeSilenceSeconds;
+  auto cancelled = [cancel]() { return cancel && cancel->load(); };
 
-      auto currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-      phrasePhonemes.push_back(currentPhrasePhonemes);
+  std::size_t sentenceSilenceSamples = 0;
+  if (voice.synthesisConfig.sentenceSilenceSeconds > 0) {
+    sentenceSilenceSamples = (std::size_t)(
+        voice.synthesisConfig.sentenceSilenceSeconds *
+        voice.synthesisConfig.sampleRate * voice.synthesisConfig.channels);
+  }
 
-      for (auto sentencePhonemesIter = sentencePhonemes.begin();
-           sentencePhonemesIter != sentencePhonemes.end();
-           sentencePhonemesIter++) {
-        Phoneme &currentPhoneme = *sentencePhonemesIter;
-        currentPhrasePhonemes->push_back(currentPhoneme);
+  // Pieces of text whose audio is cached as a whole: sentences with an audio
+  // cache, otherwise all of it
+  std::vector<std::string> pieces;
+  if (config.audioCache) {
+    pieces = PhonemizeCache::splitSentences(text);
+  } else {
+    pieces.push_back(text);
+  }
 
-        if (phonemeSilenceSeconds.count(currentPhoneme) > 0) {
-          // Split at phrase boundary
-          phraseSilenceSamples.push_back(
-              (std::size_t)(phonemeSilenceSeconds[currentPhoneme] *
-                            voice.synthesisConfig.sampleRate *
-                            voice.synthesisConfig.channels));
+  std::vector<std::string> pieceKeys(pieces.size());
+  std::vector<std::vector<int16_t>> cachedAudio(pieces.size());
+  std::vector<bool> pieceCached(pieces.size(), false);
+
+  for (std::size_t pieceIdx = 0; pieceIdx < pieces.size(); pieceIdx++) {
+    if (config.audioCache) {
+      // Hits skip phonemization and inference
+      pieceKeys[pieceIdx] = audioCacheKey(voice, pieces[pieceIdx]);
+      if (config.audioCache->lookup(pieceKeys[pieceIdx],
+                                    cachedAudio[pieceIdx])) {
+        spdlog::debug("Cached audio for: {}", pieces[pieceIdx]);
+        pieceCached[pieceIdx] = true;
+      }
+    }
+  }
 
-          currentPhrasePhonemes = std::make_shared<std::vector<Phoneme>>();
-          phrasePhonemes.push_back(currentPhrasePhonemes);
+  // Synthesize each sentence independently.
+  // Use phoneme/id map from config, compiled when the voice was loaded
+  if (!voice.phonemizeConfig.phonemeIdTable) {
+    voice.phonemizeConfig.phonemeIdTable =
+        std::make_shared<PhonemeIdTable>(voice.phonemizeConfig.phonemeIdMap);
+  }
+
+  PhonemeIdConfig idConfig;
+  idConfig.phonemeIdTable = voice.phonemizeConfig.phonemeIdTable;
+
+  const int workerCount = std::max(1, config.synthesisWorkers);
+  if (!config.synthesisPool ||
+      (config.synthesisPool->workers() != workerCount)) {
+    config.synthesisPool = std::make_shared<SynthesisPool>(workerCount);
+  }
+  SynthesisPool &pool = *config.synthesisPool;
+
+  const bool batching = (config.maxBatchPhonemes > 0) &&
+                        (config.maxBatchSentences > 1) &&
+                        !voice.session.batchUnsupported;
+
+  // Sentences are phonemized on the pool's phonemizer thread while the ones
+  // before them are synthesized: it appends them and plans their batches,
+  // workers (or this thread with one worker) synthesize the batches and this
+  // thread reassembles the audio in order. All of it under mutex; the deques
+  // keep references to their elements when they grow.
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::vector<Phoneme>> phonemes;
+  std::deque<SentenceAudio<Sample>> sentences;
+  std::vector<std::pair<std::size_t, std::size_t>> batches; // [first, last)
+  std::vector<std::size_t> sentenceBatch;
+  std::vector<bool> batchTaken;
+
+  // First sentence of each piece, and the end, for pieces phonemized so far
+  std::vector<std::size_t> pieceSentences(pieces.size() + 1, 0);
+  std::size_t piecesPhonemized = 0;
+
+  std::size_t pendingTasks = 0;
+  bool stopping = false;
+  std::exception_ptr error;
+
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+  };
+
+  // Synthesizes the batch unless it was taken already, the caller holds lock
+  auto synthesizeBatchAt = [&](std::size_t batchIdx,
+                               std::unique_lock<std::mutex> &lock) {
+    if (batchTaken[batchIdx]) {
+      return;
+    }
+    batchTaken[batchIdx] = true;
+
+    std::vector<std::vector<Phoneme> *> batchPhonemes;
+    std::vector<SentenceAudio<Sample> *> batchSentences;
+    for (std::size_t sentenceIdx = batches[batchIdx].first;
+         sentenceIdx < batches[batchIdx].second; sentenceIdx++) {
+      batchPhonemes.push_back(&phonemes[sentenceIdx]);
+      batchSentences.push_back(&sentences[sentenceIdx]);
+    }
+
+    if (!stopping && !cancelled()) {
+      lock.unlock();
+      try {
+        if ((batchSentences.size() < 2) || voice.session.batchUnsupported ||
+            !synthesizeBatch(batchPhonemes, voice, idConfig, batchSentences)) {
+          for (std::size_t i = 0; i < batchSentences.size(); i++) {
+            synthesizeSentence(*batchPhonemes[i], voice, idConfig,
+                               *batchSentences[i]);
+          }
         }
+      } catch (...) {
+        fail();
       }
-    } else {
-      // Use all phonemes
-      phrasePhonemes.push_back(
-          std::make_shared<std::vector<Phoneme>>(sentencePhonemes));
+      lock.lock();
     }
 
-    // Ensure results/samples are the same size
-    while (phraseResults.size() < phrasePhonemes.size()) {
-      phraseResults.emplace_back();
+    for (auto sentence : batchSentences) {
+      sentence->ready = true;
+    }
+    changed.notify_all();
+  };
+
+  // Batches are planned as the sentences come, by the same rules as before
+  // all of them were known: a batch grows while it has at most
+  // maxBatchSentences sentences and their phoneme count, padded to the
+  // longest one, stays within maxBatchPhonemes. Short sentences batch well, a
+  // long one mostly runs alone. The first sentence always runs alone so
+  // playback starts as early as without batching. A batch is queued once the
+  // next sentence does not fit or the text ends.
+  std::size_t openFirst = 0;
+  std::size_t openLast = 0;
+  std::size_t openLongest = 0;
+
+  auto queueBatch = [&]() {
+    if (openFirst == openLast) {
+      return;
     }
 
-    while (phraseSilenceSamples.size() < phrasePhonemes.size()) {
-      phraseSilenceSamples.push_back(0);
+    const std::size_t batchIdx = batches.size();
+    batches.emplace_back(openFirst, openLast);
+    batchTaken.push_back(false);
+    sentenceBatch.insert(sentenceBatch.end(), openLast - openFirst, batchIdx);
+    openFirst = openLast;
+    openLongest = 0;
+
+    if (workerCount > 1) {
+      pendingTasks++;
+      pool.synthesize([&, batchIdx]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        synthesizeBatchAt(batchIdx, lock);
+        pendingTasks--;
+        changed.notify_all();
+      });
     }
+    changed.notify_all();
+  };
 
-    // phonemes -> ids -> audio
-    for (size_t phraseIdx = 0; phraseIdx < phrasePhonemes.size(); phraseIdx++) {
-      if (phrasePhonemes[phraseIdx]->size() <= 0) {
-        continue;
+  auto planSentence = [&](std::size_t sentenceIdx) {
+    const std::size_t size = phonemes[sentenceIdx].size();
+    const std::size_t count = openLast - openFirst;
+
+    if ((count > 0) && (std::max(openLongest, size) * (count + 1) >
+                        (std::size_t)config.maxBatchPhonemes)) {
+      queueBatch();
+    }
+
+    openLast = sentenceIdx + 1;
+    openLongest = std::max(openLongest, size);
+
+    if (!batching || (sentenceIdx == 0) ||
+        ((int)(openLast - openFirst) >= config.maxBatchSentences)) {
+      queueBatch();
+    }
+  };
+
+  auto phonemizePieces = [&]() {
+    for (std::size_t pieceIdx = 0; pieceIdx < pieces.size(); pieceIdx++) {
+      std::vector<std::vector<Phoneme>> piecePhonemes;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || error || cancelled()) {
+          break;
+        }
       }
 
-      // phonemes -> ids
-      phonemes_to_ids(*(phrasePhonemes[phraseIdx]), idConfig, phonemeIds,
-                      missingPhonemes);
-      if (spdlog::should_log(spdlog::level::debug)) {
-        // DEBUG log for phoneme ids
-        std::stringstream phonemeIdsStr;
-        for (auto phonemeId : phonemeIds) {
-          phonemeIdsStr << phonemeId << ", ";
+      if (!pieceCached[pieceIdx]) {
+        try {
+          phonemizeText(config, voice, pieces[pieceIdx], piecePhonemes);
+        } catch (...) {
+          fail();
+          break;
         }
+      }
 
-        spdlog::debug("Converted {} phoneme(s) to {} phoneme id(s): {}",
-                      phrasePhonemes[phraseIdx]->size(), phonemeIds.size(),
-                      phonemeIdsStr.str());
+      std::lock_guard<std::mutex> lock(mutex);
+      pieceSentences[pieceIdx] = phonemes.size();
+      for (auto &sentencePhonemes : piecePhonemes) {
+        phonemes.push_back(std::move(sentencePhonemes));
+        sentences.emplace_back();
+        planSentence(phonemes.size() - 1);
       }
+      pieceSentences[pieceIdx + 1] = phonemes.size();
+      piecesPhonemized = pieceIdx + 1;
+      changed.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    queueBatch();
+    piecesPhonemized = pieces.size();
+    pendingTasks--;
+    changed.notify_all();
+  };
 
-      // ids -> audio
-      synthesize(phonemeIds, voice.synthesisConfig, voice.session, audioBuffer,
-                 phraseResults[phraseIdx]);
+  pendingTasks++;
+  pool.phonemize(phonemizePieces);
 
-      // Add end of phrase silence
-      for (std::size_t i = 0; i < phraseSilenceSamples[phraseIdx]; i++) {
-        audioBuffer.push_back(0);
+  // Queued tasks refer to this frame, they are waited for on every exit
+  auto stopTasks = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    changed.wait(lock, [&]() { return pendingTasks == 0; });
+  };
+
+  std::map<Phoneme, std::size_t> missingPhonemes;
+  std::vector<Sample> pieceAudio;
+  const double samplesPerSecond = (double)voice.synthesisConfig.sampleRate *
+                                  voice.synthesisConfig.channels;
+  try {
+    // Reassemble in order, until cancelled
+    bool stopped = false;
+    for (std::size_t pieceIdx = 0; (pieceIdx < pieces.size()) && !stopped;
+         pieceIdx++) {
+      if (cancelled()) {
+        break;
       }
 
-      result.audioSeconds += phraseResults[phraseIdx].audioSeconds;
-      result.inferSeconds += phraseResults[phraseIdx].inferSeconds;
+      if (pieceCached[pieceIdx]) {
+        // Stored with its sentence silence
+        std::vector<int16_t> &audio = cachedAudio[pieceIdx];
+        appendCachedAudio(audio, audioBuffer);
+        result.audioSeconds += audio.size() / samplesPerSecond;
+        std::vector<int16_t>().swap(audio);
 
-      phonemeIds.clear();
-    }
+        if (audioCallback) {
+          audioCallback();
+          audioBuffer.clear();
+        }
+        continue;
+      }
 
-    // Add end of sentence silence
-    if (sentenceSilenceSamples > 0) {
-      for (std::size_t i = 0; i < sentenceSilenceSamples; i++) {
-        audioBuffer.push_back(0);
+      std::size_t firstSentence = 0;
+      std::size_t lastSentence = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return (piecesPhonemized > pieceIdx) || error;
+        });
+        if (error) {
+          std::rethrow_exception(error);
+        }
+        firstSentence = pieceSentences[pieceIdx];
+        lastSentence = pieceSentences[pieceIdx + 1];
       }
-    }
 
-    if (audioCallback) {
-      // Call back must copy audio since it is cleared afterwards.
-      audioCallback();
-      audioBuffer.clear();
-    }
+      pieceAudio.clear();
+
+      for (std::size_t sentenceIdx = firstSentence;
+           sentenceIdx < lastSentence; sentenceIdx++) {
+        SentenceAudio<Sample> *sentence = nullptr;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          sentence = &sentences[sentenceIdx];
+
+          if (workerCount > 1) {
+            changed.wait(lock,
+                         [&]() { return sentence->ready || error; });
+          } else {
+            // Synthesized here once its batch is planned
+            changed.wait(lock, [&]() {
+              return (sentenceBatch.size() > sentenceIdx) || error;
+            });
+            if (!error) {
+              synthesizeBatchAt(sentenceBatch[sentenceIdx], lock);
+            }
+          }
+
+          if (error) {
+            std::rethrow_exception(error);
+          }
+        }
+
+        // A sentence skipped by a worker is only seen after cancel was set
+        if (cancelled()) {
+          stopped = true;
+          break;
+        }
+
+        std::size_t sentenceStart = audioBuffer.size();
+        audioBuffer.insert(audioBuffer.end(), sentence->audio.begin(),
+                           sentence->audio.end());
+        std::vector<Sample>().swap(sentence->audio);
+
+        // Add end of sentence silence
+        if (sentenceSilenceSamples > 0) {
+          audioBuffer.insert(audioBuffer.end(), sentenceSilenceSamples, 0);
+        }
 
-    phonemeIds.clear();
+        if (config.audioCache) {
+          pieceAudio.insert(pieceAudio.end(),
+                            audioBuffer.begin() + sentenceStart,
+                            audioBuffer.end());
+        }
+
+        for (auto phonemeCount : sentence->missingPhonemes) {
+          missingPhonemes[phonemeCount.first] += phonemeCount.second;
+        }
+
+        result.audioSeconds += sentence->result.audioSeconds;
+        result.inferSeconds += sentence->result.inferSeconds;
+
+        if (audioCallback) {
+          // Call back must copy audio since it is cleared afterwards.
+          audioCallback();
+          audioBuffer.clear();
+        }
+      }
+
+      if (config.audioCache && !pieceAudio.empty() && !stopped) {
+        storeCachedAudio(*config.audioCache, pieceKeys[pieceIdx], pieceAudio);
+      }
+    }
+  } catch (...) {
+    stopTasks();
+    throw;
   }
 
+  stopTasks();
+
   if (missingPhonemes.size() > 0) {
     spdlog::warn("Missing {} phoneme(s) from phoneme/id map!",
                  missingPhonemes.size());
@@ -613,6 +1608,23 @@ void textToAudio(PiperConfig &config, Voice &voice, std::string text,
     result.realTimeFactor = result.inferSeconds / result.audioSeconds;
   }
 
+} /* textToSamples */
+
+// Phonemize text and synthesize audio
+void textToAudio(PiperConfig &config, Voice &voice, std::string text,
+                 std::vector<int16_t> &audioBuffer, SynthesisResult &result,
+                 const std::function<void()> &audioCallback,
+                 const std::atomic<bool> *cancel) {
+  textToSamples(config, voice, std::move(text), audioBuffer, result,
+                audioCallback, cancel);
+} /* textToAudio */
+
+void textToAudio(PiperConfig &config, Voice &voice, std::string text,
+                 std::vector<float> &audioBuffer, SynthesisResult &result,
+                 const std::function<void()> &audioCallback,
+                 const std::atomic<bool> *cancel) {
+  textToSamples(config, voice, std::move(text), audioBuffer, result,
+                audioCallback, cancel);
 } /* textToAudio */
 
 // Phonemize text and synthesize audio to WAV file
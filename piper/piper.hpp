@@ -1,9 +1,12 @@
 #ifndef PIPER_H_
 #define PIPER_H_
 
+#include <atomic>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
@@ -11,6 +14,7 @@
 #include <onnxruntime_cxx_api.h>
 #include "phoneme_ids.hpp"
 #include "phonemize.hpp"
+#include "phonemize_cache.hpp"
 #include "tashkeel.hpp"
 
 #include "json.hpp"
@@ -25,6 +29,21 @@ struct eSpeakConfig {
   std::string voice = "en-us";
 };
 
+// Synthesized audio of whole sentences, including the sentence silence,
+// under keys from audioCacheKey. Implemented by the application, which
+// decides how and where it is stored. Called on the thread running
+// textToAudio; a hit skips phonemization and inference for the sentence.
+class SentenceAudioCache {
+public:
+  virtual ~SentenceAudioCache() = default;
+
+  virtual bool lookup(const std::string &key, std::vector<int16_t> &audio) = 0;
+  virtual void store(const std::string &key,
+                     const std::vector<int16_t> &audio) = 0;
+};
+
+class SynthesisPool;
+
 struct PiperConfig {
   std::string eSpeakDataPath;
   bool useESpeak = true;
@@ -32,6 +51,44 @@ struct PiperConfig {
   bool useTashkeel = false;
   std::optional<std::string> tashkeelModelPath;
   std::unique_ptr<tashkeel::State> tashkeelState;
+
+  // Sentences synthesized at the same time by textToAudio.
+  // 1 synthesizes them one after the other on the calling thread. Either way
+  // the next sentences are phonemized meanwhile, see synthesisPool.
+  int synthesisWorkers = 1;
+
+  // onnxruntime intra-op threads of each voice session, 0 for the
+  // onnxruntime default (all cores). Applied when a voice is loaded.
+  // Workers share the session, so keep workers * threads near the core count.
+  int intraOpThreads = 0;
+
+  // Sentences of an answer run through the model together, padded to the
+  // longest, while a batch has at most maxBatchSentences sentences and
+  // maxBatchPhonemes phonemes including the padding (see textToAudio).
+  // 0 runs every sentence on its own.
+  int maxBatchPhonemes = 0;
+  int maxBatchSentences = 8;
+
+  // Graph optimization of voice models. Anything above ORT_DISABLE_ALL makes
+  // loading the .onnx file slow, so with useModelCache the optimized model is
+  // saved in ORT format next to the voice on first load and memory-mapped on
+  // later loads (see modelCachePath).
+  GraphOptimizationLevel graphOptimizationLevel = ORT_ENABLE_ALL;
+  bool useModelCache = true;
+
+  // Reuse onnxruntime's CPU buffers between runs instead of allocating them
+  // for every phrase
+  bool useCpuMemArena = true;
+
+  // espeak-ng output of earlier clauses, shared by all voices
+  std::shared_ptr<PhonemizeCache> phonemizeCache;
+
+  // Audio of earlier sentences, see SentenceAudioCache
+  std::shared_ptr<SentenceAudioCache> audioCache;
+
+  // Phonemizer thread and synthesis workers of textToAudio, made on its first
+  // call and again when synthesisWorkers changes, released by terminate
+  std::shared_ptr<SynthesisPool> synthesisPool;
 };
 
 enum PhonemeType { eSpeakPhonemes, TextPhonemes };
@@ -41,6 +98,9 @@ struct PhonemizeConfig {
   std::optional<std::map<Phoneme, std::vector<Phoneme>>> phonemeMap;
   std::map<Phoneme, std::vector<PhonemeId>> phonemeIdMap;
 
+  // phonemeIdMap compiled when the voice is loaded
+  std::shared_ptr<PhonemeIdTable> phonemeIdTable;
+
   PhonemeId idPad = 0; // padding (optionally interspersed)
   PhonemeId idBos = 1; // beginning of sentence
   PhonemeId idEos = 2; // end of sentence
@@ -75,13 +135,30 @@ struct ModelConfig {
   std::optional<std::map<std::string, SpeakerId>> speakerIdMap;
 };
 
+struct InferenceContext;
+
 struct ModelSession {
+  // One environment (and its thread pools) shared by all loaded voices,
+  // released with the last of them
+  std::shared_ptr<Ort::Env> env;
+
+  // Memory-mapped ORT format model, used directly by onnx so it must outlive it
+  std::shared_ptr<const char> modelBytes;
+  std::size_t modelSize = 0;
+
   Ort::Session onnx;
   Ort::AllocatorWithDefaultOptions allocator;
   Ort::SessionOptions options;
-  Ort::Env env;
 
-  ModelSession() : onnx(nullptr){};
+  // Set when the model was exported with a fixed batch size of 1
+  std::atomic<bool> batchUnsupported{false};
+
+  // Inputs and output reused by synthesize, one per concurrent run
+  std::mutex contextsMutex;
+  std::vector<std::unique_ptr<InferenceContext>> idleContexts;
+
+  ModelSession();
+  ~ModelSession();
 };
 
 struct SynthesisResult {
@@ -91,6 +168,9 @@ struct SynthesisResult {
 };
 
 struct Voice {
+  // Identifies the model and its config in audio cache keys
+  std::string modelFingerprint;
+
   json configRoot;
   PhonemizeConfig phonemizeConfig;
   SynthesisConfig synthesisConfig;
@@ -113,15 +193,43 @@ void initialize(PiperConfig &config);
 // Clean up
 void terminate(PiperConfig &config);
 
+// Optimized model cached for an .onnx file, keyed by onnxruntime version and
+// the session options that shape the optimized graph
+std::string modelCachePath(const PiperConfig &config,
+                           const std::string &modelPath, bool useCuda);
+
 // Load Onnx model and JSON config file
 void loadVoice(PiperConfig &config, std::string modelPath,
                std::string modelConfigPath, Voice &voice,
                std::optional<SpeakerId> &speakerId, bool useCuda);
 
-// Phonemize text and synthesize audio
+// Phoneme ids of one phrase -> audio appended to audioBuffer, one model run
+void synthesize(std::vector<PhonemeId> &phonemeIds,
+                SynthesisConfig &synthesisConfig, ModelSession &session,
+                std::vector<int16_t> &audioBuffer, SynthesisResult &result);
+
+void synthesize(std::vector<PhonemeId> &phonemeIds,
+                SynthesisConfig &synthesisConfig, ModelSession &session,
+                std::vector<float> &audioBuffer, SynthesisResult &result);
+
+// Phonemize text and synthesize audio. Once *cancel is set no more sentences
+// are phonemized, synthesized, passed to audioCallback or cached, and it
+// returns after the ones in progress.
 void textToAudio(PiperConfig &config, Voice &voice, std::string text,
                  std::vector<int16_t> &audioBuffer, SynthesisResult &result,
-                 const std::function<void()> &audioCallback);
+                 const std::function<void()> &audioCallback,
+                 const std::atomic<bool> *cancel = nullptr);
+
+// The same as float samples in [-1, 1), for sinks that take float and would
+// otherwise convert the int16 samples back
+void textToAudio(PiperConfig &config, Voice &voice, std::string text,
+                 std::vector<float> &audioBuffer, SynthesisResult &result,
+                 const std::function<void()> &audioCallback,
+                 const std::atomic<bool> *cancel = nullptr);
+
+// Key of a sentence's audio: voice, speaker, synthesis settings and the
+// sentence with whitespace collapsed
+std::string audioCacheKey(const Voice &voice, const std::string &text);
 
 // Phonemize text and synthesize audio to WAV file
 void textToWavFile(PiperConfig &config, Voice &voice, std::string text,
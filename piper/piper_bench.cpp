@@ -0,0 +1,483 @@
+// Synthesis benchmarks of piper, kept out of the application. Built with
+// -DQVOICEBRIDGE_BENCH=ON:
+//
+//   piper_bench <voice.onnx> [options] [text]
+//
+// The voice config is <voice.onnx>.json. Results are logged at info level.
+// operator new is replaced here to count allocations, see
+// test_inference_allocations.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "piper.hpp"
+
+using namespace piper;
+
+namespace {
+
+// Allocations of the whole process, onnxruntime's threads included, counted
+// while countAllocations is set
+std::atomic<bool> countAllocations{false};
+std::atomic<std::size_t> allocations{0};
+
+} // namespace
+
+// Replaced for test_inference_allocations, only in this executable
+void *operator new(std::size_t size) {
+  if (countAllocations.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (void *memory = std::malloc(size > 0 ? size : 1)) {
+    return memory;
+  }
+
+  throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+
+void operator delete(void *memory, std::size_t) noexcept {
+  std::free(memory);
+}
+
+namespace {
+
+const char *DEFAULT_TEXT =
+    "The quick brown fox jumps over the lazy dog. Speech synthesis turns "
+    "written text into sound, one sentence at a time. Longer answers have "
+    "several sentences, short and long ones, so the batches and the workers "
+    "have something to share.";
+
+// Phonemes of each sentence of the text, without the voice's phoneme map
+void phonemize(Voice &voice, const std::string &text,
+               std::vector<std::vector<Phoneme>> &phonemes) {
+  if (voice.phonemizeConfig.phonemeType == eSpeakPhonemes) {
+    eSpeakPhonemeConfig eSpeakConfig;
+    eSpeakConfig.voice = voice.phonemizeConfig.eSpeak.voice;
+    phonemize_eSpeak(text, eSpeakConfig, phonemes);
+  } else {
+    CodepointsPhonemeConfig codepointsConfig;
+    phonemize_codepoints(text, codepointsConfig, phonemes);
+  }
+}
+
+// Wall time of textToAudio for the text with 1 to maxWorkers synthesis
+// workers
+void benchmarkTextToAudio(PiperConfig &config, Voice &voice,
+                          const std::string &text, int maxWorkers) {
+  const int savedWorkers = config.synthesisWorkers;
+
+  // Warm up so the first run does not pay for lazy initialization
+  std::vector<int16_t> audioBuffer;
+  SynthesisResult result{};
+  textToAudio(config, voice, text, audioBuffer, result, NULL);
+
+  double sequentialSeconds = 0;
+  for (int workers = 1; workers <= maxWorkers; workers++) {
+    config.synthesisWorkers = workers;
+    audioBuffer.clear();
+    result = SynthesisResult{};
+
+    auto startTime = std::chrono::steady_clock::now();
+    textToAudio(config, voice, text, audioBuffer, result, NULL);
+    auto endTime = std::chrono::steady_clock::now();
+
+    double wallSeconds =
+        std::chrono::duration<double>(endTime - startTime).count();
+    if (workers == 1) {
+      sequentialSeconds = wallSeconds;
+    }
+
+    spdlog::info("{} worker(s) x {} intra-op thread(s): {} second(s) of audio "
+                 "in {} second(s) wall, real-time factor {}, speedup {}",
+                 workers, config.intraOpThreads, result.audioSeconds,
+                 wallSeconds,
+                 result.audioSeconds > 0 ? wallSeconds / result.audioSeconds
+                                         : 0.0,
+                 wallSeconds > 0 ? sequentialSeconds / wallSeconds : 0.0);
+  }
+
+  config.synthesisWorkers = savedWorkers;
+} /* benchmarkTextToAudio */
+
+// Load time (uncached, first cached and cached) and real-time factor of the
+// voice for each graph optimization level with and without the CPU arena
+void benchmarkModelLoad(PiperConfig &config, const std::string &modelPath,
+                        const std::string &modelConfigPath,
+                        const std::string &text) {
+  const GraphOptimizationLevel savedLevel = config.graphOptimizationLevel;
+  const bool savedCache = config.useModelCache;
+  const bool savedArena = config.useCpuMemArena;
+
+  const GraphOptimizationLevel levels[] = {ORT_DISABLE_ALL, ORT_ENABLE_BASIC,
+                                           ORT_ENABLE_EXTENDED,
+                                           ORT_ENABLE_ALL};
+  std::optional<SpeakerId> speakerId;
+
+  for (bool arena : {false, true}) {
+    for (GraphOptimizationLevel level : levels) {
+      config.graphOptimizationLevel = level;
+      config.useCpuMemArena = arena;
+
+      // Uncached, then the load that writes the cache, then a cached load
+      double loadSeconds[3] = {0, 0, 0};
+      std::unique_ptr<Voice> voice;
+      for (int run = 0; run < 3; run++) {
+        config.useModelCache = (run > 0);
+        if (run == 1) {
+          std::error_code error;
+          std::filesystem::remove(modelCachePath(config, modelPath, false),
+                                  error);
+        }
+
+        voice.reset();
+        voice = std::make_unique<Voice>();
+
+        auto startTime = std::chrono::steady_clock::now();
+        loadVoice(config, modelPath, modelConfigPath, *voice, speakerId,
+                  false);
+        auto endTime = std::chrono::steady_clock::now();
+        loadSeconds[run] =
+            std::chrono::duration<double>(endTime - startTime).count();
+      }
+
+      // First run warms up the arena
+      std::vector<int16_t> audioBuffer;
+      SynthesisResult result{};
+      textToAudio(config, *voice, text, audioBuffer, result, NULL);
+
+      audioBuffer.clear();
+      result = SynthesisResult{};
+      textToAudio(config, *voice, text, audioBuffer, result, NULL);
+
+      spdlog::info("Optimization level {}, arena {}: load {} / {} / {} "
+                   "second(s) (onnx / caching / cached), real-time factor {}",
+                   (int)level, arena ? "on" : "off", loadSeconds[0],
+                   loadSeconds[1], loadSeconds[2], result.realTimeFactor);
+    }
+  }
+
+  config.graphOptimizationLevel = savedLevel;
+  config.useModelCache = savedCache;
+  config.useCpuMemArena = savedArena;
+} /* benchmarkModelLoad */
+
+// Time per phoneme of phonemes_to_ids for the phonemized text, with the
+// voice's std::map (copied per call as before, and shared) and with its
+// compiled PhonemeIdTable
+void benchmarkPhonemeIds(Voice &voice, const std::string &text, int rounds) {
+  std::vector<std::vector<Phoneme>> phonemes;
+  phonemize(voice, text, phonemes);
+
+  std::size_t phonemeCount = 0;
+  for (auto &sentencePhonemes : phonemes) {
+    phonemeCount += sentencePhonemes.size();
+  }
+
+  if ((phonemeCount == 0) || (rounds <= 0)) {
+    return;
+  }
+
+  const PhonemeIdTable table(voice.phonemizeConfig.phonemeIdMap);
+  std::vector<PhonemeId> phonemeIds;
+  std::map<Phoneme, std::size_t> missingPhonemes;
+  std::size_t checksum = 0;
+
+  // 0: map copied per sentence (the old textToAudio), 1: shared map,
+  // 2: compiled table
+  const char *names[] = {"copied map", "shared map", "table"};
+  for (int variant = 0; variant < 3; variant++) {
+    PhonemeIdConfig idConfig;
+    idConfig.phonemeIdMap =
+        std::make_shared<PhonemeIdMap>(voice.phonemizeConfig.phonemeIdMap);
+
+    auto startTime = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+      for (auto &sentencePhonemes : phonemes) {
+        if (variant == 0) {
+          idConfig.phonemeIdMap = std::make_shared<PhonemeIdMap>(
+              voice.phonemizeConfig.phonemeIdMap);
+        }
+
+        if (variant == 2) {
+          phonemes_to_ids(sentencePhonemes, table, idConfig, phonemeIds,
+                          missingPhonemes);
+        } else {
+          phonemes_to_ids(sentencePhonemes, idConfig, phonemeIds,
+                          missingPhonemes);
+        }
+
+        checksum += phonemeIds.size();
+        phonemeIds.clear();
+      }
+    }
+    auto endTime = std::chrono::steady_clock::now();
+
+    double nanoseconds =
+        std::chrono::duration<double, std::nano>(endTime - startTime).count();
+    spdlog::info("phonemes_to_ids with {}: {} ns per phoneme", names[variant],
+                 nanoseconds / ((double)rounds * phonemeCount));
+  }
+
+  spdlog::debug("Phoneme id checksum {}", checksum);
+} /* benchmarkPhonemeIds */
+
+// Real-time factor of textToAudio for the text with one model run per
+// sentence and with batches of up to each of batchPhonemes
+void benchmarkBatching(PiperConfig &config, Voice &voice,
+                       const std::string &text,
+                       const std::vector<int> &batchPhonemes) {
+  const int savedBatchPhonemes = config.maxBatchPhonemes;
+
+  // Warm up so the first run does not pay for lazy initialization
+  std::vector<int16_t> audioBuffer;
+  SynthesisResult result{};
+  config.maxBatchPhonemes = 0;
+  textToAudio(config, voice, text, audioBuffer, result, NULL);
+
+  std::vector<int> budgets{0};
+  budgets.insert(budgets.end(), batchPhonemes.begin(), batchPhonemes.end());
+
+  double sequentialSeconds = 0;
+  for (int budget : budgets) {
+    config.maxBatchPhonemes = budget;
+    audioBuffer.clear();
+    result = SynthesisResult{};
+
+    auto startTime = std::chrono::steady_clock::now();
+    textToAudio(config, voice, text, audioBuffer, result, NULL);
+    auto endTime = std::chrono::steady_clock::now();
+
+    double wallSeconds =
+        std::chrono::duration<double>(endTime - startTime).count();
+    if (budget == 0) {
+      sequentialSeconds = wallSeconds;
+    }
+
+    spdlog::info("Batches of up to {} phoneme(s): {} second(s) of audio in {} "
+                 "second(s) wall, real-time factor {}, speedup {}",
+                 budget, result.audioSeconds, wallSeconds,
+                 result.audioSeconds > 0 ? wallSeconds / result.audioSeconds
+                                         : 0.0,
+                 wallSeconds > 0 ? sequentialSeconds / wallSeconds : 0.0);
+  }
+
+  config.maxBatchPhonemes = savedBatchPhonemes;
+} /* benchmarkBatching */
+
+// Allocations per model run of the phonemized text, synthesized rounds
+// times. The first round grows piper's buffers and onnxruntime's arena. The
+// rounds after are compared with the same runs made on the session directly,
+// which is onnxruntime's own share: piper should add nothing to it. False if
+// it does.
+bool test_inference_allocations(Voice &voice, const std::string &text,
+                                int rounds) {
+  std::vector<std::vector<Phoneme>> phonemes;
+  phonemize(voice, text, phonemes);
+
+  PhonemeIdConfig idConfig;
+  idConfig.phonemeIdTable =
+      std::make_shared<PhonemeIdTable>(voice.phonemizeConfig.phonemeIdMap);
+
+  std::vector<std::vector<PhonemeId>> phrases;
+  std::map<Phoneme, std::size_t> missingPhonemes;
+  for (auto &sentencePhonemes : phonemes) {
+    phrases.emplace_back();
+    phonemes_to_ids(sentencePhonemes, idConfig, phrases.back(),
+                    missingPhonemes);
+  }
+
+  if (phrases.empty() || (rounds < 2)) {
+    return true;
+  }
+
+  SynthesisConfig &synthesisConfig = voice.synthesisConfig;
+  std::vector<int16_t> audioBuffer;
+  std::size_t firstRound = 0;
+  std::size_t piperRounds = 0;
+
+  for (int round = 0; round < rounds; round++) {
+    const std::size_t before = allocations;
+
+    for (auto &phonemeIds : phrases) {
+      SynthesisResult result{};
+      audioBuffer.clear();
+
+      countAllocations = true;
+      synthesize(phonemeIds, synthesisConfig, voice.session, audioBuffer,
+                 result);
+      countAllocations = false;
+    }
+
+    if (round == 0) {
+      firstRound = allocations - before;
+    } else {
+      piperRounds += allocations - before;
+    }
+  }
+
+  // The same runs without piper, inputs padded as piper pads them
+  auto memoryInfo = Ort::MemoryInfo::CreateCpu(
+      OrtAllocatorType::OrtArenaAllocator, OrtMemType::OrtMemTypeDefault);
+  const char *inputNames[] = {"input", "input_lengths", "scales", "sid"};
+  const char *outputNames[] = {"output"};
+  std::array<float, 3> scales = {synthesisConfig.noiseScale,
+                                 synthesisConfig.lengthScale,
+                                 synthesisConfig.noiseW};
+  int64_t speakerId = synthesisConfig.speakerId.value_or(0);
+  const int64_t singleShape = 1;
+  const int64_t scalesShape = 3;
+  std::size_t onnxRounds = 0;
+
+  for (int round = 1; round < rounds; round++) {
+    for (auto &phonemeIds : phrases) {
+      std::vector<int64_t> ids(phonemeIds.begin(), phonemeIds.end());
+      ids.resize((ids.size() + 31) / 32 * 32, 0);
+      int64_t length = (int64_t)phonemeIds.size();
+      const int64_t idsShape[2] = {1, (int64_t)ids.size()};
+
+      std::array<Ort::Value, 4> inputs = {
+          Ort::Value::CreateTensor<int64_t>(memoryInfo, ids.data(), ids.size(),
+                                            idsShape, 2),
+          Ort::Value::CreateTensor<int64_t>(memoryInfo, &length, 1,
+                                            &singleShape, 1),
+          Ort::Value::CreateTensor<float>(memoryInfo, scales.data(),
+                                          scales.size(), &scalesShape, 1),
+          Ort::Value::CreateTensor<int64_t>(memoryInfo, &speakerId, 1,
+                                            &singleShape, 1)};
+      Ort::Value output{nullptr};
+
+      const std::size_t before = allocations;
+      countAllocations = true;
+      voice.session.onnx.Run(Ort::RunOptions{nullptr}, inputNames,
+                             inputs.data(), synthesisConfig.speakerId ? 4 : 3,
+                             outputNames, &output, 1);
+      output = Ort::Value{nullptr};
+      countAllocations = false;
+      onnxRounds += allocations - before;
+    }
+  }
+
+  const double runs = (double)(rounds - 1) * phrases.size();
+  const double piperPerRun = piperRounds / runs;
+  const double onnxPerRun = onnxRounds / runs;
+
+  spdlog::info("{}: {} allocation(s) per run in the first round, {} in the "
+               "{} round(s) after, {} of them onnxruntime's",
+               __func__, (double)firstRound / phrases.size(), piperPerRun,
+               rounds - 1, onnxPerRun);
+
+  // onnxruntime's count varies a little between runs
+  return piperPerRun < onnxPerRun + 1.0;
+} /* test_inference_allocations */
+
+void printUsage(const char *program) {
+  std::fprintf(
+      stderr,
+      "usage: %s <voice.onnx> [options] [text]\n"
+      "\n"
+      "options:\n"
+      "  --allocations N         allocations per model run over N rounds\n"
+      "  --batching N,M,...      batches of up to N, M, ... phonemes\n"
+      "  --espeak-data DIR       espeak-ng data (default: espeak-ng-data)\n"
+      "  --intra-op-threads N    onnxruntime threads per voice session\n"
+      "  --model-load            load time per optimization level and arena\n"
+      "  --phoneme-ids N         phonemes_to_ids of the text N times\n"
+      "  --workers N             textToAudio with 1 to N synthesis workers\n",
+      program);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  PiperConfig config;
+  config.eSpeakDataPath = "espeak-ng-data";
+
+  const std::string modelPath = argv[1];
+  std::string text = DEFAULT_TEXT;
+  int maxWorkers = 0;
+  int allocationRounds = 0;
+  std::vector<int> batchPhonemes;
+  bool modelLoad = false;
+  int phonemeIdRounds = 0;
+
+  for (int i = 2; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool hasValue = (i + 1 < argc);
+
+    if ((arg == "--allocations") && hasValue) {
+      allocationRounds = std::stoi(argv[++i]);
+    } else if ((arg == "--batching") && hasValue) {
+      std::stringstream budgets(argv[++i]);
+      for (std::string budget; std::getline(budgets, budget, ',');) {
+        batchPhonemes.push_back(std::stoi(budget));
+      }
+    } else if ((arg == "--espeak-data") && hasValue) {
+      config.eSpeakDataPath = argv[++i];
+    } else if ((arg == "--intra-op-threads") && hasValue) {
+      config.intraOpThreads = std::stoi(argv[++i]);
+    } else if (arg == "--model-load") {
+      modelLoad = true;
+    } else if ((arg == "--phoneme-ids") && hasValue) {
+      phonemeIdRounds = std::stoi(argv[++i]);
+    } else if ((arg == "--workers") && hasValue) {
+      maxWorkers = std::stoi(argv[++i]);
+    } else if (!arg.empty() && (arg[0] == '-')) {
+      printUsage(argv[0]);
+      return 1;
+    } else {
+      text = arg;
+    }
+  }
+
+  initialize(config);
+
+  Voice voice;
+  std::optional<SpeakerId> speakerId;
+  loadVoice(config, modelPath, modelPath + ".json", voice, speakerId, false);
+
+  if (maxWorkers > 0) {
+    benchmarkTextToAudio(config, voice, text, maxWorkers);
+  }
+
+  if (!batchPhonemes.empty()) {
+    benchmarkBatching(config, voice, text, batchPhonemes);
+  }
+
+  if (phonemeIdRounds > 0) {
+    benchmarkPhonemeIds(voice, text, phonemeIdRounds);
+  }
+
+  if (modelLoad) {
+    benchmarkModelLoad(config, modelPath, modelPath + ".json", text);
+  }
+
+  bool passed = true;
+  if (allocationRounds > 0) {
+    passed = test_inference_allocations(voice, text, allocationRounds);
+  }
+
+  terminate(config);
+
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// SSE2 is part of every x86-64 CPU
+#if defined(__x86_64__) || defined(_M_X64)
+#define PIPER_X86 1
+#include <immintrin.h>
+#endif
+
+// AVX2 kernels need per-function targets, which MSVC does not have
+#if defined(PIPER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PIPER_AVX2 1
+#define PIPER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "sample_convert.hpp"
+
+namespace piper {
+
+static const float INT16_MIN_F = (float)std::numeric_limits<int16_t>::min();
+static const float INT16_MAX_F = (float)std::numeric_limits<int16_t>::max();
+
+// ----------------------------------------------------------------------------
+// Scalar, also used for the tails of the vector loops
+
+static float peakScalar(const float *samples, std::size_t count,
+                        float peak) {
+  for (std::size_t i = 0; i < count; i++) {
+    peak = std::max(peak, std::fabs(samples[i]));
+  }
+
+  return peak;
+}
+
+static void toInt16Scalar(const float *samples, std::size_t count,
+                          float scale, int16_t *out) {
+  for (std::size_t i = 0; i < count; i++) {
+    out[i] = static_cast<int16_t>(
+        std::clamp(samples[i] * scale, INT16_MIN_F, INT16_MAX_F));
+  }
+}
+
+static void toFloatScalar(const float *samples, std::size_t count,
+                          float scale, float *out) {
+  for (std::size_t i = 0; i < count; i++) {
+    out[i] = samples[i] * scale;
+  }
+}
+
+#ifdef PIPER_X86
+
+// ----------------------------------------------------------------------------
+// SSE2
+
+static float peakSse2(const float *samples, std::size_t count, float floor) {
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 peak0 = _mm_set1_ps(floor);
+  __m128 peak1 = peak0;
+
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    peak0 = _mm_max_ps(peak0, _mm_and_ps(_mm_loadu_ps(samples + i), absMask));
+    peak1 =
+        _mm_max_ps(peak1, _mm_and_ps(_mm_loadu_ps(samples + i + 4), absMask));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_max_ps(peak0, peak1));
+  float peak = std::max(std::max(lanes[0], lanes[1]),
+                        std::max(lanes[2], lanes[3]));
+
+  return peakScalar(samples + i, count - i, peak);
+}
+
+static void toInt16Sse2(const float *samples, std::size_t count, float scale,
+                        int16_t *out) {
+  const __m128 factor = _mm_set1_ps(scale);
+  const __m128 low = _mm_set1_ps(INT16_MIN_F);
+  const __m128 high = _mm_set1_ps(INT16_MAX_F);
+
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(samples + i), factor);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(samples + i + 4), factor);
+    a = _mm_min_ps(_mm_max_ps(a, low), high);
+    b = _mm_min_ps(_mm_max_ps(b, low), high);
+
+    // Truncating like the cast, the pack cannot saturate after the clamp
+    __m128i packed = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+    _mm_storeu_si128((__m128i *)(out + i), packed);
+  }
+
+  toInt16Scalar(samples + i, count - i, scale, out + i);
+}
+
+static void toFloatSse2(const float *samples, std::size_t count, float scale,
+                        float *out) {
+  const __m128 factor = _mm_set1_ps(scale);
+
+  std::size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(samples + i), factor));
+  }
+
+  toFloatScalar(samples + i, count - i, scale, out + i);
+}
+
+#endif // PIPER_X86
+
+#ifdef PIPER_AVX2
+
+// ----------------------------------------------------------------------------
+// AVX2
+
+PIPER_TARGET_AVX2
+static float peakAvx2(const float *samples, std::size_t count, float floor) {
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  __m256 peak0 = _mm256_set1_ps(floor);
+  __m256 peak1 = peak0;
+
+  std::size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    peak0 = _mm256_max_ps(
+        peak0, _mm256_and_ps(_mm256_loadu_ps(samples + i), absMask));
+    peak1 = _mm256_max_ps(
+        peak1, _mm256_and_ps(_mm256_loadu_ps(samples + i + 8), absMask));
+  }
+
+  __m256 peak8 = _mm256_max_ps(peak0, peak1);
+  __m128 peak4 = _mm_max_ps(_mm256_castps256_ps128(peak8),
+                            _mm256_extractf128_ps(peak8, 1));
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, peak4);
+  float peak = std::max(std::max(lanes[0], lanes[1]),
+                        std::max(lanes[2], lanes[3]));
+
+  return peakScalar(samples + i, count - i, peak);
+}
+
+PIPER_TARGET_AVX2
+static void toInt16Avx2(const float *samples, std::size_t count, float scale,
+                        int16_t *out) {
+  const __m256 factor = _mm256_set1_ps(scale);
+  const __m256 low = _mm256_set1_ps(INT16_MIN_F);
+  const __m256 high = _mm256_set1_ps(INT16_MAX_F);
+
+  std::size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_mul_ps(_mm256_loadu_ps(samples + i), factor);
+    __m256 b = _mm256_mul_ps(_mm256_loadu_ps(samples + i + 8), factor);
+    a = _mm256_min_ps(_mm256_max_ps(a, low), high);
+    b = _mm256_min_ps(_mm256_max_ps(b, low), high);
+
+    // The pack works per 128 bit lane, the permute puts the quarters back
+    // in order
+    __m256i packed =
+        _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+
+  toInt16Sse2(samples + i, count - i, scale, out + i);
+}
+
+PIPER_TARGET_AVX2
+static void toFloatAvx2(const float *samples, std::size_t count, float scale,
+                        float *out) {
+  const __m256 factor = _mm256_set1_ps(scale);
+
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(out + i,
+                     _mm256_mul_ps(_mm256_loadu_ps(samples + i), factor));
+  }
+
+  toFloatScalar(samples + i, count - i, scale, out + i);
+}
+
+#endif // PIPER_AVX2
+
+// ----------------------------------------------------------------------------
+
+namespace {
+
+struct Kernels {
+  float (*peak)(const float *, std::size_t, float);
+  void (*toInt16)(const float *, std::size_t, float, int16_t *);
+  void (*toFloat)(const float *, std::size_t, float, float *);
+  const char *isa;
+};
+
+Kernels selectKernels() {
+#ifdef PIPER_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return {peakAvx2, toInt16Avx2, toFloatAvx2, "avx2"};
+  }
+#endif
+
+#ifdef PIPER_X86
+  return {peakSse2, toInt16Sse2, toFloatSse2, "sse2"};
+#else
+  return {peakScalar, toInt16Scalar, toFloatScalar, "scalar"};
+#endif
+}
+
+const Kernels &kernels() {
+  static const Kernels selected = selectKernels();
+  return selected;
+}
+
+} // namespace
+
+float peak_abs(const float *samples, std::size_t count, float floor) {
+  return kernels().peak(samples, count, floor);
+}
+
+void scale_to_int16(const float *samples, std::size_t count, float scale,
+                    int16_t *out) {
+  kernels().toInt16(samples, count, scale, out);
+}
+
+void scale_to_float(const float *samples, std::size_t count, float scale,
+                    float *out) {
+  kernels().toFloat(samples, count, scale, out);
+}
+
+void int16_to_float(const int16_t *samples, std::size_t count, float *out) {
+  // Only for cached audio, the compiler vectorizes it well enough
+  for (std::size_t i = 0; i < count; i++) {
+    out[i] = samples[i] * (1.0f / 32768.0f);
+  }
+}
+
+const char *sample_convert_isa() { return kernels().isa; }
+
+} // namespace piper
@@ -0,0 +1,32 @@
+#ifndef SAMPLE_CONVERT_H_
+#define SAMPLE_CONVERT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace piper {
+
+// Post-processing of the model output. On x86-64 these use AVX2 when the CPU
+// has it (checked once at run time) and SSE2 otherwise, other targets get
+// the scalar loops.
+
+// Largest absolute sample value, at least floor
+float peak_abs(const float *samples, std::size_t count, float floor);
+
+// samples * scale, clamped to the int16 range and truncated toward zero
+void scale_to_int16(const float *samples, std::size_t count, float scale,
+                    int16_t *out);
+
+// samples * scale, without clamping
+void scale_to_float(const float *samples, std::size_t count, float scale,
+                    float *out);
+
+// int16 samples in [-1, 1)
+void int16_to_float(const int16_t *samples, std::size_t count, float *out);
+
+// Name of the implementation in use, for logs
+const char *sample_convert_isa();
+
+} // namespace piper
+
+#endif // SAMPLE_CONVERT_H_
@@ -0,0 +1,180 @@
+#include "qualitygovernor.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+constexpr size_t  WindowSize = 50;
+// turns at a level before it is judged
+constexpr size_t  MinSamples = 5;
+// turns below the headroom before stepping back up
+constexpr size_t  RecoverySamples = 10;
+// p95 below this share of the SLO is headroom
+constexpr double  Headroom = 0.6;
+}
+
+QualityGovernor::QualityGovernor(QObject *parent):
+    QObject(parent)
+{
+}
+
+void  QualityGovernor::setSloMs(qint64 ms)
+{
+    m_sloMs = ms;
+}
+
+void  QualityGovernor::record(Stage stage, qint64 ms)
+{
+    auto &samples = m_samples[stage];
+
+    samples.push_back(ms);
+
+    if (samples.size() > WindowSize)
+    {
+        samples.pop_front();
+    }
+
+    if (stage == EndToEnd)
+    {
+        m_sinceChange.push_back(ms);
+
+        if (m_sinceChange.size() > WindowSize)
+        {
+            m_sinceChange.pop_front();
+        }
+
+        evaluate();
+    }
+}
+
+qint64  QualityGovernor::percentile(Stage stage, double p) const
+{
+    return percentile(m_samples[stage], p);
+}
+
+int  QualityGovernor::level() const
+{
+    return m_level;
+}
+
+QualityGovernor::Level  QualityGovernor::settings(int level)
+{
+    Level  l = { false, false, -1, 1.0f, false };
+
+    if (level >= 1)
+    {
+        l.whisperFast = true;
+    }
+
+    if (level >= 2)
+    {
+        l.answerTokens = 192;
+        l.lengthScale  = 0.9f;
+    }
+
+    if (level >= 3)
+    {
+        l.whisperSmall = true;
+        l.answerTokens = 96;
+    }
+
+    if (level >= 4)
+    {
+        l.lowQualityVoice = true;
+        l.lengthScale     = 0.8f;
+    }
+
+    return l;
+}
+
+const char * QualityGovernor::stageName(Stage stage)
+{
+    switch (stage)
+    {
+    case Transcription:
+        return "transcription";
+    case Generation:
+        return "generation";
+    case Synthesis:
+        return "synthesis";
+    case EndToEnd:
+        return "end-to-end";
+    default:
+        return "?";
+    }
+}
+
+void  QualityGovernor::evaluate()
+{
+    const qint64  last = m_sinceChange.back();
+
+    // one turn at twice the SLO does not wait for the percentiles
+    if ((last > 2 * m_sloMs) && (m_level < MaxLevel))
+    {
+        setLevel(m_level + 1, QString("last turn took %1 ms, over twice the %2 ms SLO").arg(last).arg(m_sloMs));
+
+        return;
+    }
+
+    if (m_sinceChange.size() < MinSamples)
+    {
+        return;
+    }
+
+    const qint64  p95 = percentile(m_sinceChange, 0.95);
+
+    if ((p95 > m_sloMs) && (m_level < MaxLevel))
+    {
+        setLevel(m_level + 1, QString("end-to-end p95 %1 ms over the %2 ms SLO").arg(p95).arg(m_sloMs));
+    }
+    else if ((p95 < Headroom * m_sloMs) && (m_level > 0) && (m_sinceChange.size() >= RecoverySamples))
+    {
+        setLevel(m_level - 1, QString("end-to-end p95 %1 ms leaves headroom under the %2 ms SLO").arg(p95).arg(m_sloMs));
+    }
+}
+
+void  QualityGovernor::setLevel(int level, const QString &reason)
+{
+    qDebug().noquote() << "quality level" << m_level << "->" << level << ":" << reason << "|" << summary();
+
+    m_level = level;
+    m_sinceChange.clear();
+
+    emit  levelChanged(level, reason);
+}
+
+QString  QualityGovernor::summary() const
+{
+    QString  text;
+
+    for (int stage = 0; stage < StageCount; ++stage)
+    {
+        if (m_samples[stage].empty())
+        {
+            continue;
+        }
+
+        text += QString("%1 p50 %2 p95 %3 ms; ").arg(stageName(Stage(stage)))
+                .arg(percentile(Stage(stage), 0.5)).arg(percentile(Stage(stage), 0.95));
+    }
+
+    return text;
+}
+
+qint64  QualityGovernor::percentile(const std::deque<qint64> &samples, double p)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+
+    std::vector<qint64>  sorted(samples.begin(), samples.end());
+    const size_t         k = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+
+    return sorted[k];
+}
@@ -0,0 +1,82 @@
+#ifndef QUALITYGOVERNOR_H
+#define QUALITYGOVERNOR_H
+
+#include <QObject>
+#include <QString>
+
+#include <deque>
+
+// Holds the voice response latency to a service level objective by trading
+// quality for speed. Stage and end-to-end latencies are recorded after every
+// turn; when the 95th percentile of the end-to-end latency goes over the SLO
+// the governor steps one level down, when it stays well below for a while it
+// steps back up. Each level adds to the ones before it:
+//
+//   1  Whisper: greedy only (no temperature fallback), encoder window fitted
+//      to the utterance instead of 30 s
+//   2  answers limited to 192 tokens, speech 10% faster
+//   3  the smaller Whisper model, answers limited to 96 tokens
+//   4  the lower quality piper voice, speech 20% faster
+//
+// Every change is logged with the percentiles that caused it.
+class QualityGovernor: public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Stage
+    {
+        Transcription,     // end of speech to transcript
+        Generation,        // question submitted to answer
+        Synthesis,         // answer to audio
+        EndToEnd,          // end of speech (or submit) to audio
+        StageCount
+    };
+
+    struct Level
+    {
+        bool   whisperFast;
+        bool   whisperSmall;
+        int    answerTokens;       // -1 if unlimited
+        float  lengthScale;        // factor on the voice's own
+        bool   lowQualityVoice;
+    };
+
+    static constexpr int  MaxLevel = 4;
+
+    explicit QualityGovernor(QObject *parent = nullptr);
+
+    // 95th percentile target of the end-to-end latency.
+    void          setSloMs(qint64 ms);
+
+    // A turn's stage latency, EndToEnd last as it triggers the decision.
+    void          record(Stage stage, qint64 ms);
+
+    qint64        percentile(Stage stage, double p) const;
+
+    int           level() const;
+
+    static Level  settings(int level);
+
+    static const char * stageName(Stage stage);
+
+signals:
+    void  levelChanged(int level, const QString &reason);
+
+private:
+    void     evaluate();
+
+    void     setLevel(int level, const QString &reason);
+
+    QString  summary() const;
+
+    static qint64  percentile(const std::deque<qint64> &samples, double p);
+
+private:
+    std::deque<qint64>  m_samples[StageCount]; // recent turns per stage
+    std::deque<qint64>  m_sinceChange;         // end-to-end at the current level
+    qint64              m_sloMs = 4000;
+    int                 m_level = 0;
+};
+
+#endif // QUALITYGOVERNOR_H
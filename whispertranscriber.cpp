@@ -17,6 +17,12 @@ WhisperTranscriber::~WhisperTranscriber()
         whisper_free(m_context);  // Free Whisper context when cleaning up
         m_context = nullptr;
     }
+
+    if (m_smallContext)
+    {
+        whisper_free(m_smallContext);
+        m_smallContext = nullptr;
+    }
 }
 
 bool  WhisperTranscriber::initialize(const QString &modelPath, const QString &languag)
@@ -59,9 +65,38 @@ bool  WhisperTranscriber::initialize(const QString &modelPath, const QString &la
         return false;
     }
 
+    m_active = m_context;
+
     return true;
 }
 
+void  WhisperTranscriber::setSmallModel(const QString &modelPath)
+{
+    m_smallModelPath = modelPath;
+}
+
+void  WhisperTranscriber::setQuality(bool fast, bool small)
+{
+    m_fast = fast;
+
+    if (small && !m_smallContext && QFile::exists(m_smallModelPath))
+    {
+        struct whisper_context_params  cparams = whisper_context_default_params();
+
+        cparams.use_gpu    = m_params->use_gpu;
+        cparams.flash_attn = m_params->flash_attn;
+
+        m_smallContext = whisper_init_from_file_with_params(m_smallModelPath.toStdString().c_str(), cparams);
+    }
+
+    if (small && !m_smallContext)
+    {
+        qWarning() << "Small Whisper model not available:" << m_smallModelPath;
+    }
+
+    m_active = (small && m_smallContext) ? m_smallContext : m_context;
+}
+
 // void  WhisperTranscriber::transcribeAudio(const QString &audioFilePath)
 // {
 // std::string  wavfile = audioFilePath.toStdString();
@@ -93,15 +128,83 @@ void  WhisperTranscriber::transcribeAudio(std::vector<float> pcmf32)
     fprintf(stderr, "\nProcessing audio (%d samples, %.1f sec) ...\n",
             int(pcmf32.size()), float(pcmf32.size()) / WHISPER_SAMPLE_RATE);
 
-    // if (m_params->language == "auto")
-    // {
-    // std::vector<float>  probs(whisper_lang_max_id() + 1, 0.0f);
-    // auto                lang_id      = whisper_lang_auto_detect(m_context, 0, m_params->n_threads, probs.data());
-    // auto                detectedLang = whisper_lang_str(lang_id);
+    if (!m_active)
+    {
+        return;
+    }
+
+    // detected before whisper_full, which then skips its own detection
+    float        probability = 1.0f;
+    std::string  language    = m_params->language;
+
+    if (language == "auto")
+    {
+        language = detectLanguage(pcmf32, probability);
+    }
+
+    QString  result;
+
+    if (!transcribe(pcmf32, false, language, result))
+    {
+        return;
+    }
+
+    auto  id       = whisper_full_lang_id(m_active);
+    auto  langCode = whisper_lang_str(id);
+    auto  langFull = whisper_lang_str_full(id);
+
+    // Emit signal when transcription is done
+    // whisper_lang_str_full()
+    emit  transcriptionCompleted(result, QPair<QString, QString>(QString::fromStdString(langCode), QString::fromStdString(langFull)), probability);
+}
+
+void  WhisperTranscriber::transcribePartial(std::vector<float> pcmf32, bool endOfSpeech)
+{
+    QString  result;
+
+    if (m_active && transcribe(pcmf32, true, m_params->language, result))
+    {
+        emit  partialTranscription(result, endOfSpeech);
+    }
+}
+
+bool  WhisperTranscriber::isBusy() const
+{
+    return m_busy;
+}
+
+std::string  WhisperTranscriber::detectLanguage(const std::vector<float> &pcmf32, float &probability)
+{
+    probability = 0.0f;
+    m_busy      = true;
+
+    std::vector<float>  probs(whisper_lang_max_id() + 1, 0.0f);
+    int                 id = -1;
+
+    if (whisper_pcm_to_mel(m_active, pcmf32.data(), pcmf32.size(), m_params->n_threads) == 0)
+    {
+        id = whisper_lang_auto_detect(m_active, 0, m_params->n_threads, probs.data());
+    }
+
+    if (id < 0)
+    {
+        // whisper_full detects it again, without a probability
+        return "auto";
+    }
+
+    probability = probs[id];
+
+    return whisper_lang_str(id);
+}
 
-    // std::cout << "detected lang: " << detectedLang << std::endl;
-    // m_params->language = std::string(whisper_lang_str(lang_id));
-    // }
+bool  WhisperTranscriber::transcribe(const std::vector<float> &pcmf32, bool partial, const std::string &language, QString &text)
+{
+    if (!m_active)
+    {
+        return false;
+    }
+
+    m_busy = true;
 
     // ─────────────────────────────────────────────────────────────
     // Set up whisper processing parameters
@@ -109,43 +212,52 @@ void  WhisperTranscriber::transcribeAudio(std::vector<float> pcmf32)
 
     wparams.n_threads        = m_params->n_threads;
     wparams.translate        = m_params->translate;
-    wparams.language         = m_params->language.c_str();
+    wparams.language         = language.c_str();
     wparams.offset_ms        = m_params->offset_t_ms;
     wparams.duration_ms      = m_params->duration_ms;
-    wparams.print_timestamps = true;  // change to false if you don’t want time info
+    wparams.print_timestamps = !partial;  // change to false if you don’t want time info
     // You can customize additional parameters (temperature, beam size, etc.) if needed
 
+    if (partial)
+    {
+        // only used to prefill the LLM, speed over accuracy
+        wparams.single_segment  = true;
+        wparams.no_timestamps   = true;
+        wparams.temperature_inc = 0.0f;
+        wparams.print_progress  = false;
+        wparams.print_realtime  = false;
+    }
+
+    if (partial || m_fast)
+    {
+        // 50 encoder frames per second of audio instead of 30 s of them
+        wparams.temperature_inc = 0.0f;
+        wparams.audio_ctx       = std::min<int>(1500, pcmf32.size() * 50 / WHISPER_SAMPLE_RATE + 64);
+    }
+
     // ─────────────────────────────────────────────────────────────
     // Run the inference using the full (parallel) runner
-    if (whisper_full_parallel(m_context, wparams, pcmf32.data(), pcmf32.size(), m_params->n_processors) != 0)
+    const int  status = whisper_full_parallel(m_active, wparams, pcmf32.data(), pcmf32.size(), m_params->n_processors);
+
+    m_busy = false;
+
+    if (status != 0)
     {
         fprintf(stderr, "error: failed to process audio\n");
 
-        return;
+        return false;
     }
 
-    QString    result;
-    const int  n_segments = whisper_full_n_segments(m_context);
+    const int  n_segments = whisper_full_n_segments(m_active);
 
-    if (n_segments > 0)
+    for (int i = 0; i < n_segments; i++)
     {
-        for (int i = 0; i < n_segments; i++)
-        {
-            // Optionally, you can also get the timestamps by:
-            // int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            // int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-            // printf("[%s --> %s] ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
-            result += whisper_full_get_segment_text(m_context, i);
-        }
-
-        auto  id       = whisper_full_lang_id(m_context);
-        auto  langCode = whisper_lang_str(id);
-        auto  langFull = whisper_lang_str_full(id);
-
-        // Emit signal when transcription is done
-        // whisper_lang_str_full()
-        emit  transcriptionCompleted(result, QPair<QString, QString>(QString::fromStdString(langCode), QString::fromStdString(langFull)));
+        // Optionally, you can also get the timestamps by:
+        // int64_t t0 = whisper_full_get_segment_t0(ctx, i);
+        // int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+        // printf("[%s --> %s] ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
+        text += whisper_full_get_segment_text(m_active, i);
     }
 
-    return;
+    return n_segments > 0;
 }
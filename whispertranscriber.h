@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QString>
 #include "whisper.h"  // Include the header file for whisper.cpp
+#include <atomic>
 #include <string>
 #include <thread>
 
@@ -16,23 +17,50 @@ public:
 
     ~WhisperTranscriber();
 
-    // Initialize the Whisper model
+    // Initialize the Whisper model, languag "auto" detects the spoken language
     bool  initialize(const QString &modelPath, const QString &languag);
 
     // Asynchronously transcribe audio file
     // void  transcribeAudio(const QString &audioFilePath);
 
+    // A transcription is running, safe to call from any thread.
+    bool  isBusy() const;
+
+    // Smaller model for setQuality(), loaded when it is first needed.
+    void  setSmallModel(const QString &modelPath);
+
 public slots:
     // Asynchronously transcribe audio data
     void  transcribeAudio(std::vector<float> pcmf32);
 
+    // Quick single segment transcription of an utterance that may still go on
+    void  transcribePartial(std::vector<float> pcmf32, bool endOfSpeech);
+
+    // fast: greedy only, without the temperature fallback, and an encoder
+    // window fitted to the audio. small: use the small model.
+    void  setQuality(bool fast, bool small);
+
 signals:
-    // Signal emitted when transcription is done containing transcipted text and detected language code and detected language full name
-    void  transcriptionCompleted(const QString &text, QPair<QString, QString> language);
+    // Signal emitted when transcription is done containing transcipted text and detected language code and detected language full name.
+    // languageProbability is whisper's confidence in a detected language, 1 when the language is fixed.
+    void  transcriptionCompleted(const QString &text, QPair<QString, QString> language, float languageProbability);
+
+    void  partialTranscription(const QString &text, bool endOfSpeech);
+
+private:
+    bool  transcribe(const std::vector<float> &pcmf32, bool partial, const std::string &language, QString &text);
+
+    // Spoken language code and its probability, "auto" if it cannot be detected
+    std::string  detectLanguage(const std::vector<float> &pcmf32, float &probability);
 
 private:
     struct whisper_context *m_context;  // Whisper context
+    struct whisper_context *m_smallContext = nullptr;
+    struct whisper_context *m_active       = nullptr; // one of the two above
     struct whisper_params  *m_params;
+    QString                 m_smallModelPath;
+    bool                    m_fast = false;
+    std::atomic<bool>       m_busy { false };
 };
 
 